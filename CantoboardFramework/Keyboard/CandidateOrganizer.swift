@@ -50,12 +50,15 @@ class InputEngineCandidateSource: CandidateSource {
     private var curRimeCandidateIndex = 0, curEnglishCandidateIndex = 0
     private var hasLoadedAllBestRimeCandidates = false
     private var hasPopulatedBestEnglishCandidates = false, hasPopulatedWorstEnglishCandidates = false
+    private var hasRerankedFirstPage = false
     private weak var inputController: InputController?
+    private let contextualReranker: ContextualCandidateReranker?
     
     var isStatic: Bool { false }
     
-    init(inputController: InputController) {
+    init(inputController: InputController, contextualReranker: ContextualCandidateReranker? = nil) {
         self.inputController = inputController
+        self.contextualReranker = contextualReranker
     }
     
     private func resetCandidates() {
@@ -68,6 +71,7 @@ class InputEngineCandidateSource: CandidateSource {
         hasLoadedAllBestRimeCandidates = false
         hasPopulatedBestEnglishCandidates = false
         hasPopulatedWorstEnglishCandidates = false
+        hasRerankedFirstPage = false
     }
     
     private func populateCandidates() {
@@ -158,6 +162,28 @@ class InputEngineCandidateSource: CandidateSource {
         candidatePaths[0] = sortedCandidatePaths
     }
     
+    // Reorders the first page of Rime candidates by how likely they follow the text before the input.
+    // Runs once per candidate list, so loading more candidates never moves the ones already shown.
+    private func rerankFirstPageByContext() {
+        hasRerankedFirstPage = true
+        guard let contextualReranker = contextualReranker,
+              let inputEngine = inputController?.inputEngine,
+              let firstSection = candidatePaths.first,
+              // The fixed order replaces Rime's order on purpose, keep it.
+              !(inputEngine.rimeSchema == .quick3 && Settings.cached.quick3CandidateMode == .fixedOrder) else { return }
+        
+        let slots = firstSection.prefix(ContextualCandidateReranker.firstPageSize).indices.filter { firstSection[$0].source == .rime }
+        let candidates = slots.compactMap { inputEngine.getRimeCandidate(firstSection[$0].index) }
+        guard candidates.count == slots.count,
+              let order = contextualReranker.rank(candidates) else { return }
+        
+        var rerankedSection = firstSection
+        for (slot, candidateIndex) in zip(slots, order) {
+            rerankedSection[slot] = firstSection[slots[candidateIndex]]
+        }
+        candidatePaths[0] = rerankedSection
+    }
+    
     private func populateCandidatesByFreq() {
         guard let inputController = inputController,
               let inputEngine = inputController.inputEngine else { return }
@@ -454,6 +480,10 @@ class InputEngineCandidateSource: CandidateSource {
             _ = inputEngine.loadMoreRimeCandidates()
             populateCandidates()
         } while inputEngine.rimeLoadedCandidatesCount < targetCandidatesCount && !inputEngine.hasRimeLoadedAllCandidates
+        
+        if groupByMode == .byFrequency && !hasRerankedFirstPage {
+            rerankFirstPageByContext()
+        }
     }
 
     func getNumberOfSections() -> Int {
@@ -584,6 +614,36 @@ class AutoSuggestionCandidateSource: CandidateSource {
     var groupByMode: GroupByMode = .byFrequency
 }
 
+// Ranks Rime candidates by how likely the ngram model thinks they follow the text before the input.
+struct ContextualCandidateReranker {
+    // Candidates past the first page are rarely looked at, scoring them is not worth the time.
+    static let firstPageSize = 10
+    // Scoring runs on the main thread while the candidates are about to be shown. Past this, Rime's order is kept.
+    static let timeBudget: TimeInterval = 0.0005
+    
+    let engine: PredictiveTextEngine
+    let contextualText: String
+    
+    // Returns a permutation of the candidate indices. The first candidate, Rime's best match for the whole input, keeps
+    // the first slot. Other candidates the model knows are sorted by score among the slots they occupy, the rest keep
+    // their slots. Returns nil if the scores did not arrive within timeBudget.
+    func rank(_ candidates: [String]) -> [Int]? {
+        // With the first slot fixed, there is nothing to reorder in fewer than 3 candidates.
+        guard candidates.count > 2,
+              let scores = engine.scoreContinuations(contextualText, candidates: candidates, timeBudget: Self.timeBudget)?.map({ $0.floatValue }),
+              scores.count == candidates.count else { return nil }
+        
+        let scoredIndices = candidates.indices.dropFirst().filter { scores[$0].isFinite }
+        // Ties keep Rime's order.
+        let rankedIndices = scoredIndices.sorted { scores[$0] > scores[$1] || scores[$0] == scores[$1] && $0 < $1 }
+        var order = Array(candidates.indices)
+        for (slot, candidateIndex) in zip(scoredIndices, rankedIndices) {
+            order[slot] = candidateIndex
+        }
+        return order
+    }
+}
+
 struct CandidatePath {
     enum Source {
         case english, rime
@@ -607,22 +667,68 @@ enum AutoSuggestionType {
     }
 }
 
+// Opens the engine of a char form on first use. Engines unmap their ngram file after idling for idleUnloadDelay or on
+// memory warnings, and map it again on the next prediction, so callers can keep their references. Main thread only.
+class PredictiveTextEngineRegistry {
+    static let shared = PredictiveTextEngineRegistry()
+    
+    var idleUnloadDelay: TimeInterval = 120 {
+        didSet { scheduleIdleCheck() }
+    }
+    private var engines: [CharForm: PredictiveTextEngine] = [:]
+    private var idleCheckTimer: Timer?
+    
+    func getEngine(charForm: CharForm) -> PredictiveTextEngine {
+        if let engine = engines[charForm] { return engine }
+        let engine = PredictiveTextEngine.initPredictiveTextEngine(charForm: charForm)
+        engines[charForm] = engine
+        if idleCheckTimer == nil { scheduleIdleCheck() }
+        return engine
+    }
+    
+    func unloadIdleEngines() {
+        for engine in engines.values where engine.isLoaded && engine.idleTime >= idleUnloadDelay {
+            engine.unload()
+        }
+    }
+    
+    func unloadAllEngines() {
+        for engine in engines.values where engine.isLoaded {
+            engine.unload()
+        }
+        DDLogInfo("Unloaded predictive text engines. Loads: \(numOfLoads) unloads: \(numOfUnloads) load time: \(totalLoadTime)s")
+    }
+    
+    var numOfLoads: Int { engines.values.reduce(0) { $0 + Int($1.numOfLoads) } }
+    var numOfUnloads: Int { engines.values.reduce(0) { $0 + Int($1.numOfUnloads) } }
+    var totalLoadTime: TimeInterval { engines.values.reduce(0) { $0 + $1.totalLoadTime } }
+    
+    private func scheduleIdleCheck() {
+        idleCheckTimer?.invalidate()
+        // Checking twice per delay unloads an engine at most 1.5 delays after its last use.
+        idleCheckTimer = Timer.scheduledTimer(withTimeInterval: max(idleUnloadDelay / 2, 1), repeats: true) { [weak self] _ in
+            self?.unloadIdleEngines()
+        }
+    }
+}
+
 extension PredictiveTextEngine {
-    private static func initPredictiveTextEngine(charForm: CharForm) -> PredictiveTextEngine {
+    fileprivate static func initPredictiveTextEngine(charForm: CharForm) -> PredictiveTextEngine {
         if !DataFileManager.hasInstalled {
             fatalError("Data files not installed.")
         }
         
         let dictsPath = DataFileManager.builtInNGramDictDirectory
         let ngramFileName = charForm == .traditional ? "/zh_HK.ngram" : "/zh_CN.ngram"
-        return PredictiveTextEngine(dictsPath + ngramFileName)
+        let overlayFileName = charForm == .traditional ? "/zh_HK.ngram-overlay" : "/zh_CN.ngram-overlay"
+        let engine = PredictiveTextEngine(dictsPath + ngramFileName, overlayFilePath: DataFileManager.userDataDirectory + overlayFileName)
+        // The hot sections of the ngram file are a few hundred KB. Faulting them in up front keeps page faults off the first predictions.
+        engine.residencyPolicy = .preTouch
+        return engine
     }
     
-    private static let hk = initPredictiveTextEngine(charForm: .traditional)
-    private static let cn = initPredictiveTextEngine(charForm: .simplified)
-    
     public static func getPredictiveTextEngine(charForm: CharForm) -> PredictiveTextEngine {
-        return charForm == .traditional ? .hk : .cn
+        return PredictiveTextEngineRegistry.shared.getEngine(charForm: charForm)
     }
 }
 
@@ -657,17 +763,21 @@ class CandidateOrganizer {
     var suggestionContextualText: String = ""
     var charForm: CharForm {
         didSet {
-            predictiveTextEngine = PredictiveTextEngine.getPredictiveTextEngine(charForm: charForm)
+            predictionSession = PredictiveTextEngine.getPredictiveTextEngine(charForm: charForm).createSession()
         }
     }
     
     private weak var inputController: InputController?
-    private var predictiveTextEngine: PredictiveTextEngine
+    // The session remembers the previous context, so predicting after committing text doesn't start from scratch.
+    private var predictionSession: PredictionSession
+    private var predictionRequestId = 0
+    // Past this, the best predictions found so far are shown rather than making the user wait.
+    private static let predictionTimeBudget: TimeInterval = 0.03
     
     init(inputController: InputController) {
         self.inputController = inputController
         charForm = inputController.inputEngine.charForm
-        predictiveTextEngine = PredictiveTextEngine.getPredictiveTextEngine(charForm: charForm)
+        predictionSession = PredictiveTextEngine.getPredictiveTextEngine(charForm: charForm).createSession()
     }
     
     func requestMoreCandidates(section: Int) {
@@ -679,10 +789,12 @@ class CandidateOrganizer {
     
     func updateCandidates(reload: Bool, targetCandidatesCount: Int = 0) {
         guard let inputController = inputController else { return }
+        // Drop any prediction still on its way, it was made for an older state.
+        predictionRequestId += 1
         if inputController.state.isInCaretMovingMode {
             candidateSource = nil
         } else if inputController.inputEngine.isComposing {
-            candidateSource = InputEngineCandidateSource(inputController: inputController)
+            candidateSource = InputEngineCandidateSource(inputController: inputController, contextualReranker: makeContextualReranker())
         } else if let autoSuggestionType = autoSuggestionType {
             switch autoSuggestionType {
             case .fullWidthPunctuation: candidateSource = Self.fullWidthPunctuationCandidateSource
@@ -693,12 +805,7 @@ class CandidateOrganizer {
             }
             
             if Settings.cached.enablePredictiveText && !suggestionContextualText.isEmpty && inputController.state.inputMode != .english {
-                let shouldFilterOffensiveWords = !Settings.cached.predictiveTextOffensiveWord
-                let predictiveCandidates = predictiveTextEngine.predict(suggestionContextualText, filterOffensiveWords: shouldFilterOffensiveWords) as NSArray as? [String]
-                if let predictiveCandidates = predictiveCandidates, !predictiveCandidates.isEmpty {
-                    // DDLogInfo("Predictive text: \(suggestionContextualText) \(predictiveCandidates)")
-                    candidateSource = AutoSuggestionCandidateSource(predictiveCandidates)
-                }
+                requestPredictiveCandidates(requestId: predictionRequestId)
             }
         } else {
             candidateSource = nil
@@ -713,6 +820,40 @@ class CandidateOrganizer {
         }
     }
 
+    // Orders the first Rime candidates by the text before the input, if predictive text is on.
+    private func makeContextualReranker() -> ContextualCandidateReranker? {
+        guard Settings.cached.enablePredictiveText,
+              !suggestionContextualText.isEmpty,
+              inputController?.state.inputMode != .english else { return nil }
+        return ContextualCandidateReranker(engine: PredictiveTextEngine.getPredictiveTextEngine(charForm: charForm),
+                                           contextualText: suggestionContextualText)
+    }
+    
+    // Lets the predictions adapt to what the user types.
+    func learnCommittedText(_ text: String, contextualText: String) {
+        guard Settings.cached.enablePredictiveText,
+              let inputController = inputController,
+              inputController.state.inputMode != .english else { return }
+        PredictiveTextEngine.getPredictiveTextEngine(charForm: charForm).learn(text, context: contextualText)
+    }
+    
+    // Shows the static suggestions right away and replaces them with the predictions once they arrive.
+    private func requestPredictiveCandidates(requestId: Int) {
+        let shouldFilterOffensiveWords = !Settings.cached.predictiveTextOffensiveWord
+        predictionSession.predictAsync(suggestionContextualText, filterOffensiveWords: shouldFilterOffensiveWords, timeBudget: Self.predictionTimeBudget) { [weak self] results in
+            guard let self = self,
+                  self.predictionRequestId == requestId,
+                  let inputController = self.inputController,
+                  !inputController.inputEngine.isComposing,
+                  self.autoSuggestionType != nil,
+                  let predictiveCandidates = results as NSArray as? [String],
+                  !predictiveCandidates.isEmpty else { return }
+            // DDLogInfo("Predictive text: \(self.suggestionContextualText) \(predictiveCandidates)")
+            self.candidateSource = AutoSuggestionCandidateSource(predictiveCandidates)
+            self.onReloadCandidates?(self)
+        }
+    }
+    
     func getNumberOfSections() -> Int {
         return candidateSource?.getNumberOfSections() ?? 0
     }
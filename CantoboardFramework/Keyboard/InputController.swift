@@ -686,6 +686,8 @@ class InputController: NSObject {
         guard let textDocumentProxy = textDocumentProxy else { return }
         let isNewLine = text == "\n"
         
+        candidateOrganizer.learnCommittedText(text, contextualText: documentContextBeforeInput)
+        
         if shouldRemoveSmartSpace(text) {
             compositionRenderer.removeCharBeforeInput()
             hasInsertedAutoSpace = false
@@ -426,6 +426,8 @@ open class KeyboardViewController: UIInputViewController {
     
     public override func didReceiveMemoryWarning() {
         super.didReceiveMemoryWarning()
+        // The engines map their ngram file again on the next prediction.
+        PredictiveTextEngineRegistry.shared.unloadAllEngines()
         let isVisible = isViewLoaded && view.window != nil
         if !isVisible {
             DDLogInfo("Under memory pressure. Unloading invisible KeyboardView. \(self)")
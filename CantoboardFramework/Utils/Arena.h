@@ -0,0 +1,102 @@
+//
+//  Arena.h
+//  CantoboardFramework
+//
+//  Bump allocator for data that lives as long as a single query. Everything is freed at once when
+//  the arena is destroyed, so building many short strings and containers costs a few block allocations.
+//
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+// Allocations never fail. Once more than capacityInBytes has been allocated, isFull() turns true and the query is
+// expected to stop at its next check, so it allocates at most its capacity plus what one step between checks needs.
+class Arena {
+public:
+    explicit Arena(size_t capacityInBytes = SIZE_MAX, size_t blockSizeInBytes = 4096) :
+        capacity(capacityInBytes), blockSize(blockSizeInBytes), used(0), remaining(0), next(nullptr) {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // Returns a copy of text1 + text2 owned by the arena.
+    std::string_view concat(std::string_view text1, std::string_view text2 = std::string_view()) {
+        const size_t length = text1.length() + text2.length();
+        char* buffer = (char*)allocate(length, 1);
+        if (!text1.empty()) memcpy(buffer, text1.data(), text1.length());
+        if (!text2.empty()) memcpy(buffer + text1.length(), text2.data(), text2.length());
+        return std::string_view(buffer, length);
+    }
+
+    void* allocate(size_t size, size_t alignment) {
+        size_t padding = (alignment - (uintptr_t)next % alignment) % alignment;
+        if (padding + size > remaining) {
+            // Oversized allocations get a block of their own. Blocks are aligned for any type.
+            const size_t newBlockSize = std::max(blockSize, size);
+            blocks.push_back(std::make_unique<char[]>(newBlockSize));
+            next = blocks.back().get();
+            remaining = newBlockSize;
+            padding = 0;
+        }
+        char* buffer = next + padding;
+        next += padding + size;
+        remaining -= padding + size;
+        used += padding + size;
+        return buffer;
+    }
+
+    size_t sizeInBytes() const { return used; }
+    size_t capacityInBytes() const { return capacity; }
+    bool isFull() const { return used > capacity; }
+    size_t numOfBlocks() const { return blocks.size(); }
+
+private:
+    const size_t capacity;
+    const size_t blockSize;
+    size_t used, remaining;
+    char* next;
+    std::vector<std::unique_ptr<char[]>> blocks;
+};
+
+// Lets standard containers allocate from an arena. Freed memory is only reclaimed with the arena,
+// so reserve containers up front where the size is known instead of growing them.
+template <typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(Arena& arena) : arena(&arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) { return (T*)arena->allocate(n * sizeof(T), alignof(T)); }
+    void deallocate(T*, size_t) {}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+
+private:
+    template <typename U>
+    friend class ArenaAllocator;
+
+    Arena* arena;
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+// The strings are typically owned by the same arena, see Arena::concat.
+typedef std::unordered_set<std::string_view, std::hash<std::string_view>, std::equal_to<std::string_view>,
+                           ArenaAllocator<std::string_view>> ArenaStringSet;
+
+#endif  // ARENA_H_
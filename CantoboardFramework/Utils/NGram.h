@@ -1,14 +1,54 @@
 #ifndef NGRAM_H_
 #define NGRAM_H_
 
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
 #pragma pack(push,1)
 
 enum NGramSectionId {
     trie = 0,
     weight = 1,
     isWord = 2,
+    // Optional. Precomputed best completions of short prefixes. See NGramTopKEntry.
+    topKIndex = 3,
+    topKKeyIds = 4,
+    // Optional. Bitset of keys containing an offensive word, indexed by key id.
+    isOffensive = 5,
+    // Version 1 only. kNumOfWeightCodes floats, the log-probability of each weight code in ascending order.
+    weightCodebook = 6,
+    // Optional, version 1 only. Array of NGramKeyRecord indexed by key id. Files with it leave the weight, isWord
+    // and isOffensive sections empty.
+    keyRecord = 7,
+    // Optional. One byte per key, indexed by key id, with the suffixWordMask of NGramKeyRecord.
+    // Only used by files without the keyRecord section.
+    suffixWordMask = 8,
+    // Optional, version 1 only. Keys sorted in byte order, so the completions of any key are a contiguous run of ranks.
+    // Array of NGramLexRange indexed by key id.
+    lexRange = 9,
+    // Key id of each rank, an array of uint32_t.
+    lexKeyIds = 10,
+    // Weight code of each rank, so a run can be ranked without reading the per-key sections.
+    lexWeightCodes = 11,
+    numOfSections,
+};
+
+// The version selects the encoding of the weight section.
+enum NGramVersion : short {
+    // One IEEE 754 half precision probability per key.
+    fp16Weights = 0,
+    // One byte per key, indexing the weightCodebook section. Codes compare like the weights they encode.
+    quantizedWeights = 1,
 };
 
+static const size_t kNumOfWeightCodes = 256;
+static const size_t kNumOfSuffixWordBits = 8;
+
+typedef uint16_t Fp16Weight;
+typedef uint8_t WeightCode;
+
 struct NGramSectionHeader {
     size_t dataSizeInBytes;
     size_t dataOffset;
@@ -17,14 +57,70 @@ struct NGramSectionHeader {
 struct NGramHeader {
     const char magicHeader[8] = {'C', 'A', 'N', 'T', 'N', 'G', 'A', 'M'};
     short headerSizeInBytes = sizeof(NGramHeader);
-    short version = 0;
+    short version = NGramVersion::quantizedWeights;
     char maxN;
     size_t numOfEntries;
-    NGramSectionHeader sections[3];
+    // Sections added after the first 3 are optional. Files written before they were added
+    // have a shorter header, readers must check hasSection() before using them.
+    NGramSectionHeader sections[NGramSectionId::numOfSections];
+};
+
+// The topKIndex section is an array of NGramTopKEntry sorted by prefixKeyId.
+// Each entry points to a slice of the topKKeyIds section (an array of uint32_t key ids) holding the
+// best completions of the prefix, ordered by weight descending then by key id ascending.
+struct NGramTopKEntry {
+    uint32_t prefixKeyId;
+    uint32_t keyIdsOffset;
+    uint16_t numOfKeyIds;
+    // True if the prefix has more completions than numOfKeyIds.
+    uint16_t isTruncated;
+};
+
+enum NGramKeyFlag : uint8_t {
+    keyIsWord = 1 << 0,
+    keyIsOffensive = 1 << 1,
+};
+
+// Everything ranking and filtering a key reads, packed so it costs a single memory access.
+struct NGramKeyRecord {
+    WeightCode weightCode;
+    // NGramKeyFlag bits.
+    uint8_t flags;
+    // Saturates at 255.
+    uint8_t numOfCodePoints;
+    // Bit i - 1 is set if the key without its first i code points is a word, for i in [1, kNumOfSuffixWordBits].
+    uint8_t suffixWordMask;
+};
+
+// The ranks of the key and of all keys it is a prefix of are [firstRank, endRank).
+struct NGramLexRange {
+    uint32_t firstRank;
+    uint32_t endRank;
 };
 
 #pragma pack(pop)
 
-typedef __fp16 Weight;
+inline bool hasSection(const NGramHeader* header, NGramSectionId sectionId) {
+    size_t numOfSectionsInFile = (header->headerSizeInBytes - offsetof(NGramHeader, sections)) / sizeof(NGramSectionHeader);
+    return sectionId < numOfSectionsInFile && header->sections[sectionId].dataSizeInBytes > 0;
+}
+
+// Decodes a version 0 weight in software, so the format does not depend on compiler support for __fp16.
+inline float decodeFp16Weight(Fp16Weight bits) {
+    const uint32_t sign = (uint32_t)(bits & 0x8000) << 16;
+    const uint32_t exponent = (bits >> 10) & 0x1F;
+    const uint32_t mantissa = bits & 0x3FF;
+    float value;
+    if (exponent == 0) {
+        // Zero or subnormal: mantissa * 2^-24.
+        value = mantissa * (1.0f / (1 << 24));
+    } else if (exponent == 0x1F) {
+        value = mantissa == 0 ? HUGE_VALF : NAN;
+    } else {
+        const uint32_t floatBits = ((exponent + 127 - 15) << 23) | (mantissa << 13);
+        memcpy(&value, &floatBits, sizeof(value));
+    }
+    return sign != 0 ? -value : value;
+}
 
 #endif  // NGRAM_H_
@@ -0,0 +1,1062 @@
+//
+//  NGramModel.cpp
+//  CantoboardFramework
+//
+
+#include "NGramModel.h"
+#include "Arena.h"
+#include "NGramOverlay.h"
+#include "OffensiveWords.h"
+#include "Utf8.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
+using namespace std;
+using namespace marisa;
+
+// Min number of keys kept by the top-K heap of each search. Some of the kept keys are dropped by the
+// filtering in appendResults, keep more than needed so that we rarely have to search again with a larger heap.
+static const size_t kMinTopKCapacity = 64;
+// Number of keys enumerated between two checks of the budget. Reading the clock on every key would dominate the search.
+static const size_t kBudgetCheckInterval = 256;
+
+static uint64_t nowInNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Adds the time from construction to destruction to a PredictStats stage duration.
+class StageTimer {
+public:
+    StageTimer(bool isEnabled, PredictStats& stats, PredictStage stage) : stats(isEnabled ? &stats : nullptr), stage(stage), startTime(isEnabled ? nowInNs() : 0) {}
+    ~StageTimer() {
+        if (stats != nullptr) stats->addStageDuration(stage, nowInNs() - startTime);
+    }
+
+private:
+    PredictStats* stats;
+    const PredictStage stage;
+    const uint64_t startTime;
+};
+
+// marisa agents hold the state of a search and allocate it on first use. Each thread has its own agents, so
+// concurrent searches never share one and successive searches on a thread reuse the allocations.
+// A search may use one agent of each kind at a time, e.g. looking up a key while a reverse lookup result is still in use.
+struct ThreadAgents {
+    Agent lookupAgent;
+    Agent predictiveSearchAgent;
+    Agent reverseLookupAgent;
+};
+
+static ThreadAgents& threadAgents() {
+    static thread_local ThreadAgents agents;
+    return agents;
+}
+
+// Higher weight ranks higher. Ties are broken by key id to keep the order deterministic.
+// NGramBuilder orders the precomputed completions the same way.
+template <typename RankedKey>
+static bool isRankedHigher(const RankedKey& key1, const RankedKey& key2) {
+    if (key1.weight != key2.weight) return key1.weight > key2.weight;
+    return key1.keyId < key2.keyId;
+}
+
+NGramModel::NGramModel() :
+    fd(-1), fileSize(0), data(nullptr), header(nullptr), keyRecords(nullptr), fp16Weights(nullptr), weightCodes(nullptr), isWordList(nullptr), isOffensiveList(nullptr), suffixWordMasks(nullptr),
+    topKEntries(nullptr), numOfTopKEntries(0), topKKeyIds(nullptr), lexRanges(nullptr), lexKeyIds(nullptr), lexWeightCodes(nullptr), scoring(ScoringMode::longestSuffixFirst), residency(ResidencyPolicy::demandPaging), overlay(nullptr),
+    isStageTimingEnabled(false) {
+}
+
+NGramModel::~NGramModel() {
+    close();
+}
+
+void NGramModel::close() {
+    if (data != nullptr && data != MAP_FAILED) {
+        header = nullptr;
+        keyRecords = nullptr;
+        fp16Weights = nullptr;
+        weightCodes = nullptr;
+        isWordList = nullptr;
+        isOffensiveList = nullptr;
+        suffixWordMasks = nullptr;
+        topKEntries = nullptr;
+        numOfTopKEntries = 0;
+        topKKeyIds = nullptr;
+        lexRanges = nullptr;
+        lexKeyIds = nullptr;
+        lexWeightCodes = nullptr;
+        trie.clear();
+        residency = ResidencyPolicy::demandPaging;
+        munmap(data, fileSize);
+    }
+    data = nullptr;
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+        fileSize = 0;
+    }
+}
+
+bool NGramModel::open(const string& ngramFilePath, string& error) {
+    close();
+
+    fd = ::open(ngramFilePath.c_str(), O_RDONLY);
+    if (fd == -1) {
+        error = "Failed to open " + ngramFilePath + " ngram file. " + strerror(errno);
+        return false;
+    }
+
+    struct stat buf;
+    if (fstat(fd, &buf) != 0) {
+        error = "Failed to stat " + ngramFilePath + " ngram file. " + strerror(errno);
+        close();
+        return false;
+    }
+    fileSize = buf.st_size;
+    // The trie, weight and isWord sections are required.
+    const size_t minHeaderSize = offsetof(NGramHeader, sections) + NGramSectionId::topKIndex * sizeof(NGramSectionHeader);
+    if (fileSize < minHeaderSize) {
+        error = "Ngram file " + ngramFilePath + " is too small.";
+        close();
+        return false;
+    }
+
+    data = (char*)mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        error = string("Failed to mmap ngram file. ") + strerror(errno);
+        close();
+        return false;
+    }
+
+    const NGramHeader* fileHeader = (const NGramHeader*)data;
+    if (memcmp(fileHeader->magicHeader, NGramHeader().magicHeader, sizeof(fileHeader->magicHeader)) != 0) {
+        error = ngramFilePath + " is not an ngram file.";
+        close();
+        return false;
+    }
+    if (fileHeader->headerSizeInBytes < (short)minHeaderSize || (size_t)fileHeader->headerSizeInBytes > fileSize) {
+        error = "Ngram file has a corrupt header size " + to_string(fileHeader->headerSizeInBytes) + ".";
+        close();
+        return false;
+    }
+    if (fileHeader->version != NGramVersion::fp16Weights && fileHeader->version != NGramVersion::quantizedWeights) {
+        error = "Unsupported ngram file version " + to_string(fileHeader->version) + ".";
+        close();
+        return false;
+    }
+    if (fileHeader->maxN < 1) {
+        error = "Ngram file has an invalid maxN " + to_string(fileHeader->maxN) + ".";
+        close();
+        return false;
+    }
+    // Once every section is known to lie within the file, the checks below only compare section sizes.
+    const size_t numOfSectionsInFile = min<size_t>(NGramSectionId::numOfSections,
+        (fileHeader->headerSizeInBytes - offsetof(NGramHeader, sections)) / sizeof(NGramSectionHeader));
+    for (size_t i = 0; i < numOfSectionsInFile; ++i) {
+        const NGramSectionHeader& sectionHeader = fileHeader->sections[i];
+        if (sectionHeader.dataSizeInBytes > 0 &&
+            (sectionHeader.dataOffset > fileSize || sectionHeader.dataSizeInBytes > fileSize - sectionHeader.dataOffset)) {
+            error = string("Ngram file has a truncated ") + toString((NGramSectionId)i) + " section.";
+            close();
+            return false;
+        }
+    }
+    header = fileHeader;
+
+    const NGramSectionHeader& trieSectionHeader = header->sections[NGramSectionId::trie];
+    try {
+        trie.map(data + trieSectionHeader.dataOffset, trieSectionHeader.dataSizeInBytes);
+    } catch (const Exception& e) {
+        error = string("Ngram file has a corrupt trie. ") + e.what();
+        close();
+        return false;
+    }
+    // Every other section is indexed by key id.
+    if (trie.size() != header->numOfEntries) {
+        error = "Ngram file has " + to_string(trie.size()) + " keys in its trie but " + to_string(header->numOfEntries) + " entries.";
+        close();
+        return false;
+    }
+
+    const NGramSectionHeader& weightSectionHeader = header->sections[NGramSectionId::weight];
+    if (header->version == NGramVersion::quantizedWeights) {
+        if (!hasSection(header, NGramSectionId::weightCodebook) ||
+            header->sections[NGramSectionId::weightCodebook].dataSizeInBytes != kNumOfWeightCodes * sizeof(float)) {
+            error = "Ngram file has a missing or truncated weight codebook.";
+            close();
+            return false;
+        }
+        const char* codebook = data + header->sections[NGramSectionId::weightCodebook].dataOffset;
+        for (size_t i = 0; i < kNumOfWeightCodes; ++i) {
+            float logProb;
+            memcpy(&logProb, codebook + i * sizeof(float), sizeof(logProb));
+            weightCodeValues[i] = expf(logProb);
+        }
+        if (hasSection(header, NGramSectionId::keyRecord)) {
+            if (header->sections[NGramSectionId::keyRecord].dataSizeInBytes < header->numOfEntries * sizeof(NGramKeyRecord)) {
+                error = "Ngram file has a truncated key record section.";
+                close();
+                return false;
+            }
+            keyRecords = (const NGramKeyRecord*)(data + header->sections[NGramSectionId::keyRecord].dataOffset);
+        } else if (weightSectionHeader.dataSizeInBytes < header->numOfEntries * sizeof(WeightCode)) {
+            error = "Ngram file has a truncated weight section.";
+            close();
+            return false;
+        } else {
+            weightCodes = (const WeightCode*)(data + weightSectionHeader.dataOffset);
+        }
+    } else {
+        if (weightSectionHeader.dataSizeInBytes < header->numOfEntries * sizeof(Fp16Weight)) {
+            error = "Ngram file has a truncated weight section.";
+            close();
+            return false;
+        }
+        fp16Weights = data + weightSectionHeader.dataOffset;
+    }
+
+    const size_t bitsetSizeInBytes = (header->numOfEntries + 7) / 8;
+    if (keyRecords == nullptr) {
+        const NGramSectionHeader& isWordListSectionHeader = header->sections[NGramSectionId::isWord];
+        if (isWordListSectionHeader.dataSizeInBytes < bitsetSizeInBytes) {
+            error = "Ngram file has a truncated isWord section.";
+            close();
+            return false;
+        }
+        isWordList = (const char*)(data + isWordListSectionHeader.dataOffset);
+    }
+
+    if (hasSection(header, NGramSectionId::topKIndex) && hasSection(header, NGramSectionId::topKKeyIds)) {
+        const NGramSectionHeader& topKIndexSectionHeader = header->sections[NGramSectionId::topKIndex];
+        const NGramTopKEntry* entries = (const NGramTopKEntry*)(data + topKIndexSectionHeader.dataOffset);
+        const size_t numOfEntries = topKIndexSectionHeader.dataSizeInBytes / sizeof(NGramTopKEntry);
+        const size_t numOfKeyIds = header->sections[NGramSectionId::topKKeyIds].dataSizeInBytes / sizeof(uint32_t);
+        // The index is small and read by every short prefix search anyway. Check each slice lies within topKKeyIds.
+        for (size_t i = 0; i < numOfEntries; ++i) {
+            if (entries[i].prefixKeyId >= header->numOfEntries || entries[i].keyIdsOffset > numOfKeyIds ||
+                entries[i].numOfKeyIds > numOfKeyIds - entries[i].keyIdsOffset) {
+                error = "Ngram file has a corrupt topKIndex section.";
+                close();
+                return false;
+            }
+        }
+        topKEntries = entries;
+        numOfTopKEntries = numOfEntries;
+        topKKeyIds = (const uint32_t*)(data + header->sections[NGramSectionId::topKKeyIds].dataOffset);
+    }
+
+    // A truncated section is ignored, filtering falls back to the offensive word list.
+    if (keyRecords == nullptr && hasSection(header, NGramSectionId::isOffensive) &&
+        header->sections[NGramSectionId::isOffensive].dataSizeInBytes >= bitsetSizeInBytes) {
+        isOffensiveList = (const char*)(data + header->sections[NGramSectionId::isOffensive].dataOffset);
+    }
+
+    // A truncated section is ignored, search falls back to looking up the suffixes.
+    if (keyRecords == nullptr && hasSection(header, NGramSectionId::suffixWordMask) &&
+        header->sections[NGramSectionId::suffixWordMask].dataSizeInBytes >= header->numOfEntries) {
+        suffixWordMasks = (const uint8_t*)(data + header->sections[NGramSectionId::suffixWordMask].dataOffset);
+    }
+
+    // Ranges are only usable with weight codes. Like the suffix word masks, truncated sections are ignored.
+    if (header->version == NGramVersion::quantizedWeights &&
+        hasSection(header, NGramSectionId::lexRange) && hasSection(header, NGramSectionId::lexKeyIds) &&
+        hasSection(header, NGramSectionId::lexWeightCodes) &&
+        header->sections[NGramSectionId::lexRange].dataSizeInBytes >= header->numOfEntries * sizeof(NGramLexRange) &&
+        header->sections[NGramSectionId::lexKeyIds].dataSizeInBytes >= header->numOfEntries * sizeof(uint32_t) &&
+        header->sections[NGramSectionId::lexWeightCodes].dataSizeInBytes >= header->numOfEntries * sizeof(WeightCode)) {
+        lexRanges = (const NGramLexRange*)(data + header->sections[NGramSectionId::lexRange].dataOffset);
+        lexKeyIds = (const uint32_t*)(data + header->sections[NGramSectionId::lexKeyIds].dataOffset);
+        lexWeightCodes = (const WeightCode*)(data + header->sections[NGramSectionId::lexWeightCodes].dataOffset);
+    }
+
+    return true;
+}
+
+const char* toString(NGramSectionId sectionId) {
+    switch (sectionId) {
+        case NGramSectionId::trie: return "trie";
+        case NGramSectionId::weight: return "weight";
+        case NGramSectionId::isWord: return "isWord";
+        case NGramSectionId::topKIndex: return "topKIndex";
+        case NGramSectionId::topKKeyIds: return "topKKeyIds";
+        case NGramSectionId::isOffensive: return "isOffensive";
+        case NGramSectionId::weightCodebook: return "weightCodebook";
+        case NGramSectionId::keyRecord: return "keyRecord";
+        case NGramSectionId::suffixWordMask: return "suffixWordMask";
+        case NGramSectionId::lexRange: return "lexRange";
+        case NGramSectionId::lexKeyIds: return "lexKeyIds";
+        case NGramSectionId::lexWeightCodes: return "lexWeightCodes";
+        case NGramSectionId::numOfSections: break;
+    }
+    return "unknown";
+}
+
+static size_t pageSize() {
+    static const size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+// Every search walks the trie from the root and short prefixes read the precomputed completions.
+// Range scans read runs of the lexWeightCodes section. The other sections are indexed by key id or rank
+// and only a few scattered entries are read per search.
+bool NGramModel::isHotSection(NGramSectionId sectionId) {
+    return sectionId == NGramSectionId::trie || sectionId == NGramSectionId::topKIndex || sectionId == NGramSectionId::topKKeyIds ||
+        sectionId == NGramSectionId::lexWeightCodes;
+}
+
+bool NGramModel::sectionPages(NGramSectionId sectionId, char*& pagesStart, size_t& pagesLength) const {
+    if (header == nullptr || !hasSection(header, sectionId)) return false;
+    const NGramSectionHeader& sectionHeader = header->sections[sectionId];
+    // data is page aligned as it comes from mmap.
+    const size_t startOffset = sectionHeader.dataOffset / pageSize() * pageSize();
+    const size_t endOffset = min(fileSize, sectionHeader.dataOffset + sectionHeader.dataSizeInBytes);
+    if (startOffset >= endOffset) return false;
+    pagesStart = data + startOffset;
+    pagesLength = endOffset - startOffset;
+    return true;
+}
+
+bool NGramModel::setResidencyPolicy(ResidencyPolicy policy) {
+    if (header == nullptr) return false;
+    residency = policy;
+
+    bool isSuccessful = madvise(data, fileSize, MADV_NORMAL) == 0;
+    if (policy == ResidencyPolicy::demandPaging) return isSuccessful;
+
+    // Pages shared by a cold and a hot section are advised as hot last, so read-ahead still covers them.
+    for (bool isHot : { false, true }) {
+        for (int i = 0; i < NGramSectionId::numOfSections; ++i) {
+            const NGramSectionId sectionId = (NGramSectionId)i;
+            char* pagesStart;
+            size_t pagesLength;
+            if (isHotSection(sectionId) != isHot || !sectionPages(sectionId, pagesStart, pagesLength)) continue;
+            isSuccessful &= madvise(pagesStart, pagesLength, isHot ? MADV_WILLNEED : MADV_RANDOM) == 0;
+        }
+    }
+    return isSuccessful;
+}
+
+size_t NGramModel::preTouchHotSections(const atomic<bool>* isCancelled) const {
+    size_t numOfBytesTouched = 0;
+    volatile char sink = 0;
+    for (int i = 0; i < NGramSectionId::numOfSections; ++i) {
+        const NGramSectionId sectionId = (NGramSectionId)i;
+        char* pagesStart;
+        size_t pagesLength;
+        if (!isHotSection(sectionId) || !sectionPages(sectionId, pagesStart, pagesLength)) continue;
+        for (size_t offset = 0; offset < pagesLength; offset += pageSize()) {
+            if (isCancelled != nullptr && *isCancelled) return numOfBytesTouched;
+            sink = sink + pagesStart[offset];
+            numOfBytesTouched += min(pageSize(), pagesLength - offset);
+        }
+    }
+    return numOfBytesTouched;
+}
+
+vector<SectionResidency> NGramModel::sectionResidency() const {
+    vector<SectionResidency> residencies;
+#ifdef __APPLE__
+    typedef char MincoreVecType;
+#else
+    typedef unsigned char MincoreVecType;
+#endif
+    vector<MincoreVecType> pageStates;
+    for (int i = 0; i < NGramSectionId::numOfSections; ++i) {
+        const NGramSectionId sectionId = (NGramSectionId)i;
+        char* pagesStart;
+        size_t pagesLength;
+        if (!sectionPages(sectionId, pagesStart, pagesLength)) continue;
+
+        SectionResidency entry({ sectionId, header->sections[sectionId].dataSizeInBytes, 0 });
+        const size_t numOfPages = (pagesLength + pageSize() - 1) / pageSize();
+        pageStates.assign(numOfPages, 0);
+        if (mincore(pagesStart, pagesLength, pageStates.data()) == 0) {
+            // Only count the part of each page holding the section.
+            const size_t sectionStartOffset = header->sections[sectionId].dataOffset - (pagesStart - data);
+            for (size_t page = 0; page < numOfPages; ++page) {
+                if (!(pageStates[page] & 1)) continue;
+                const size_t pageStartOffset = max(page * pageSize(), sectionStartOffset);
+                const size_t pageEndOffset = min((page + 1) * pageSize(), pagesLength);
+                entry.residentSizeInBytes += pageEndOffset - pageStartOffset;
+            }
+        }
+        residencies.push_back(entry);
+    }
+    return residencies;
+}
+
+string_view NGramModel::effectiveContext(string_view context) const {
+    if (header == nullptr) {
+        return string_view();
+    }
+    // header->maxN indicates the max length of suggested text.
+    // That means we should search for suffix with length up to max length-1 of the context.
+    // To start the search, move the pointer backward from the end of the string by max length-1 times.
+    size_t backward = header->maxN - 1;
+    size_t currentIndex = context.length();
+    while (currentIndex > 0 && backward > 0) {
+        currentIndex = previousCodePointIndex(context, currentIndex);
+        backward--;
+    }
+    return context.substr(currentIndex);
+}
+
+vector<string_view> NGramModel::suffixesOf(string_view context) const {
+    context = effectiveContext(context);
+
+    // Search for the whole effective context first, then move forward by 1 code point then search again.
+    // e.g. let context = abcdefg, max length = 6,
+    // The first iteration would search for cdefg, then defg, etc. At the end it would search for g.
+    vector<string_view> suffixes;
+    for (size_t currentIndex = 0; currentIndex < context.length(); currentIndex = nextCodePointIndex(context, currentIndex)) {
+        suffixes.push_back(context.substr(currentIndex));
+    }
+    return suffixes;
+}
+
+vector<string> NGramModel::predict(string_view context, bool shouldFilterOffensiveWords, PredictStats* stats,
+                                   const PredictBudget* budget) const {
+    const bool shouldTimeStages = isStageTimingEnabled && stats != nullptr;
+    const uint64_t startTime = shouldTimeStages ? nowInNs() : 0;
+    const vector<string_view> suffixes = suffixesOf(context);
+    const uint64_t suffixWalkDuration = shouldTimeStages ? nowInNs() - startTime : 0;
+
+    vector<string> results = predictSuffixes(suffixes, shouldFilterOffensiveWords, nullptr, stats, budget);
+    if (shouldTimeStages) stats->addStageDuration(PredictStage::suffixWalk, suffixWalkDuration);
+    return results;
+}
+
+vector<string> NGramModel::predictSuffixes(const vector<string_view>& suffixes, bool shouldFilterOffensiveWords,
+                                           vector<SuffixSearchResult>* suffixSearchResults, PredictStats* stats,
+                                           const PredictBudget* budget) const {
+    vector<string> results;
+    if (suffixSearchResults != nullptr) {
+        suffixSearchResults->assign(suffixes.size(), SuffixSearchResult::notSearched);
+    }
+    if (header == nullptr) {
+        return results;
+    }
+    PredictStats localStats;
+    PredictStats& predictStats = stats != nullptr ? *stats : localStats;
+    predictStats = PredictStats();
+    Arena arena;
+
+    if (scoring == ScoringMode::stupidBackoff) {
+        ArenaVector<ScoredResult> scoredResults = scoreSuffixesWithBackoff(arena, suffixes, kMaxNumberOfTerms, shouldFilterOffensiveWords,
+                                                                           suffixSearchResults, predictStats, budget);
+        results.reserve(scoredResults.size());
+        for (const ScoredResult& scoredResult : scoredResults) {
+            results.emplace_back(scoredResult.text);
+        }
+        return results;
+    }
+
+    // Results of shorter suffixes are always appended after results of longer suffixes.
+    // Once we have enough results, searching the remaining suffixes cannot change the output.
+    ArenaVector<string_view> resultTexts{ ArenaAllocator<string_view>(arena) };
+    resultTexts.reserve(kMaxNumberOfTerms);
+    ArenaStringSet dedupSet{ 0, ArenaStringSet::hasher(), ArenaStringSet::key_equal(), ArenaStringSet::allocator_type(arena) };
+    for (size_t i = 0; i < suffixes.size() && resultTexts.size() < kMaxNumberOfTerms; ++i) {
+        if (isOverBudget(budget, predictStats)) break;
+        bool hasCompletions = search(arena, suffixes[i], kMaxNumberOfTerms, resultTexts, nullptr, dedupSet, shouldFilterOffensiveWords,
+                                     predictStats, budget);
+        // An interrupted search without completions doesn't tell if the suffix has any.
+        bool isInterrupted = predictStats.isTimedOut || predictStats.isCancelled;
+        if (suffixSearchResults != nullptr && (hasCompletions || !isInterrupted)) {
+            (*suffixSearchResults)[i] = hasCompletions ? SuffixSearchResult::found : SuffixSearchResult::notFound;
+        }
+        if (isInterrupted) break;
+    }
+
+    results.assign(resultTexts.begin(), resultTexts.end());
+    return results;
+}
+
+ArenaVector<NGramModel::ScoredResult> NGramModel::scoreSuffixesWithBackoff(Arena& arena, const vector<string_view>& suffixes,
+                                                                          size_t maxNumOfResults, bool shouldFilterOffensiveWords,
+                                                                          vector<SuffixSearchResult>* suffixSearchResults,
+                                                                          PredictStats& stats, const PredictBudget* budget) const {
+    auto isScoredHigher = [](const ScoredResult& result1, const ScoredResult& result2) {
+        return result1.score > result2.score;
+    };
+
+    // Stupid Backoff keeps the score from the longest suffix a result follows. Suffixes are searched longest first,
+    // so results already in dedupSet are skipped.
+    ArenaStringSet dedupSet{ 0, ArenaStringSet::hasher(), ArenaStringSet::key_equal(), ArenaStringSet::allocator_type(arena) };
+    ArenaVector<ScoredResult> scoredResults{ ArenaAllocator<ScoredResult>(arena) };
+    scoredResults.reserve(suffixes.size() * maxNumOfResults);
+    ArenaVector<string_view> suffixResults{ ArenaAllocator<string_view>(arena) };
+    suffixResults.reserve(maxNumOfResults);
+    ArenaVector<float> suffixResultWeights{ ArenaAllocator<float>(arena) };
+    suffixResultWeights.reserve(maxNumOfResults);
+    const size_t maxOrder = header->maxN - 1;
+    for (size_t i = 0; i < suffixes.size(); ++i) {
+        const size_t order = countCodePoints(suffixes[i]);
+        // Scores are capped at 1 before the penalty, so no result of this or any shorter suffix can score higher.
+        const float maxScore = powf(kBackoffAlpha, (float)(maxOrder - min(maxOrder, order)));
+        if (scoredResults.size() >= maxNumOfResults) {
+            nth_element(scoredResults.begin(), scoredResults.begin() + maxNumOfResults - 1, scoredResults.end(), isScoredHigher);
+            if (scoredResults[maxNumOfResults - 1].score >= maxScore) break;
+        }
+        if (isOverBudget(budget, stats)) break;
+
+        suffixResults.clear();
+        suffixResultWeights.clear();
+        bool hasCompletions = search(arena, suffixes[i], maxNumOfResults, suffixResults, &suffixResultWeights, dedupSet,
+                                     shouldFilterOffensiveWords, stats, budget);
+        bool isInterrupted = stats.isTimedOut || stats.isCancelled;
+        if (suffixSearchResults != nullptr && (hasCompletions || !isInterrupted)) {
+            (*suffixSearchResults)[i] = hasCompletions ? SuffixSearchResult::found : SuffixSearchResult::notFound;
+        }
+
+        if (!suffixResults.empty()) {
+            // P(suffix) is the weight of the suffix itself. If the suffix is not a key, normalize by its best completion.
+            float suffixWeight = suffixResultWeights.front();
+            Agent& trieAgent = threadAgents().lookupAgent;
+            trieAgent.set_query(suffixes[i]);
+            if (trie.lookup(trieAgent)) suffixWeight = weightOf(trieAgent.key().id());
+
+            for (size_t j = 0; j < suffixResults.size(); ++j) {
+                float conditionalProb = suffixWeight > 0 ? min(1.0f, suffixResultWeights[j] / suffixWeight) : 1.0f;
+                scoredResults.push_back({ suffixResults[j], maxScore * conditionalProb });
+            }
+        }
+        if (isInterrupted) break;
+    }
+
+    // Stable, so ties keep the results of longer suffixes first.
+    stable_sort(scoredResults.begin(), scoredResults.end(), isScoredHigher);
+    if (scoredResults.size() > maxNumOfResults) scoredResults.resize(maxNumOfResults);
+    return scoredResults;
+}
+
+vector<string> NGramModel::predictPhrases(string_view context, bool shouldFilterOffensiveWords, size_t numOfSteps, size_t beamWidth,
+                                          PredictStats* stats, const PredictBudget* budget) const {
+    vector<string> phrases;
+    if (header == nullptr || numOfSteps == 0 || beamWidth == 0) {
+        return phrases;
+    }
+    PredictStats localStats;
+    PredictStats& predictStats = stats != nullptr ? *stats : localStats;
+    predictStats = PredictStats();
+
+    struct Continuation {
+        string_view text;
+        float logScore;
+    };
+    struct Beam {
+        string_view phrase;
+        float logScore;
+        size_t numOfSteps;
+    };
+    auto isBeamScoredHigher = [](const Beam& beam1, const Beam& beam2) {
+        return beam1.logScore > beam2.logScore;
+    };
+
+    // Everything this query allocates, down to the searches of each beam, lives in the arena and is freed together on return.
+    Arena arena(kPhraseArenaCapacityInBytes);
+    // Beams whose phrases end the same way have the same effective context, they share one search.
+    typedef unordered_map<string_view, ArenaVector<Continuation>, hash<string_view>, equal_to<string_view>,
+                          ArenaAllocator<pair<const string_view, ArenaVector<Continuation>>>> ContinuationsByContext;
+    ContinuationsByContext continuationsByContext{ 0, ContinuationsByContext::hasher(), ContinuationsByContext::key_equal(),
+                                                   ContinuationsByContext::allocator_type(arena) };
+    const string_view queryContext = arena.concat(effectiveContext(context));
+
+    // Each step keeps beamWidth beams and expands each into up to beamWidth beams.
+    const size_t maxNumOfNextBeams = beamWidth * beamWidth;
+    ArenaVector<Beam> beams{ ArenaAllocator<Beam>(arena) }, nextBeams{ ArenaAllocator<Beam>(arena) };
+    ArenaVector<Beam> finishedBeams{ ArenaAllocator<Beam>(arena) };
+    beams.reserve(maxNumOfNextBeams);
+    nextBeams.reserve(maxNumOfNextBeams);
+    finishedBeams.reserve(numOfSteps * beamWidth + 1);
+    beams.push_back({ string_view(), 0, 0 });
+    bool isInterrupted = false;
+    for (size_t step = 0; step < numOfSteps && !beams.empty() && !isInterrupted; ++step) {
+        nextBeams.clear();
+        size_t numOfExpandedBeams = 0;
+        for (; numOfExpandedBeams < beams.size(); ++numOfExpandedBeams) {
+            if (isOverBudget(budget, predictStats)) break;
+            if (arena.isFull()) {
+                predictStats.isArenaFull = true;
+                break;
+            }
+            const Beam& beam = beams[numOfExpandedBeams];
+            const string_view beamContext = effectiveContext(beam.phrase.empty() ? queryContext : arena.concat(queryContext, beam.phrase));
+
+            auto it = continuationsByContext.find(beamContext);
+            if (it == continuationsByContext.end()) {
+                ArenaVector<ScoredResult> scoredResults = scoreSuffixesWithBackoff(arena, suffixesOf(beamContext), beamWidth,
+                                                                                   shouldFilterOffensiveWords, nullptr, predictStats, budget);
+                ArenaVector<Continuation> continuations{ ArenaAllocator<Continuation>(arena) };
+                continuations.reserve(scoredResults.size());
+                for (const ScoredResult& scoredResult : scoredResults) {
+                    continuations.push_back({ scoredResult.text, logf(max(scoredResult.score, 1e-9f)) });
+                }
+                it = continuationsByContext.emplace(beamContext, move(continuations)).first;
+            }
+            // Partial continuations of an interrupted search are still ranked correctly, use them but stop after this beam.
+            isInterrupted = predictStats.isTimedOut || predictStats.isCancelled;
+
+            if (it->second.empty()) {
+                finishedBeams.push_back(beam);
+            }
+            for (const Continuation& continuation : it->second) {
+                nextBeams.push_back({ arena.concat(beam.phrase, continuation.text), beam.logScore + continuation.logScore, beam.numOfSteps + 1 });
+            }
+            if (isInterrupted) {
+                ++numOfExpandedBeams;
+                break;
+            }
+        }
+        if (numOfExpandedBeams < beams.size()) {
+            // Out of budget. Beams not expanded in this step are still valid phrases.
+            finishedBeams.insert(finishedBeams.end(), beams.begin() + numOfExpandedBeams, beams.end());
+            isInterrupted = true;
+        }
+
+        if (nextBeams.size() > beamWidth) {
+            partial_sort(nextBeams.begin(), nextBeams.begin() + beamWidth, nextBeams.end(), isBeamScoredHigher);
+            nextBeams.resize(beamWidth);
+        }
+        beams.swap(nextBeams);
+    }
+    finishedBeams.insert(finishedBeams.end(), beams.begin(), beams.end());
+
+    // Longer phrases multiply more probabilities, compare the mean log score per step instead.
+    const size_t minNumOfSteps = min<size_t>(2, numOfSteps);
+    ArenaVector<Beam> rankedBeams{ ArenaAllocator<Beam>(arena) };
+    rankedBeams.reserve(finishedBeams.size());
+    for (const Beam& beam : finishedBeams) {
+        if (beam.numOfSteps < minNumOfSteps) continue;
+        rankedBeams.push_back({ beam.phrase, beam.logScore / beam.numOfSteps, beam.numOfSteps });
+    }
+    stable_sort(rankedBeams.begin(), rankedBeams.end(), isBeamScoredHigher);
+
+    ArenaStringSet dedupSet{ 0, ArenaStringSet::hasher(), ArenaStringSet::key_equal(), ArenaStringSet::allocator_type(arena) };
+    for (const Beam& beam : rankedBeams) {
+        if (phrases.size() >= kMaxNumberOfTerms) break;
+        if (!dedupSet.insert(beam.phrase).second) continue;
+        phrases.emplace_back(beam.phrase);
+    }
+    return phrases;
+}
+
+vector<float> NGramModel::scoreContinuations(string_view context, const vector<string_view>& candidates, PredictStats* stats,
+                                            const PredictBudget* budget) const {
+    vector<float> scores(candidates.size(), -INFINITY);
+    if (header == nullptr || candidates.empty()) {
+        return scores;
+    }
+    PredictStats localStats;
+    PredictStats& predictStats = stats != nullptr ? *stats : localStats;
+    predictStats = PredictStats();
+
+    vector<string_view> suffixes = suffixesOf(context);
+    // The empty suffix scores candidates by their own weight, which is P(candidate).
+    suffixes.push_back(string_view());
+
+    // Same scores as scoreSuffixesWithBackoff, kept linear until the end. 0 means not scored yet.
+    vector<float> linearScores(candidates.size(), 0);
+    vector<float> candidateWeights(candidates.size());
+    Arena arena;
+    ArenaVector<RankedKey> topKeys{ ArenaAllocator<RankedKey>(arena) };
+    string key;
+    Agent& trieAgent = threadAgents().lookupAgent;
+    const size_t maxOrder = header->maxN - 1;
+    size_t numOfScoredCandidates = 0;
+    for (const string_view suffix : suffixes) {
+        if (numOfScoredCandidates == candidates.size() || isOverBudget(budget, predictStats)) break;
+        predictStats.numOfSearches++;
+
+        float suffixWeight = 1;
+        if (!suffix.empty()) {
+            trieAgent.set_query(suffix);
+            if (trie.lookup(trieAgent)) {
+                suffixWeight = weightOf(trieAgent.key().id());
+            } else {
+                // Like scoreSuffixesWithBackoff, normalize by the best completion if the suffix is not a key.
+                selectTopKeys(suffix, 1, topKeys, predictStats, budget);
+                if (topKeys.empty()) continue;
+                suffixWeight = topKeys.front().weight;
+            }
+        }
+
+        // Stupid Backoff keeps the score of the longest suffix a candidate follows, only look up the unscored ones.
+        key.assign(suffix);
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            candidateWeights[i] = 0;
+            if (linearScores[i] > 0 || candidates[i].empty()) continue;
+            key.resize(suffix.length());
+            key.append(candidates[i]);
+            trieAgent.set_query(key);
+            predictStats.numOfVisitedKeys++;
+            if (trie.lookup(trieAgent)) candidateWeights[i] = weightOf(trieAgent.key().id());
+        }
+
+        // Branch free over plain arrays, so the compiler can vectorize the comparison.
+        const float maxScore = powf(kBackoffAlpha, (float)(maxOrder - min(maxOrder, countCodePoints(suffix))));
+        const float scale = suffixWeight > 0 ? 1.0f / suffixWeight : 0;
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            const float conditionalProb = suffixWeight > 0 ? min(1.0f, candidateWeights[i] * scale) : 1.0f;
+            const float score = candidateWeights[i] > 0 ? maxScore * conditionalProb : 0;
+            linearScores[i] = max(linearScores[i], score);
+        }
+        numOfScoredCandidates = count_if(linearScores.begin(), linearScores.end(), [](float score) { return score > 0; });
+    }
+
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        if (linearScores[i] > 0) scores[i] = logf(linearScores[i]);
+    }
+    return scores;
+}
+
+bool NGramModel::hasUserContinuations(string_view context) const {
+    const NGramOverlay* currentOverlay = overlay;
+    return currentOverlay != nullptr && currentOverlay->hasContext(context);
+}
+
+bool NGramModel::isOverBudget(const PredictBudget* budget, PredictStats& stats) {
+    if (budget == nullptr) return false;
+    if (budget->latestRequestId != nullptr && budget->latestRequestId->load(memory_order_relaxed) != budget->requestId) {
+        stats.isCancelled = true;
+        return true;
+    }
+    if (budget->deadline != chrono::steady_clock::time_point::max() && chrono::steady_clock::now() >= budget->deadline) {
+        stats.isTimedOut = true;
+        return true;
+    }
+    return false;
+}
+
+static bool testBit(const char* bitset, size_t index) {
+    size_t byteOffset = index / 8;
+    short bitOffset = index % 8;
+    char encodedByte = bitset[byteOffset];
+
+    return 1 == ((encodedByte >> bitOffset) & 1);
+}
+
+bool NGramModel::isWord(size_t keyId) const {
+    if (keyRecords != nullptr) return keyRecords[keyId].flags & NGramKeyFlag::keyIsWord;
+    return testBit(isWordList, keyId);
+}
+
+bool NGramModel::isOffensive(size_t keyId) const {
+    if (keyRecords != nullptr) return keyRecords[keyId].flags & NGramKeyFlag::keyIsOffensive;
+    return testBit(isOffensiveList, keyId);
+}
+
+size_t NGramModel::numOfSuffixCodePoints(size_t keyId, string_view suffix, size_t numOfPrefixCodePoints) const {
+    if (keyRecords != nullptr && keyRecords[keyId].numOfCodePoints < UINT8_MAX) {
+        return keyRecords[keyId].numOfCodePoints - numOfPrefixCodePoints;
+    }
+    return countCodePoints(suffix);
+}
+
+bool NGramModel::isSuffixWord(size_t keyId, string_view suffix, size_t numOfPrefixCodePoints) const {
+    if ((keyRecords != nullptr || suffixWordMasks != nullptr) && numOfPrefixCodePoints >= 1 && numOfPrefixCodePoints <= kNumOfSuffixWordBits) {
+        const uint8_t mask = keyRecords != nullptr ? keyRecords[keyId].suffixWordMask : suffixWordMasks[keyId];
+        return (mask >> (numOfPrefixCodePoints - 1)) & 1;
+    }
+    Agent& trieAgent = threadAgents().lookupAgent;
+    trieAgent.set_query(suffix);
+    return trie.lookup(trieAgent) && isWord(trieAgent.key().id());
+}
+
+// Only used with ngram files built without the isOffensive section.
+static bool containsOffensiveWord(string_view text) {
+    for (const char* offensiveWord : builtInOffensiveWords) {
+        if (text.find(offensiveWord) != string_view::npos) return true;
+    }
+    return false;
+}
+
+// Returns the precomputed completions of prefix, or nullptr if prefix has none in the ngram file.
+const NGramTopKEntry* NGramModel::findPrecomputedTopK(string_view prefix) const {
+    if (topKEntries == nullptr) return nullptr;
+
+    Agent& trieAgent = threadAgents().lookupAgent;
+    trieAgent.set_query(prefix);
+    if (!trie.lookup(trieAgent)) return nullptr;
+
+    const uint32_t prefixKeyId = (uint32_t)trieAgent.key().id();
+    const NGramTopKEntry* topKEntriesEnd = topKEntries + numOfTopKEntries;
+    const NGramTopKEntry* it = lower_bound(topKEntries, topKEntriesEnd, prefixKeyId, [](const NGramTopKEntry& entry, uint32_t keyId) {
+        return entry.prefixKeyId < keyId;
+    });
+    if (it == topKEntriesEnd || it->prefixKeyId != prefixKeyId) return nullptr;
+    return it;
+}
+
+// Keeps the best `capacity` keys matching prefix in a min-heap, ordered from the best to the worst on return.
+// Only key ids and weights are kept, key text is materialized for the survivors only.
+// Returns true if some matching keys were dropped because the heap was full.
+bool NGramModel::selectTopKeys(string_view prefix, size_t capacity, ArenaVector<RankedKey>& topKeys,
+                               PredictStats& stats, const PredictBudget* budget) const {
+    StageTimer timer(isStageTimingEnabled, stats, PredictStage::trieTraversal);
+    topKeys.clear();
+    topKeys.reserve(capacity);
+
+    const NGramTopKEntry* topKEntry = findPrecomputedTopK(prefix);
+    if (topKEntry != nullptr && (!topKEntry->isTruncated || capacity <= topKEntry->numOfKeyIds)) {
+        // The precomputed completions are already ordered. Read the slice instead of enumerating the trie.
+        const size_t numOfKeyIds = min(capacity, (size_t)topKEntry->numOfKeyIds);
+        const uint32_t* keyIds = topKKeyIds + topKEntry->keyIdsOffset;
+        for (size_t i = 0; i < numOfKeyIds; ++i) {
+            topKeys.push_back({ keyIds[i], weightOf(keyIds[i]) });
+        }
+        stats.numOfVisitedKeys += numOfKeyIds;
+        return topKEntry->isTruncated || numOfKeyIds < topKEntry->numOfKeyIds;
+    }
+
+    if (lexRanges != nullptr) {
+        // Every key completes the empty prefix.
+        if (prefix.empty()) return selectTopKeysInRange(0, header->numOfEntries, capacity, topKeys, stats, budget);
+        Agent& lookupAgent = threadAgents().lookupAgent;
+        lookupAgent.set_query(prefix);
+        if (trie.lookup(lookupAgent)) {
+            const NGramLexRange& range = lexRanges[lookupAgent.key().id()];
+            return selectTopKeysInRange(range.firstRank, range.endRank, capacity, topKeys, stats, budget);
+        }
+        // Completions of a prefix that is not a key are not contiguous in the ranks of any key. Walk the trie.
+    }
+
+    bool isTruncated = false;
+    Agent& trieAgent = threadAgents().predictiveSearchAgent;
+    trieAgent.set_query(prefix);
+    size_t numOfKeysBeforeBudgetCheck = kBudgetCheckInterval;
+    while (trie.predictive_search(trieAgent)) {
+        // Keep the best keys found so far if the budget runs out.
+        if (--numOfKeysBeforeBudgetCheck == 0) {
+            if (isOverBudget(budget, stats)) break;
+            numOfKeysBeforeBudgetCheck = kBudgetCheckInterval;
+        }
+        stats.numOfVisitedKeys++;
+        const size_t keyId = trieAgent.key().id();
+        const RankedKey rankedKey({ keyId, weightOf(keyId) });
+        if (topKeys.size() < capacity) {
+            topKeys.push_back(rankedKey);
+            push_heap(topKeys.begin(), topKeys.end(), isRankedHigher<RankedKey>);
+        } else {
+            isTruncated = true;
+            // The heap front is the worst key kept so far.
+            if (!isRankedHigher(rankedKey, topKeys.front())) continue;
+            pop_heap(topKeys.begin(), topKeys.end(), isRankedHigher<RankedKey>);
+            topKeys.back() = rankedKey;
+            push_heap(topKeys.begin(), topKeys.end(), isRankedHigher<RankedKey>);
+        }
+    }
+    sort_heap(topKeys.begin(), topKeys.end(), isRankedHigher<RankedKey>);
+    return isTruncated;
+}
+
+// Same result as walking the trie, but reads a contiguous run of weight codes instead of decoding keys.
+// A histogram of the codes finds the weight of the capacity-th best key, then only keys at least that heavy are kept.
+bool NGramModel::selectTopKeysInRange(size_t firstRank, size_t endRank, size_t capacity, ArenaVector<RankedKey>& topKeys,
+                                      PredictStats& stats, const PredictBudget* budget) const {
+    if (capacity == 0) return endRank > firstRank;
+    size_t numOfKeysPerCode[kNumOfWeightCodes] = {};
+    for (size_t rank = firstRank; rank < endRank; ++rank) {
+        numOfKeysPerCode[lexWeightCodes[rank]]++;
+    }
+    stats.numOfVisitedKeys += endRank - firstRank;
+
+    size_t thresholdCode = kNumOfWeightCodes;
+    size_t numOfKeysAboveThreshold = 0;
+    while (thresholdCode > 0 && numOfKeysAboveThreshold < capacity) {
+        numOfKeysAboveThreshold += numOfKeysPerCode[--thresholdCode];
+    }
+    // Unused codes can decode to the same weight as a used one, so compare weights rather than codes.
+    const float thresholdWeight = weightCodeValues[thresholdCode];
+
+    size_t numOfKeysBeforeBudgetCheck = kBudgetCheckInterval;
+    for (size_t rank = firstRank; rank < endRank; ++rank) {
+        if (--numOfKeysBeforeBudgetCheck == 0) {
+            if (isOverBudget(budget, stats)) break;
+            numOfKeysBeforeBudgetCheck = kBudgetCheckInterval;
+        }
+        const float weight = weightCodeValues[lexWeightCodes[rank]];
+        if (weight >= thresholdWeight) topKeys.push_back({ lexKeyIds[rank], weight });
+    }
+    const size_t numOfTopKeys = min(capacity, topKeys.size());
+    partial_sort(topKeys.begin(), topKeys.begin() + numOfTopKeys, topKeys.end(), isRankedHigher<RankedKey>);
+    topKeys.resize(numOfTopKeys);
+    return endRank - firstRank > capacity;
+}
+
+bool NGramModel::search(Arena& arena, string_view prefix, size_t maxNumOfResults, ArenaVector<string_view>& output,
+                        ArenaVector<float>* outputWeights, ArenaStringSet& dedupSet, bool shouldFilterOffensiveWords, PredictStats& stats,
+                        const PredictBudget* budget) const {
+    const NGramOverlay* currentOverlay = overlay;
+    ArenaVector<NGramOverlayContinuation> overlayContinuations{ ArenaAllocator<NGramOverlayContinuation>(arena) };
+    float confidence = 0;
+    if (currentOverlay == nullptr || !currentOverlay->findContinuations(prefix, arena, overlayContinuations, confidence)) {
+        return searchTrie(arena, prefix, maxNumOfResults, output, outputWeights, dedupSet, shouldFilterOffensiveWords, stats, budget);
+    }
+
+    const size_t numOfTermsNeeded = maxNumOfResults - min(maxNumOfResults, output.size());
+    ArenaVector<string_view> trieResults{ ArenaAllocator<string_view>(arena) };
+    trieResults.reserve(numOfTermsNeeded);
+    ArenaVector<float> trieWeights{ ArenaAllocator<float>(arena) };
+    trieWeights.reserve(numOfTermsNeeded);
+    bool hasCompletions = searchTrie(arena, prefix, numOfTermsNeeded, trieResults, &trieWeights, dedupSet, shouldFilterOffensiveWords,
+                                     stats, budget);
+
+    // The overlay gives P(text | prefix), the ngram file gives P(prefix + text). Mix them as
+    // (1 - confidence) * P(prefix + text) + confidence * P(prefix) * P_user(text | prefix).
+    Agent& trieAgent = threadAgents().lookupAgent;
+    trieAgent.set_query(prefix);
+    float prefixWeight = trie.lookup(trieAgent) ? weightOf(trieAgent.key().id()) : (trieWeights.empty() ? 1.0f : trieWeights.front());
+
+    struct MixedResult {
+        string_view text;
+        float weight;
+    };
+    ArenaVector<MixedResult> mixedResults{ ArenaAllocator<MixedResult>(arena) };
+    mixedResults.reserve(trieResults.size() + overlayContinuations.size());
+    for (size_t i = 0; i < trieResults.size(); ++i) {
+        mixedResults.push_back({ trieResults[i], (1 - confidence) * trieWeights[i] });
+    }
+
+    for (const NGramOverlayContinuation& continuation : overlayContinuations) {
+        const float userWeight = confidence * prefixWeight * continuation.prob;
+        auto it = find_if(mixedResults.begin(), mixedResults.end(), [&](const MixedResult& result) {
+            return result.text == continuation.text;
+        });
+        if (it != mixedResults.end()) {
+            it->weight += userWeight;
+            continue;
+        }
+        // Already suggested for a longer suffix.
+        if (dedupSet.find(continuation.text) != dedupSet.end()) continue;
+
+        const string_view key = arena.concat(prefix, continuation.text);
+        trieAgent.set_query(key);
+        const bool isKey = trie.lookup(trieAgent);
+        if (shouldFilterOffensiveWords) {
+            // The blocklist the offensive flags were built from is not shipped, so text outside the ngram file cannot be
+            // checked against it.
+            bool shouldFilter = hasOffensiveFlags() ? !isKey || isOffensive(trieAgent.key().id()) : containsOffensiveWord(key);
+            if (shouldFilter) continue;
+        }
+        const float baseWeight = isKey ? weightOf(trieAgent.key().id()) : 0;
+        const string_view text = key.substr(prefix.length());
+        dedupSet.insert(text);
+        mixedResults.push_back({ text, (1 - confidence) * baseWeight + userWeight });
+    }
+
+    stable_sort(mixedResults.begin(), mixedResults.end(), [](const MixedResult& result1, const MixedResult& result2) {
+        return result1.weight > result2.weight;
+    });
+    for (size_t i = 0; i < mixedResults.size(); ++i) {
+        if (i >= numOfTermsNeeded) {
+            // Let shorter suffixes suggest it.
+            dedupSet.erase(mixedResults[i].text);
+            continue;
+        }
+        if (outputWeights != nullptr) outputWeights->push_back(mixedResults[i].weight);
+        output.push_back(mixedResults[i].text);
+    }
+    return hasCompletions || !mixedResults.empty();
+}
+
+bool NGramModel::searchTrie(Arena& arena, string_view prefix, size_t maxNumOfResults, ArenaVector<string_view>& output,
+                            ArenaVector<float>* outputWeights, ArenaStringSet& dedupSet, bool shouldFilterOffensiveWords, PredictStats& stats,
+                            const PredictBudget* budget) const {
+    const size_t numOfTermsNeeded = maxNumOfResults - min(maxNumOfResults, output.size());
+    // Keys already in dedupSet and keys filtered below do not count towards numOfTermsNeeded.
+    size_t capacity = max(kMinTopKCapacity, 2 * (numOfTermsNeeded + dedupSet.size()));
+    ArenaVector<RankedKey> topKeys{ ArenaAllocator<RankedKey>(arena) };
+    size_t numOfKeysProcessed = 0;
+    while (true) {
+        stats.numOfSearches++;
+        bool isTruncated = selectTopKeys(prefix, capacity, topKeys, stats, budget);
+        appendResults(arena, prefix, topKeys, numOfKeysProcessed, maxNumOfResults, output, outputWeights, dedupSet, shouldFilterOffensiveWords,
+                      stats);
+        // If too many keys were filtered, search again with a larger heap and continue from where we stopped.
+        if (!isTruncated || output.size() >= maxNumOfResults || stats.isTimedOut || stats.isCancelled) break;
+        numOfKeysProcessed = topKeys.size();
+        capacity *= 4;
+    }
+    return !topKeys.empty();
+}
+
+void NGramModel::appendResults(Arena& arena, string_view prefix, const ArenaVector<RankedKey>& topKeys, size_t startIndex,
+                               size_t maxNumOfResults, ArenaVector<string_view>& output, ArenaVector<float>* outputWeights,
+                               ArenaStringSet& dedupSet, bool shouldFilterOffensiveWords, PredictStats& stats) const {
+    // Reverse lookups and filtering interleave, charge the time since the last switch to the stage that just ended.
+    const bool shouldTimeStages = isStageTimingEnabled;
+    uint64_t stageStartTime = shouldTimeStages ? nowInNs() : 0;
+    auto endStage = [&](PredictStage stage) {
+        if (!shouldTimeStages) return;
+        const uint64_t now = nowInNs();
+        stats.addStageDuration(stage, now - stageStartTime);
+        stageStartTime = now;
+    };
+
+    Agent& reverseLookupAgent = threadAgents().reverseLookupAgent;
+    // Key records and suffix word masks count code points from the start of the key.
+    const size_t numOfPrefixCodePoints = keyRecords != nullptr || suffixWordMasks != nullptr ? countCodePoints(prefix) : 0;
+    for (size_t i = startIndex; i < topKeys.size() && output.size() < maxNumOfResults; ++i) {
+        const size_t keyId = topKeys[i].keyId;
+        // With the isOffensive section, offensive keys are dropped before paying for the reverse lookup.
+        if (shouldFilterOffensiveWords && hasOffensiveFlags() && isOffensive(keyId)) {
+            stats.numOfOffensiveResults++;
+            stats.numOfDroppedResults++;
+            continue;
+        }
+        endStage(PredictStage::filtering);
+
+        reverseLookupAgent.set_query(keyId);
+        trie.reverse_lookup(reverseLookupAgent);
+        const Key& key = reverseLookupAgent.key();
+        const string_view fullText(key.ptr(), key.length());
+        endStage(PredictStage::materialization);
+
+        if (shouldFilterOffensiveWords && !hasOffensiveFlags() && containsOffensiveWord(fullText)) {
+            stats.numOfOffensiveResults++;
+            stats.numOfDroppedResults++;
+            continue;
+        }
+
+        const string_view suffix = fullText.substr(prefix.length());
+        if (suffix.empty()) {
+            stats.numOfDroppedResults++;
+            continue;
+        }
+
+        bool shouldAdd = false;
+        if (isWord(keyId)) {
+            shouldAdd = true;
+        } else if (numOfSuffixCodePoints(keyId, suffix, numOfPrefixCodePoints) == 1) {
+            // If the suffix has just a single char, always suggest it.
+            shouldAdd = true;
+        } else {
+            // If suffix is a word, suggest the whole word.
+            shouldAdd = isSuffixWord(keyId, suffix, numOfPrefixCodePoints);
+        }
+        if (!shouldAdd) {
+            stats.numOfDroppedResults++;
+            continue;
+        }
+
+        // suffix points into the reverse lookup agent, copy it to the arena only if it is kept.
+        if (dedupSet.find(suffix) == dedupSet.end()) {
+            const string_view toAdd = arena.concat(suffix);
+            if (outputWeights != nullptr) outputWeights->push_back(topKeys[i].weight);
+            output.push_back(toAdd);
+            dedupSet.insert(toAdd);
+        } else {
+            stats.numOfDroppedResults++;
+        }
+    }
+    endStage(PredictStage::filtering);
+}
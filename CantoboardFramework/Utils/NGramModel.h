@@ -0,0 +1,262 @@
+//
+//  NGramModel.h
+//  CantoboardFramework
+//
+//  Portable core of PredictiveTextEngine. It has no Foundation dependency so it can be built and
+//  benchmarked off-device.
+//
+
+#ifndef NGRAMMODEL_H_
+#define NGRAMMODEL_H_
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "marisa/trie.h"
+#include "Arena.h"
+#include "NGram.h"
+#include "PredictMetrics.h"
+
+class NGramOverlay;
+
+struct PredictStats {
+    // Number of trie keys enumerated or read from the precomputed completions.
+    size_t numOfVisitedKeys = 0;
+    size_t numOfSearches = 0;
+    // Selected keys not returned because they were offensive, not words or duplicates.
+    size_t numOfDroppedResults = 0;
+    size_t numOfOffensiveResults = 0;
+    // Time spent in each PredictStage. Only measured if stage timing is enabled on the model.
+    uint64_t stageDurationsInNs[kNumOfPredictStages] = {};
+    // Bit i is set if stage i was measured, so stages that did not run are not mistaken for instant ones.
+    uint32_t timedStages = 0;
+    // Set if the budget ran out before the search finished. The results are the best found so far.
+    bool isTimedOut = false;
+    bool isCancelled = false;
+    // Set if predictPhrases used up its arena. The results are the best found so far.
+    bool isArenaFull = false;
+
+    void addStageDuration(PredictStage stage, uint64_t durationInNs) {
+        stageDurationsInNs[(size_t)stage] += durationInNs;
+        timedStages |= 1u << (size_t)stage;
+    }
+    bool isStageTimed(PredictStage stage) const { return (timedStages >> (size_t)stage) & 1; }
+};
+
+// Bounds the time a predict call may take.
+struct PredictBudget {
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    // If set, the call is cancelled as soon as *latestRequestId no longer equals requestId,
+    // i.e. when a newer request has been issued.
+    const std::atomic<uint64_t>* latestRequestId = nullptr;
+    uint64_t requestId = 0;
+};
+
+enum class ScoringMode : uint8_t {
+    // Results of longer suffixes of the context always rank first. Results of each suffix are ordered by weight.
+    longestSuffixFirst,
+    // Stupid Backoff. Results of all suffixes are merged and ranked by
+    // P(suffix + result) / P(suffix) * alpha ^ (number of chars dropped from the effective context).
+    stupidBackoff,
+};
+
+// How the mapped ngram file is kept in memory. Trades the page faults of the first predictions after launch against RSS.
+enum class ResidencyPolicy : uint8_t {
+    // Leave paging to the kernel.
+    demandPaging,
+    // Ask the kernel to read the hot sections (trie and precomputed completions) ahead and not to read around
+    // the per-key arrays, of which each search only reads a few scattered entries.
+    advise,
+    // Like advise. Call preTouchHotSections to fault in every page of the hot sections, preferably off the main thread.
+    preTouch,
+};
+
+struct SectionResidency {
+    NGramSectionId sectionId;
+    size_t sizeInBytes;
+    // Bytes of the section that are in memory.
+    size_t residentSizeInBytes;
+};
+
+const char* toString(NGramSectionId sectionId);
+
+enum class SuffixSearchResult : uint8_t {
+    notSearched,
+    // The suffix is a prefix of at least one key.
+    found,
+    notFound,
+};
+
+// Queries are const and reentrant: predict, predictSuffixes and predictPhrases can run on any number of threads
+// at once. The mapped file is never written and each thread searches with its own marisa agents.
+// The setters and preTouchHotSections can be called while queries run. open and close must not.
+class NGramModel {
+public:
+    static constexpr size_t kMaxNumberOfTerms = 30;
+    // Score penalty per char dropped from the context. 0.4 is the value from the Stupid Backoff paper.
+    static constexpr float kBackoffAlpha = 0.4f;
+    static const size_t kDefaultNumOfPhraseSteps = 3;
+    static const size_t kDefaultPhraseBeamWidth = 4;
+    // Bounds the memory a predictPhrases call allocates. Default phrase searches allocate around 40KB.
+    static const size_t kPhraseArenaCapacityInBytes = 256 * 1024;
+
+    NGramModel();
+    ~NGramModel();
+    NGramModel(const NGramModel&) = delete;
+    NGramModel& operator=(const NGramModel&) = delete;
+
+    // Maps the ngram file into memory. On failure, returns false and describes the failure in error.
+    bool open(const std::string& ngramFilePath, std::string& error);
+    void close();
+
+    bool isOpen() const { return header != nullptr; }
+    int maxN() const { return header != nullptr ? header->maxN : 0; }
+    size_t numOfPrecomputedPrefixes() const { return numOfTopKEntries; }
+    // True if the ngram file flags offensive keys, false if predict falls back to scanning each result.
+    bool hasOffensiveFlags() const { return isOffensiveList != nullptr || keyRecords != nullptr; }
+    // True if the ngram file stores the per-key data as NGramKeyRecord.
+    bool hasKeyRecords() const { return keyRecords != nullptr; }
+    // True if completions of keys are selected by scanning the lexRange sections instead of walking the trie.
+    bool hasLexRanges() const { return lexRanges != nullptr; }
+
+    // Applies the madvise hints of policy. Returns false if the kernel rejected any of them.
+    bool setResidencyPolicy(ResidencyPolicy policy);
+    ResidencyPolicy residencyPolicy() const { return residency; }
+    // Reads a byte of every page of the hot sections so later searches do not fault on them. Stops early once
+    // *isCancelled is true. Returns the number of bytes touched. The model must not be closed while this runs.
+    size_t preTouchHotSections(const std::atomic<bool>* isCancelled = nullptr) const;
+    // Returns how much of each section in the file is in memory, according to mincore.
+    std::vector<SectionResidency> sectionResidency() const;
+
+    // Mixes the user's counts into the weights. The overlay must outlive the model or be unset first.
+    // If the ngram file flags offensive keys, filtered predictions only suggest learned text that is a key.
+    void setOverlay(const NGramOverlay* overlay) { this->overlay = overlay; }
+    // True if the overlay recorded text after context. Such a context can have completions the ngram file lacks.
+    bool hasUserContinuations(std::string_view context) const;
+
+    // Measures PredictStats::stageDurationsInNs. Costs a couple of clock reads per selected key.
+    bool stageTimingEnabled() const { return isStageTimingEnabled; }
+    void setStageTimingEnabled(bool isEnabled) { isStageTimingEnabled = isEnabled; }
+
+    ScoringMode scoringMode() const { return scoring; }
+    void setScoringMode(ScoringMode scoringMode) { scoring = scoringMode; }
+
+    // Returns the suffix of context predict reads, i.e. its last maxN - 1 code points.
+    std::string_view effectiveContext(std::string_view context) const;
+
+    // Returns up to kMaxNumberOfTerms texts likely to follow context. context must be in UTF-8.
+    std::vector<std::string> predict(std::string_view context, bool shouldFilterOffensiveWords, PredictStats* stats = nullptr,
+                                     const PredictBudget* budget = nullptr) const;
+
+    // Like predict, but only searches the given suffixes of the context, longest first.
+    // If suffixSearchResults is set, it receives whether each suffix was searched and had any completion.
+    std::vector<std::string> predictSuffixes(const std::vector<std::string_view>& suffixes, bool shouldFilterOffensiveWords,
+                                             std::vector<SuffixSearchResult>* suffixSearchResults, PredictStats* stats = nullptr,
+                                             const PredictBudget* budget = nullptr) const;
+
+    // Returns phrases of up to numOfSteps predictions likely to follow context, best first.
+    // Each step extends the best beamWidth phrases so far by their best beamWidth predictions.
+    // Phrases are always scored with Stupid Backoff and ranked by their mean log score per step.
+    // The search stops early, like when the budget runs out, once it has allocated kPhraseArenaCapacityInBytes.
+    std::vector<std::string> predictPhrases(std::string_view context, bool shouldFilterOffensiveWords,
+                                            size_t numOfSteps = kDefaultNumOfPhraseSteps, size_t beamWidth = kDefaultPhraseBeamWidth,
+                                            PredictStats* stats = nullptr, const PredictBudget* budget = nullptr) const;
+
+    // Returns the natural log of the Stupid Backoff score of each candidate following context, in the order of candidates.
+    // Unlike predict, a candidate no suffix of the context is followed by falls back to its own weight. Candidates that
+    // are not keys at all score -infinity. Each suffix of the context is looked up once for all candidates, then each
+    // suffix + candidate is looked up from the root, as marisa cannot resume a lookup from the node of the suffix.
+    // Candidates are scored as given: the overlay, the word rules and the offensive word filter of predict do not apply.
+    // If the budget runs out, unscored candidates stay at -infinity.
+    std::vector<float> scoreContinuations(std::string_view context, const std::vector<std::string_view>& candidates,
+                                          PredictStats* stats = nullptr, const PredictBudget* budget = nullptr) const;
+
+private:
+    struct RankedKey {
+        size_t keyId;
+        float weight;
+    };
+
+    struct ScoredResult {
+        // Owned by the arena of the query.
+        std::string_view text;
+        float score;
+    };
+
+    static bool isHotSection(NGramSectionId sectionId);
+    // Returns the page aligned range holding the section.
+    bool sectionPages(NGramSectionId sectionId, char*& pagesStart, size_t& pagesLength) const;
+    float weightOf(size_t keyId) const {
+        if (keyRecords != nullptr) return weightCodeValues[keyRecords[keyId].weightCode];
+        if (weightCodes != nullptr) return weightCodeValues[weightCodes[keyId]];
+        // Version 0 weights are not 2 byte aligned in the file.
+        Fp16Weight bits;
+        memcpy(&bits, fp16Weights + keyId * sizeof(Fp16Weight), sizeof(bits));
+        return decodeFp16Weight(bits);
+    }
+    bool isWord(size_t keyId) const;
+    bool isOffensive(size_t keyId) const;
+    // Returns the number of code points of the key with id keyId after its first numOfPrefixCodePoints, i.e. of suffix.
+    size_t numOfSuffixCodePoints(size_t keyId, std::string_view suffix, size_t numOfPrefixCodePoints) const;
+    // Returns true if suffix, the key with id keyId without its first numOfPrefixCodePoints code points, is a word.
+    bool isSuffixWord(size_t keyId, std::string_view suffix, size_t numOfPrefixCodePoints) const;
+    const NGramTopKEntry* findPrecomputedTopK(std::string_view prefix) const;
+    // Returns true and flags stats if the budget has run out.
+    static bool isOverBudget(const PredictBudget* budget, PredictStats& stats);
+    bool selectTopKeys(std::string_view prefix, size_t capacity, ArenaVector<RankedKey>& topKeys,
+                       PredictStats& stats, const PredictBudget* budget) const;
+    // Like selectTopKeys, for the keys with ranks in [firstRank, endRank) of the lexRange sections.
+    bool selectTopKeysInRange(size_t firstRank, size_t endRank, size_t capacity, ArenaVector<RankedKey>& topKeys,
+                              PredictStats& stats, const PredictBudget* budget) const;
+    std::vector<std::string_view> suffixesOf(std::string_view context) const;
+    // Returns up to maxNumOfResults results following suffixes, ordered by their Stupid Backoff score.
+    // The results and everything the search allocates live in arena.
+    ArenaVector<ScoredResult> scoreSuffixesWithBackoff(Arena& arena, const std::vector<std::string_view>& suffixes, size_t maxNumOfResults,
+                                                       bool shouldFilterOffensiveWords,
+                                                       std::vector<SuffixSearchResult>* suffixSearchResults,
+                                                       PredictStats& stats, const PredictBudget* budget) const;
+    // Appends results to output until it has maxNumOfResults. If outputWeights is set, it receives the weight of each result.
+    // The texts of the results are allocated in arena. Returns true if prefix has any completion.
+    bool search(Arena& arena, std::string_view prefix, size_t maxNumOfResults, ArenaVector<std::string_view>& output,
+                ArenaVector<float>* outputWeights, ArenaStringSet& dedupSet, bool shouldFilterOffensiveWords, PredictStats& stats,
+                const PredictBudget* budget) const;
+    // Like search, but ignores the overlay.
+    bool searchTrie(Arena& arena, std::string_view prefix, size_t maxNumOfResults, ArenaVector<std::string_view>& output,
+                    ArenaVector<float>* outputWeights, ArenaStringSet& dedupSet, bool shouldFilterOffensiveWords, PredictStats& stats,
+                    const PredictBudget* budget) const;
+    void appendResults(Arena& arena, std::string_view prefix, const ArenaVector<RankedKey>& topKeys, size_t startIndex,
+                       size_t maxNumOfResults, ArenaVector<std::string_view>& output, ArenaVector<float>* outputWeights,
+                       ArenaStringSet& dedupSet, bool shouldFilterOffensiveWords, PredictStats& stats) const;
+
+    int fd;
+    size_t fileSize;
+    char* data;
+    const NGramHeader* header;
+    // One of them is set, depending on the file version and layout.
+    const NGramKeyRecord* keyRecords;
+    const char* fp16Weights;
+    const WeightCode* weightCodes;
+    // The probability of each weight code, i.e. exp of the codebook entries.
+    float weightCodeValues[kNumOfWeightCodes];
+    // Not set if the file has key records.
+    const char* isWordList;
+    const char* isOffensiveList;
+    const uint8_t* suffixWordMasks;
+    const NGramTopKEntry* topKEntries;
+    size_t numOfTopKEntries;
+    const uint32_t* topKKeyIds;
+    // Set if the file has the lexRange sections.
+    const NGramLexRange* lexRanges;
+    const uint32_t* lexKeyIds;
+    const WeightCode* lexWeightCodes;
+    marisa::Trie trie;
+    std::atomic<ScoringMode> scoring;
+    std::atomic<ResidencyPolicy> residency;
+    std::atomic<const NGramOverlay*> overlay;
+    std::atomic<bool> isStageTimingEnabled;
+};
+
+#endif  // NGRAMMODEL_H_
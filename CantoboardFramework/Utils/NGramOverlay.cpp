@@ -0,0 +1,312 @@
+//
+//  NGramOverlay.cpp
+//  CantoboardFramework
+//
+
+#include "NGramOverlay.h"
+#include "Utf8.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+
+using namespace std;
+
+// The user's counts of a context only outweigh the static weights once they add up to more than this.
+static const float kPriorCount = 4;
+
+NGramOverlay::NGramOverlay() : fd(-1), fileSize(0), compactedFileSize(0), compactionThreshold(kDefaultCompactionThresholdInBytes),
+    maxCompactedSize(kDefaultMaxCompactedSizeInBytes) {
+}
+
+NGramOverlay::~NGramOverlay() {
+    close();
+}
+
+uint32_t NGramOverlay::currentTimestamp() {
+    return (uint32_t)time(nullptr);
+}
+
+float NGramOverlay::decay(float count, uint32_t timestamp, uint32_t now) {
+    if (now <= timestamp) return count;
+    return count * (float)exp2(-(double)(now - timestamp) / kHalfLifeInSeconds);
+}
+
+bool NGramOverlay::isOpen() const {
+    shared_lock<shared_mutex> lock(mutex);
+    return fd != -1;
+}
+
+void NGramOverlay::close() {
+    unique_lock<shared_mutex> lock(mutex);
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+    fileSize = 0;
+    compactedFileSize = 0;
+    entries.clear();
+}
+
+bool NGramOverlay::open(const string& overlayFilePath, string& error) {
+    close();
+    unique_lock<shared_mutex> lock(mutex);
+
+    int newFd = ::open(overlayFilePath.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (newFd == -1) {
+        error = "Failed to open " + overlayFilePath + " overlay file. " + strerror(errno);
+        return false;
+    }
+
+    struct stat buf;
+    fstat(newFd, &buf);
+    size_t size = buf.st_size;
+    if (size == 0) {
+        const NGramOverlayHeader header;
+        if (write(newFd, &header, sizeof(header)) != sizeof(header)) {
+            error = string("Failed to write overlay file header. ") + strerror(errno);
+            ::close(newFd);
+            return false;
+        }
+        size = sizeof(header);
+    } else {
+        if (size < sizeof(NGramOverlayHeader)) {
+            error = "Overlay file " + overlayFilePath + " is too small.";
+            ::close(newFd);
+            return false;
+        }
+        const char* data = (const char*)mmap(nullptr, size, PROT_READ, MAP_SHARED, newFd, 0);
+        if (data == MAP_FAILED) {
+            error = string("Failed to mmap overlay file. ") + strerror(errno);
+            ::close(newFd);
+            return false;
+        }
+
+        const NGramOverlayHeader* header = (const NGramOverlayHeader*)data;
+        if (memcmp(header->magicHeader, NGramOverlayHeader().magicHeader, sizeof(header->magicHeader)) != 0 || header->version != 0) {
+            error = "Unsupported overlay file " + overlayFilePath + ".";
+            munmap((void*)data, size);
+            ::close(newFd);
+            return false;
+        }
+
+        size_t offset = header->headerSizeInBytes;
+        while (offset + sizeof(NGramOverlayRecord) <= size) {
+            const NGramOverlayRecord* record = (const NGramOverlayRecord*)(data + offset);
+            const size_t recordSize = sizeof(NGramOverlayRecord) + record->contextLength + record->textLength;
+            if (offset + recordSize > size) break;
+            const char* context = data + offset + sizeof(NGramOverlayRecord);
+            apply(string_view(context, record->contextLength), string_view(context + record->contextLength, record->textLength),
+                  record->count, record->timestamp);
+            offset += recordSize;
+        }
+        munmap((void*)data, size);
+
+        // Drop the partial record left by a write interrupted by a crash.
+        if (offset < size && ftruncate(newFd, offset) == 0) size = offset;
+    }
+
+    path = overlayFilePath;
+    fd = newFd;
+    fileSize = size;
+    return true;
+}
+
+void NGramOverlay::apply(string_view context, string_view text, float count, uint32_t timestamp) {
+    auto it = entries.find(context);
+    if (it == entries.end()) {
+        auto entry = make_unique<ContextEntry>();
+        entry->context = string(context);
+        const string_view key(entry->context);
+        it = entries.emplace(key, move(entry)).first;
+    }
+
+    vector<Continuation>& continuations = it->second->continuations;
+    for (Continuation& continuation : continuations) {
+        if (continuation.text == text) {
+            continuation.count = decay(continuation.count, continuation.timestamp, timestamp) + count;
+            continuation.timestamp = max(continuation.timestamp, timestamp);
+            return;
+        }
+    }
+    continuations.push_back({ string(text), count, timestamp });
+}
+
+static void appendRecord(string& buffer, string_view context, string_view text, float count, uint32_t timestamp) {
+    const NGramOverlayRecord record({ timestamp, count, (uint8_t)context.length(), (uint8_t)text.length() });
+    buffer.append((const char*)&record, sizeof(record));
+    buffer.append(context);
+    buffer.append(text);
+}
+
+bool NGramOverlay::record(string_view context, string_view text, size_t maxContextLength, uint32_t now) {
+    if (text.empty() || text.length() > UINT8_MAX) return false;
+    for (size_t i = 0; i < text.length(); i = nextCodePointIndex(text, i)) {
+        if (!isCjkCodePoint(decodeCodePoint(text, i))) return false;
+    }
+
+    // Only the CJK chars right before the text are context, the model has nothing to say about the rest.
+    size_t contextStartIndex = context.length();
+    for (size_t contextLength = 0; contextStartIndex > 0 && contextLength < maxContextLength; ++contextLength) {
+        const size_t previousIndex = previousCodePointIndex(context, contextStartIndex);
+        if (!isCjkCodePoint(decodeCodePoint(context, previousIndex))) break;
+        contextStartIndex = previousIndex;
+    }
+    context = context.substr(contextStartIndex);
+    if (context.empty()) return false;
+
+    unique_lock<shared_mutex> lock(mutex);
+    if (fd == -1) return false;
+
+    // Write all suffixes in one call, so a crash loses either all or none of them.
+    string buffer;
+    for (size_t i = 0; i < context.length(); i = nextCodePointIndex(context, i)) {
+        const string_view suffix = context.substr(i);
+        apply(suffix, text, 1, now);
+        appendRecord(buffer, suffix, text, 1, now);
+    }
+    if (write(fd, buffer.data(), buffer.length()) == (ssize_t)buffer.length()) {
+        fileSize += buffer.length();
+    }
+    return true;
+}
+
+bool NGramOverlay::findContinuations(string_view context, Arena& arena, ArenaVector<NGramOverlayContinuation>& continuations,
+                                     float& confidence, uint32_t now) const {
+    continuations.clear();
+    shared_lock<shared_mutex> lock(mutex);
+    if (entries.empty()) return false;
+    auto it = entries.find(context);
+    if (it == entries.end()) return false;
+
+    float totalCount = 0;
+    continuations.reserve(it->second->continuations.size());
+    for (const Continuation& continuation : it->second->continuations) {
+        const float count = decay(continuation.count, continuation.timestamp, now);
+        continuations.push_back({ arena.concat(continuation.text), count });
+        totalCount += count;
+    }
+    if (totalCount <= 0) {
+        continuations.clear();
+        return false;
+    }
+    for (NGramOverlayContinuation& continuation : continuations) {
+        continuation.prob /= totalCount;
+    }
+    confidence = totalCount / (totalCount + kPriorCount);
+    return true;
+}
+
+bool NGramOverlay::hasContext(string_view context) const {
+    shared_lock<shared_mutex> lock(mutex);
+    return entries.find(context) != entries.end();
+}
+
+size_t NGramOverlay::fileSizeInBytes() const {
+    shared_lock<shared_mutex> lock(mutex);
+    return fileSize;
+}
+
+bool NGramOverlay::needsCompaction() const {
+    shared_lock<shared_mutex> lock(mutex);
+    return fileSize > max(compactionThreshold, 2 * compactedFileSize);
+}
+
+size_t NGramOverlay::numOfContexts() const {
+    shared_lock<shared_mutex> lock(mutex);
+    return entries.size();
+}
+
+bool NGramOverlay::compact(string& error, uint32_t now) {
+    unique_lock<shared_mutex> lock(mutex);
+    if (fd == -1) {
+        error = "Overlay is not open.";
+        return false;
+    }
+
+    struct LivePair {
+        const ContextEntry* entry;
+        const Continuation* continuation;
+        float count;
+    };
+    vector<LivePair> livePairs;
+    size_t liveSizeInBytes = sizeof(NGramOverlayHeader);
+    for (const auto& keyAndEntry : entries) {
+        const ContextEntry& entry = *keyAndEntry.second;
+        for (const Continuation& continuation : entry.continuations) {
+            const float count = decay(continuation.count, continuation.timestamp, now);
+            if (count < kMinCount) continue;
+            livePairs.push_back({ &entry, &continuation, count });
+            liveSizeInBytes += sizeof(NGramOverlayRecord) + entry.context.length() + continuation.text.length();
+        }
+    }
+    // Keep the pairs the user typed most, so the file stays bounded however much is still live.
+    if (liveSizeInBytes > maxCompactedSize) {
+        stable_sort(livePairs.begin(), livePairs.end(), [](const LivePair& pair1, const LivePair& pair2) {
+            return pair1.count > pair2.count;
+        });
+        size_t keptSizeInBytes = sizeof(NGramOverlayHeader);
+        size_t numOfKeptPairs = 0;
+        for (; numOfKeptPairs < livePairs.size(); ++numOfKeptPairs) {
+            const LivePair& pair = livePairs[numOfKeptPairs];
+            const size_t recordSize = sizeof(NGramOverlayRecord) + pair.entry->context.length() + pair.continuation->text.length();
+            if (keptSizeInBytes + recordSize > maxCompactedSize) break;
+            keptSizeInBytes += recordSize;
+        }
+        livePairs.resize(numOfKeptPairs);
+    }
+
+    const NGramOverlayHeader header;
+    string buffer((const char*)&header, sizeof(header));
+    unordered_map<string_view, unique_ptr<ContextEntry>> liveEntries;
+    for (const LivePair& pair : livePairs) {
+        appendRecord(buffer, pair.entry->context, pair.continuation->text, pair.count, now);
+        auto it = liveEntries.find(pair.entry->context);
+        if (it == liveEntries.end()) {
+            auto entry = make_unique<ContextEntry>();
+            entry->context = pair.entry->context;
+            const string_view key(entry->context);
+            it = liveEntries.emplace(key, move(entry)).first;
+        }
+        it->second->continuations.push_back({ pair.continuation->text, pair.count, now });
+    }
+    entries.swap(liveEntries);
+
+    // Write a new file and swap it in, so a crash during compaction keeps the old file intact.
+    const string compactedFilePath = path + ".compacting";
+    int compactedFd = ::open(compactedFilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (compactedFd == -1) {
+        error = "Failed to create " + compactedFilePath + ". " + strerror(errno);
+        return false;
+    }
+    if (write(compactedFd, buffer.data(), buffer.length()) != (ssize_t)buffer.length() || fsync(compactedFd) != 0) {
+        error = string("Failed to write compacted overlay file. ") + strerror(errno);
+        ::close(compactedFd);
+        unlink(compactedFilePath.c_str());
+        return false;
+    }
+    ::close(compactedFd);
+    if (rename(compactedFilePath.c_str(), path.c_str()) != 0) {
+        error = string("Failed to replace overlay file. ") + strerror(errno);
+        unlink(compactedFilePath.c_str());
+        return false;
+    }
+
+    ::close(fd);
+    fd = ::open(path.c_str(), O_RDWR | O_APPEND);
+    if (fd == -1) {
+        error = "Failed to reopen " + path + " overlay file. " + strerror(errno);
+        fileSize = 0;
+        return false;
+    }
+    fileSize = buffer.length();
+    compactedFileSize = fileSize;
+    return true;
+}
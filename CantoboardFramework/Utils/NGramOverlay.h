@@ -0,0 +1,124 @@
+//
+//  NGramOverlay.h
+//  CantoboardFramework
+//
+//  Per-user counts of committed text. NGramModel mixes them into the static ngram weights at query time,
+//  so predictions adapt to what the user actually types.
+//
+
+#ifndef NGRAMOVERLAY_H_
+#define NGRAMOVERLAY_H_
+
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "Arena.h"
+
+#pragma pack(push,1)
+
+// The overlay file is an append-only log: the header followed by NGramOverlayRecords.
+struct NGramOverlayHeader {
+    const char magicHeader[8] = {'C', 'A', 'N', 'T', 'O', 'V', 'L', 'Y'};
+    uint16_t headerSizeInBytes = sizeof(NGramOverlayHeader);
+    uint16_t version = 0;
+};
+
+// Followed by contextLength bytes of context then textLength bytes of text, both in UTF-8.
+// Appending a record adds count to the (context, text) pair, decaying the previous count to timestamp first.
+struct NGramOverlayRecord {
+    // Seconds since the Unix epoch.
+    uint32_t timestamp;
+    float count;
+    uint8_t contextLength;
+    uint8_t textLength;
+};
+
+#pragma pack(pop)
+
+struct NGramOverlayContinuation {
+    // Owned by the arena passed to findContinuations.
+    std::string_view text;
+    // P(text | context) estimated from the user's decayed counts.
+    float prob;
+};
+
+class NGramOverlay {
+public:
+    static const size_t kDefaultCompactionThresholdInBytes = 256 * 1024;
+    static const size_t kDefaultMaxCompactedSizeInBytes = 128 * 1024;
+    // Counts halve every 30 days without use.
+    static constexpr double kHalfLifeInSeconds = 30 * 24 * 3600;
+    // Pairs whose count decayed below this are dropped on compaction.
+    static constexpr float kMinCount = 0.05f;
+
+    NGramOverlay();
+    ~NGramOverlay();
+    NGramOverlay(const NGramOverlay&) = delete;
+    NGramOverlay& operator=(const NGramOverlay&) = delete;
+
+    // Loads the overlay file, creating it if it does not exist. On failure, returns false and describes the failure in error.
+    bool open(const std::string& overlayFilePath, std::string& error);
+    void close();
+    bool isOpen() const;
+
+    // Records that text was committed after context. Only the CJK text is recorded, under every suffix of the context
+    // with up to maxContextLength code points. Returns false if nothing was recorded.
+    bool record(std::string_view context, std::string_view text, size_t maxContextLength, uint32_t now = currentTimestamp());
+
+    // Returns false if context was never recorded. Otherwise fills continuations and sets confidence to how much
+    // the user's counts should be trusted over the static weights, between 0 and 1. The texts are copied into arena,
+    // so lookups do not allocate on the heap.
+    bool findContinuations(std::string_view context, Arena& arena, ArenaVector<NGramOverlayContinuation>& continuations,
+                           float& confidence, uint32_t now = currentTimestamp()) const;
+    // True if text was ever recorded after context. Cheaper than findContinuations.
+    bool hasContext(std::string_view context) const;
+
+    size_t fileSizeInBytes() const;
+    size_t compactionThresholdInBytes() const { return compactionThreshold; }
+    void setCompactionThresholdInBytes(size_t thresholdInBytes) { compactionThreshold = thresholdInBytes; }
+    size_t maxCompactedSizeInBytes() const { return maxCompactedSize; }
+    void setMaxCompactedSizeInBytes(size_t maxSizeInBytes) { maxCompactedSize = maxSizeInBytes; }
+    // True once the file outgrows both the compaction threshold and twice its size after the last compaction,
+    // so a file whose live pairs alone exceed the threshold is not compacted again on every record.
+    bool needsCompaction() const;
+    // Rewrites the file with one record per pair, dropping the pairs that decayed away. If the rest is still larger
+    // than maxCompactedSizeInBytes, the pairs with the lowest counts are dropped until it fits.
+    bool compact(std::string& error, uint32_t now = currentTimestamp());
+
+    size_t numOfContexts() const;
+
+    static uint32_t currentTimestamp();
+
+private:
+    struct Continuation {
+        std::string text;
+        float count;
+        uint32_t timestamp;
+    };
+    struct ContextEntry {
+        std::string context;
+        std::vector<Continuation> continuations;
+    };
+
+    static float decay(float count, uint32_t timestamp, uint32_t now);
+    void apply(std::string_view context, std::string_view text, float count, uint32_t timestamp);
+    bool append(std::string_view context, std::string_view text, float count, uint32_t timestamp);
+
+    mutable std::shared_mutex mutex;
+    std::string path;
+    int fd;
+    size_t fileSize;
+    // Size of the file after the last compaction since it was opened, 0 before the first.
+    size_t compactedFileSize;
+    size_t compactionThreshold;
+    size_t maxCompactedSize;
+    // Keys point into the owned ContextEntry::context.
+    std::unordered_map<std::string_view, std::unique_ptr<ContextEntry>> entries;
+};
+
+#endif  // NGRAMOVERLAY_H_
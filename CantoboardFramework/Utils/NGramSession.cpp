@@ -0,0 +1,92 @@
+//
+//  NGramSession.cpp
+//  CantoboardFramework
+//
+
+#include "NGramSession.h"
+#include "Utf8.h"
+
+using namespace std;
+
+NGramSession::NGramSession(const NGramModel& model) : model(model) {
+}
+
+void NGramSession::reset(string_view context) {
+    effectiveContext.clear();
+    suffixStartIndices.clear();
+    suffixSearchResults.clear();
+    append(model.effectiveContext(context));
+}
+
+void NGramSession::append(string_view text) {
+    for (size_t currentIndex = 0; currentIndex < text.length();) {
+        size_t nextIndex = nextCodePointIndex(text, currentIndex);
+        // Existing suffixes get longer. The ones without completions stay without completions.
+        for (SuffixSearchResult& suffixSearchResult : suffixSearchResults) {
+            if (suffixSearchResult != SuffixSearchResult::notFound) {
+                suffixSearchResult = SuffixSearchResult::notSearched;
+            }
+        }
+        suffixStartIndices.push_back(effectiveContext.length());
+        suffixSearchResults.push_back(SuffixSearchResult::notSearched);
+        effectiveContext.append(text.substr(currentIndex, nextIndex - currentIndex));
+        currentIndex = nextIndex;
+    }
+    trimToMaxLength();
+}
+
+void NGramSession::update(string_view context) {
+    context = model.effectiveContext(context);
+    // Find the longest suffix of the current context the new context starts with.
+    // The suffix states only depend on the suffix text, so any match is a valid alignment.
+    for (size_t i = 0; i < suffixStartIndices.size(); ++i) {
+        string_view remainingContext = string_view(effectiveContext).substr(suffixStartIndices[i]);
+        if (context.length() >= remainingContext.length() && context.substr(0, remainingContext.length()) == remainingContext) {
+            const size_t numOfDroppedBytes = suffixStartIndices[i];
+            effectiveContext.erase(0, numOfDroppedBytes);
+            suffixStartIndices.erase(suffixStartIndices.begin(), suffixStartIndices.begin() + i);
+            suffixSearchResults.erase(suffixSearchResults.begin(), suffixSearchResults.begin() + i);
+            for (size_t& suffixStartIndex : suffixStartIndices) {
+                suffixStartIndex -= numOfDroppedBytes;
+            }
+            append(context.substr(remainingContext.length()));
+            return;
+        }
+    }
+    reset(context);
+}
+
+void NGramSession::trimToMaxLength() {
+    const size_t maxNumOfSuffixes = model.maxN() > 1 ? model.maxN() - 1 : 0;
+    if (suffixStartIndices.size() <= maxNumOfSuffixes) return;
+
+    const size_t numOfSuffixesToDrop = suffixStartIndices.size() - maxNumOfSuffixes;
+    const size_t numOfDroppedBytes = maxNumOfSuffixes > 0 ? suffixStartIndices[numOfSuffixesToDrop] : effectiveContext.length();
+    effectiveContext.erase(0, numOfDroppedBytes);
+    suffixStartIndices.erase(suffixStartIndices.begin(), suffixStartIndices.begin() + numOfSuffixesToDrop);
+    suffixSearchResults.erase(suffixSearchResults.begin(), suffixSearchResults.begin() + numOfSuffixesToDrop);
+    for (size_t& suffixStartIndex : suffixStartIndices) {
+        suffixStartIndex -= numOfDroppedBytes;
+    }
+}
+
+vector<string> NGramSession::predict(bool shouldFilterOffensiveWords, PredictStats* stats, const PredictBudget* budget) {
+    vector<string_view> suffixes;
+    vector<size_t> suffixIndices;
+    for (size_t i = 0; i < suffixStartIndices.size(); ++i) {
+        const string_view suffix = string_view(effectiveContext).substr(suffixStartIndices[i]);
+        // The overlay can learn continuations of any context, so only the ngram file's answer is cached.
+        if (suffixSearchResults[i] == SuffixSearchResult::notFound && !model.hasUserContinuations(suffix)) continue;
+        suffixes.push_back(suffix);
+        suffixIndices.push_back(i);
+    }
+
+    vector<SuffixSearchResult> searchResults;
+    vector<string> results = model.predictSuffixes(suffixes, shouldFilterOffensiveWords, &searchResults, stats, budget);
+    for (size_t i = 0; i < suffixIndices.size(); ++i) {
+        if (searchResults[i] != SuffixSearchResult::notSearched) {
+            suffixSearchResults[suffixIndices[i]] = searchResults[i];
+        }
+    }
+    return results;
+}
@@ -0,0 +1,52 @@
+//
+//  NGramSession.h
+//  CantoboardFramework
+//
+//  Incremental prediction over a context that grows one commit at a time.
+//
+
+#ifndef NGRAMSESSION_H_
+#define NGRAMSESSION_H_
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "NGramModel.h"
+
+// Remembers which suffixes of the context have no completion in the model.
+// If suffix s has no completion in the ngram file, neither does s + c, so after appending text those suffixes are
+// skipped instead of being searched again, unless the model's overlay learned continuations for them since.
+// Typed text quickly stops matching long keys, so the number of searches per commit stays small instead of
+// growing with maxN.
+// marisa does not expose a way to resume a search from a previous agent state, so live suffixes are
+// still searched from the root. Those descents are bounded by maxN chars.
+// Sessions are not thread safe. Threads sharing a model each need their own session.
+class NGramSession {
+public:
+    explicit NGramSession(const NGramModel& model);
+
+    // Starts over from context, e.g. after backspace or moving the caret.
+    void reset(std::string_view context);
+    // Appends committed text to the context.
+    void append(std::string_view text);
+    // Moves to context, appending to the current context if context extends it, resetting otherwise.
+    void update(std::string_view context);
+
+    std::vector<std::string> predict(bool shouldFilterOffensiveWords, PredictStats* stats = nullptr,
+                                     const PredictBudget* budget = nullptr);
+
+    const std::string& context() const { return effectiveContext; }
+
+private:
+    void trimToMaxLength();
+
+    const NGramModel& model;
+    // The last maxN - 1 code points of the context.
+    std::string effectiveContext;
+    // Byte offset and search result of each suffix of effectiveContext, longest first.
+    std::vector<size_t> suffixStartIndices;
+    std::vector<SuffixSearchResult> suffixSearchResults;
+};
+
+#endif  // NGRAMSESSION_H_
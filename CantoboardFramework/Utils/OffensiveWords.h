@@ -0,0 +1,17 @@
+//
+//  OffensiveWords.h
+//  CantoboardFramework
+//
+//  Words that make a prediction offensive. NGramModel filters keys containing them when the ngram file has no
+//  isOffensive section. NGramBuilder flags the same keys, plus those matching NGramBuilder/offensive-words.txt.
+//
+
+#ifndef OFFENSIVE_WORDS_H_
+#define OFFENSIVE_WORDS_H_
+
+static const char* const builtInOffensiveWords[] = {
+    "屌", "𨳒", "鳩", "𨳊", "閪", "撚", "柒", "仆街", "老母", "老味", // TC
+    "鸠" // SC
+};
+
+#endif  // OFFENSIVE_WORDS_H_
@@ -0,0 +1,118 @@
+//
+//  PredictMetrics.cpp
+//  CantoboardFramework
+//
+
+#include "PredictMetrics.h"
+
+#include <cstdio>
+
+using namespace std;
+
+const char* toString(PredictStage stage) {
+    switch (stage) {
+        case PredictStage::suffixWalk: return "suffixWalk";
+        case PredictStage::trieTraversal: return "trieTraversal";
+        case PredictStage::materialization: return "materialization";
+        case PredictStage::filtering: return "filtering";
+        case PredictStage::stringConversion: return "stringConversion";
+        case PredictStage::total: return "total";
+    }
+    return "unknown";
+}
+
+const char* toString(PredictCounter counter) {
+    switch (counter) {
+        case PredictCounter::predictions: return "predictions";
+        case PredictCounter::cacheHits: return "cacheHits";
+        case PredictCounter::visitedKeys: return "visitedKeys";
+        case PredictCounter::droppedResults: return "droppedResults";
+        case PredictCounter::offensiveResults: return "offensiveResults";
+        case PredictCounter::timedOutPredictions: return "timedOutPredictions";
+        case PredictCounter::cancelledPredictions: return "cancelledPredictions";
+    }
+    return "unknown";
+}
+
+LatencyHistogram::LatencyHistogram() {
+    reset();
+}
+
+void LatencyHistogram::reset() {
+    for (auto& bucket : buckets) bucket.store(0, memory_order_relaxed);
+    numOfValues.store(0, memory_order_relaxed);
+    sum.store(0, memory_order_relaxed);
+    maxValue.store(0, memory_order_relaxed);
+}
+
+size_t LatencyHistogram::bucketIndexOf(uint64_t value) {
+    if (value < kNumOfSubBuckets) return value;
+    // kNumOfSubBuckets is 2^3. Keep the 3 bits after the leading one as the sub bucket.
+    const size_t exponent = 63 - __builtin_clzll(value);
+    const size_t subBucket = (value >> (exponent - 3)) & (kNumOfSubBuckets - 1);
+    return min(kNumOfBuckets - 1, (exponent - 2) * kNumOfSubBuckets + subBucket);
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t bucketIndex) {
+    if (bucketIndex < kNumOfSubBuckets) return bucketIndex;
+    const size_t exponent = bucketIndex / kNumOfSubBuckets + 2;
+    const uint64_t subBucket = bucketIndex % kNumOfSubBuckets;
+    return ((kNumOfSubBuckets + subBucket + 1) << (exponent - 3)) - 1;
+}
+
+void LatencyHistogram::record(uint64_t valueInNs) {
+    buckets[bucketIndexOf(valueInNs)].fetch_add(1, memory_order_relaxed);
+    numOfValues.fetch_add(1, memory_order_relaxed);
+    sum.fetch_add(valueInNs, memory_order_relaxed);
+    uint64_t currentMax = maxValue.load(memory_order_relaxed);
+    while (valueInNs > currentMax && !maxValue.compare_exchange_weak(currentMax, valueInNs, memory_order_relaxed));
+}
+
+double LatencyHistogram::mean() const {
+    const uint64_t n = count();
+    return n > 0 ? (double)sum.load(memory_order_relaxed) / n : 0;
+}
+
+uint64_t LatencyHistogram::percentile(double percentile) const {
+    const uint64_t n = count();
+    if (n == 0) return 0;
+    // Values recorded while reading may make the buckets add up to more than n, stop at the last bucket anyway.
+    const uint64_t rank = std::max<uint64_t>(1, (uint64_t)(percentile * n + 0.5));
+    uint64_t numOfValuesSeen = 0;
+    for (size_t i = 0; i < kNumOfBuckets; ++i) {
+        numOfValuesSeen += buckets[i].load(memory_order_relaxed);
+        if (numOfValuesSeen >= rank) return min(bucketUpperBound(i), max());
+    }
+    return max();
+}
+
+PredictMetrics::PredictMetrics() {
+    reset();
+}
+
+void PredictMetrics::reset() {
+    for (auto& histogram : histograms) histogram.reset();
+    for (auto& counter : counters) counter.store(0, memory_order_relaxed);
+}
+
+string PredictMetrics::toJson() const {
+    string json = "{\"stages\":{";
+    char buffer[256];
+    for (size_t i = 0; i < kNumOfPredictStages; ++i) {
+        const LatencyHistogram& histogram = histograms[i];
+        snprintf(buffer, sizeof(buffer),
+                 "%s\"%s\":{\"count\":%llu,\"meanUs\":%.1f,\"p50Us\":%.1f,\"p95Us\":%.1f,\"p99Us\":%.1f,\"maxUs\":%.1f}",
+                 i > 0 ? "," : "", toString((PredictStage)i), (unsigned long long)histogram.count(), histogram.mean() / 1000,
+                 histogram.percentile(0.5) / 1000.0, histogram.percentile(0.95) / 1000.0, histogram.percentile(0.99) / 1000.0,
+                 histogram.max() / 1000.0);
+        json += buffer;
+    }
+    json += "},\"counters\":{";
+    for (size_t i = 0; i < kNumOfPredictCounters; ++i) {
+        snprintf(buffer, sizeof(buffer), "%s\"%s\":%llu", i > 0 ? "," : "", toString((PredictCounter)i),
+                 (unsigned long long)counters[i].load(memory_order_relaxed));
+        json += buffer;
+    }
+    json += "}}";
+    return json;
+}
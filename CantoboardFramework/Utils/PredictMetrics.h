@@ -0,0 +1,94 @@
+//
+//  PredictMetrics.h
+//  CantoboardFramework
+//
+//  Lock-free latency histograms and counters of predict calls. Recording is a few relaxed atomic adds,
+//  so it can stay enabled on the keystroke path.
+//
+
+#ifndef PREDICTMETRICS_H_
+#define PREDICTMETRICS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+enum class PredictStage : uint8_t {
+    // Splitting the context into the suffixes to search.
+    suffixWalk,
+    // Enumerating trie keys or reading the precomputed completions.
+    trieTraversal,
+    // Reverse looking up the text of the selected keys.
+    materialization,
+    // Offensive word, word and duplicate checks.
+    filtering,
+    // Converting the results to NSString.
+    stringConversion,
+    // The whole predict call.
+    total,
+};
+static const size_t kNumOfPredictStages = (size_t)PredictStage::total + 1;
+
+enum class PredictCounter : uint8_t {
+    predictions,
+    cacheHits,
+    // Trie keys enumerated or read from the precomputed completions.
+    visitedKeys,
+    // Selected keys not returned: offensive, not a word or duplicated.
+    droppedResults,
+    offensiveResults,
+    timedOutPredictions,
+    cancelledPredictions,
+};
+static const size_t kNumOfPredictCounters = (size_t)PredictCounter::cancelledPredictions + 1;
+
+const char* toString(PredictStage stage);
+const char* toString(PredictCounter counter);
+
+// HDR-style histogram: each power of two is split into kNumOfSubBuckets linear buckets,
+// so every recorded value is within 1 / kNumOfSubBuckets of its bucket bounds.
+class LatencyHistogram {
+public:
+    static const size_t kNumOfSubBuckets = 8;
+    // Covers up to 2^40 ns, about 18 minutes.
+    static const size_t kNumOfBuckets = 40 * kNumOfSubBuckets;
+
+    LatencyHistogram();
+
+    void record(uint64_t valueInNs);
+    void reset();
+
+    uint64_t count() const { return numOfValues.load(std::memory_order_relaxed); }
+    uint64_t max() const { return maxValue.load(std::memory_order_relaxed); }
+    double mean() const;
+    // Returns the upper bound of the bucket holding the value at percentile, between 0 and 1.
+    uint64_t percentile(double percentile) const;
+
+private:
+    static size_t bucketIndexOf(uint64_t value);
+    static uint64_t bucketUpperBound(size_t bucketIndex);
+
+    std::atomic<uint64_t> buckets[kNumOfBuckets];
+    std::atomic<uint64_t> numOfValues, sum, maxValue;
+};
+
+class PredictMetrics {
+public:
+    PredictMetrics();
+
+    void record(PredictStage stage, uint64_t durationInNs) { histograms[(size_t)stage].record(durationInNs); }
+    void increment(PredictCounter counter, uint64_t delta = 1) { counters[(size_t)counter].fetch_add(delta, std::memory_order_relaxed); }
+    void reset();
+
+    const LatencyHistogram& histogram(PredictStage stage) const { return histograms[(size_t)stage]; }
+    uint64_t counter(PredictCounter counter) const { return counters[(size_t)counter].load(std::memory_order_relaxed); }
+
+    // e.g. {"stages":{"total":{"count":3,"meanUs":120.5,"p50Us":110.0,...}},"counters":{"predictions":3,...}}
+    std::string toJson() const;
+
+private:
+    LatencyHistogram histograms[kNumOfPredictStages];
+    std::atomic<uint64_t> counters[kNumOfPredictCounters];
+};
+
+#endif  // PREDICTMETRICS_H_
@@ -0,0 +1,127 @@
+//
+//  PredictionCache.cpp
+//  CantoboardFramework
+//
+
+#include "PredictionCache.h"
+
+using namespace std;
+
+// Rough per entry bookkeeping cost: list node, hash node, vector and string headers.
+static const size_t kEntryOverheadInBytes = 128;
+
+PredictionCache::PredictionCache(size_t capacityInBytes) :
+    capacity(capacityInBytes), size(0), numOfHits(0), numOfMisses(0), numOfInvalidations(0) {
+}
+
+string PredictionCache::makeKey(string_view effectiveContext, bool shouldFilterOffensiveWords) {
+    string key;
+    key.reserve(effectiveContext.length() + 1);
+    // The flag byte is never part of a valid UTF-8 context.
+    key.push_back(shouldFilterOffensiveWords ? '\xff' : '\xfe');
+    key.append(effectiveContext);
+    return key;
+}
+
+bool PredictionCache::get(string_view effectiveContext, bool shouldFilterOffensiveWords, vector<string>& results) {
+    const string key = makeKey(effectiveContext, shouldFilterOffensiveWords);
+    lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(key);
+    if (it == index.end()) {
+        numOfMisses++;
+        return false;
+    }
+    numOfHits++;
+    entries.splice(entries.begin(), entries, it->second);
+    results = it->second->results;
+    return true;
+}
+
+void PredictionCache::put(string_view effectiveContext, bool shouldFilterOffensiveWords, const vector<string>& results,
+                          size_t generation) {
+    Entry entry({ makeKey(effectiveContext, shouldFilterOffensiveWords), results, kEntryOverheadInBytes });
+    entry.sizeInBytes += entry.key.capacity();
+    for (const string& result : results) {
+        entry.sizeInBytes += sizeof(string) + result.capacity();
+    }
+
+    lock_guard<std::mutex> lock(mutex);
+    if (generation != numOfInvalidations || entry.sizeInBytes > capacity) return;
+
+    auto it = index.find(entry.key);
+    if (it != index.end()) {
+        auto entryIt = it->second;
+        size -= entryIt->sizeInBytes;
+        index.erase(it);
+        entries.erase(entryIt);
+    }
+    size += entry.sizeInBytes;
+    entries.push_front(move(entry));
+    index[entries.front().key] = entries.begin();
+    evictToFit();
+}
+
+void PredictionCache::clear() {
+    lock_guard<std::mutex> lock(mutex);
+    index.clear();
+    entries.clear();
+    size = 0;
+    numOfInvalidations++;
+}
+
+void PredictionCache::invalidateContextsEndingWith(string_view suffix) {
+    lock_guard<std::mutex> lock(mutex);
+    for (auto it = entries.begin(); it != entries.end();) {
+        // Skip the flag byte of the key.
+        const string_view context = string_view(it->key).substr(1);
+        if (context.length() >= suffix.length() && context.compare(context.length() - suffix.length(), suffix.length(), suffix) == 0) {
+            size -= it->sizeInBytes;
+            index.erase(it->key);
+            it = entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    // A put computed before the invalidation may hold results it just removed.
+    numOfInvalidations++;
+}
+
+size_t PredictionCache::generation() const {
+    lock_guard<std::mutex> lock(mutex);
+    return numOfInvalidations;
+}
+
+size_t PredictionCache::capacityInBytes() const {
+    lock_guard<std::mutex> lock(mutex);
+    return capacity;
+}
+
+void PredictionCache::setCapacityInBytes(size_t capacityInBytes) {
+    lock_guard<std::mutex> lock(mutex);
+    capacity = capacityInBytes;
+    evictToFit();
+}
+
+void PredictionCache::evictToFit() {
+    while (size > capacity && !entries.empty()) {
+        const Entry& leastRecentlyUsed = entries.back();
+        size -= leastRecentlyUsed.sizeInBytes;
+        index.erase(leastRecentlyUsed.key);
+        entries.pop_back();
+    }
+}
+
+size_t PredictionCache::sizeInBytes() const {
+    lock_guard<std::mutex> lock(mutex);
+    return size;
+}
+
+size_t PredictionCache::hits() const {
+    lock_guard<std::mutex> lock(mutex);
+    return numOfHits;
+}
+
+size_t PredictionCache::misses() const {
+    lock_guard<std::mutex> lock(mutex);
+    return numOfMisses;
+}
@@ -0,0 +1,64 @@
+//
+//  PredictionCache.h
+//  CantoboardFramework
+//
+//  LRU cache of NGramModel::predict results, bounded by an approximate memory footprint.
+//
+
+#ifndef PREDICTIONCACHE_H_
+#define PREDICTIONCACHE_H_
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class PredictionCache {
+public:
+    static const size_t kDefaultCapacityInBytes = 64 * 1024;
+
+    explicit PredictionCache(size_t capacityInBytes = kDefaultCapacityInBytes);
+
+    // effectiveContext should be the part of the context the model actually reads, so that contexts
+    // differing only in older text share an entry.
+    bool get(std::string_view effectiveContext, bool shouldFilterOffensiveWords, std::vector<std::string>& results);
+    // generation is the value of generation() read before computing results. If the cache was cleared since,
+    // the results may be stale and are not stored.
+    void put(std::string_view effectiveContext, bool shouldFilterOffensiveWords, const std::vector<std::string>& results,
+             size_t generation);
+    void clear();
+    // Removes the entries of the contexts ending with suffix, e.g. after the model learned a continuation of suffix.
+    void invalidateContextsEndingWith(std::string_view suffix);
+    // Incremented by every clear and invalidation.
+    size_t generation() const;
+
+    size_t capacityInBytes() const;
+    // Evicts least recently used entries until the cache fits.
+    void setCapacityInBytes(size_t capacityInBytes);
+
+    size_t sizeInBytes() const;
+    size_t hits() const;
+    size_t misses() const;
+
+private:
+    struct Entry {
+        std::string key;
+        std::vector<std::string> results;
+        size_t sizeInBytes;
+    };
+
+    static std::string makeKey(std::string_view effectiveContext, bool shouldFilterOffensiveWords);
+    void evictToFit();
+
+    mutable std::mutex mutex;
+    // Most recently used entry first.
+    std::list<Entry> entries;
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+    size_t capacity, size;
+    size_t numOfHits, numOfMisses;
+    size_t numOfInvalidations;
+};
+
+#endif  // PREDICTIONCACHE_H_
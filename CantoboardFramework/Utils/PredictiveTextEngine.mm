@@ -6,49 +6,96 @@
 //
 
 #import <Foundation/Foundation.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <algorithm>
-#include <set>
-#include <unordered_map>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <vector>
 
 #import <CocoaLumberjack/DDLogMacros.h>
 static const DDLogLevel ddLogLevel = DDLogLevelDebug;
 
-#include "marisa/trie.h"
-#include "NGram.h"
-#include "Utils.h"
+// Logging every prediction costs more than most cache hits. Use metricsJson to look at the latency instead.
+// #define DEBUG_PREDICTIONS
 
-static short kMaxNumberOfTerms = 30;
+#include "NGramModel.h"
+#include "NGramOverlay.h"
+#include "NGramSession.h"
+#include "PredictionCache.h"
+#include "PredictMetrics.h"
+#include "Utf8.h"
+#include "Utils.h"
 
 using namespace std;
-using namespace marisa;
 
-@interface NSString (Unicode)
-@property(readonly) NSUInteger lengthOfComposedChars;
+@interface PredictionSession ()
+- (NGramSession*)ngramSession;
 @end
 
-@implementation NSString (Unicode)
--(size_t) lengthOfComposedChars {
-    __block size_t count = 0;
-    [self enumerateSubstringsInRange:NSMakeRange(0, [self length])
-                             options:NSStringEnumerationByComposedCharacterSequences
-                          usingBlock:^(NSString * _Nullable substring, NSRange substringRange, NSRange enclosingRange, BOOL * _Nonnull stop) {
-        count++;
-    }];
-    return count;
-}
+@interface PredictiveTextEngine ()
+- (NSArray*)predict:(NSString*) context filterOffensiveWords:(bool) shouldFilterOffensiveWords session:(NGramSession*) session
+             budget:(const PredictBudget*) budget stats:(PredictStats&) stats;
+- (void)recordMetrics:(const PredictStats&) stats;
+- (void)predictAsync:(NSString*) context filterOffensiveWords:(bool) shouldFilterOffensiveWords timeBudget:(NSTimeInterval) timeBudget
+             session:(PredictionSession*) session completion:(void (^)(NSArray*)) completion;
+- (const NGramModel&)model;
+- (bool)loadModel;
+- (shared_lock<shared_mutex>)lockLoadedModel;
+- (void)applyResidencyPolicy;
 @end
 
+static uint64_t nanosecondsSince(chrono::steady_clock::time_point startTime) {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - startTime).count();
+}
+
+static int64_t steadyClockNowInNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static NSArray* toNSArray(const vector<string>& results) {
+    NSMutableArray *finalResults = [[NSMutableArray alloc] initWithCapacity:results.size()];
+    for (const string& result : results) {
+        NSString *text = [[NSString alloc] initWithBytes:result.data()
+                                                  length:result.length()
+                                                encoding:NSUTF8StringEncoding];
+        if (text != nil) [finalResults addObject:text];
+    }
+    return finalResults;
+}
+
 @implementation PredictiveTextEngine {
-    int fd;
-    size_t fileSize;
-    char* data;
-    const NGramHeader* header;
-    const Weight* weights;
-    const char* isWordList;
-    Trie trie;
+    NGramModel model;
+    // Predictions hold it shared while reading the model, loading and unloading hold it exclusively.
+    shared_mutex modelMutex;
+    string modelFilePath;
+    // Set when the model was unloaded to save memory. The next prediction loads it again.
+    bool isUnloaded;
+    // maxN of the last loaded model, so learning does not need the model loaded.
+    atomic<int> modelMaxN;
+    atomic<size_t> numOfLoads, numOfUnloads;
+    atomic<uint64_t> totalLoadTimeInNs;
+    // steady_clock time of the last prediction or learn call, in ns.
+    atomic<int64_t> lastUseTimeInNs;
+    // Applied again every time the model is loaded.
+    NGramResidencyPolicy desiredResidencyPolicy;
+    // Each engine has its own cache, so switching between the hk and cn engines never returns stale results.
+    PredictionCache cache;
+    // Written by concurrent predict calls, so kept as separate atomics rather than a PredictStats.
+    atomic<size_t> lastPredictNumOfVisitedKeys, lastPredictNumOfSearches;
+    // Async predictions run one at a time on this queue. Issuing a request cancels the older ones.
+    dispatch_queue_t predictQueue;
+    atomic<uint64_t> latestRequestId;
+    PredictMetrics metrics;
+    NGramOverlay overlay;
+    // Recording and compacting the overlay write to disk, keep them off the main thread.
+    dispatch_queue_t overlayQueue;
+    // Pre-touching the hot sections runs here. It holds modelMutex shared and stops once isPreTouchCancelled is set.
+    dispatch_queue_t residencyQueue;
+    atomic<bool> isPreTouchCancelled;
 }
 
 - (void)dealloc {
@@ -56,206 +103,492 @@ using namespace marisa;
 }
 
 - (void)close {
-    if (data != nullptr && data != MAP_FAILED) {
-        header = nullptr;
-        weights = nullptr;
-        isWordList = nullptr;
+    isPreTouchCancelled = true;
+    unique_lock<shared_mutex> lock(modelMutex);
+    isPreTouchCancelled = false;
+    isUnloaded = false;
+    model.setOverlay(nullptr);
+    overlay.close();
+    if (model.isOpen()) {
+        DDLogInfo(@"Predictive text engine metrics: %s", metrics.toJson().c_str());
         DDLogInfo(@"Predictive text engine unmapping ngram table from memory...");
-        munmap(data, fileSize);
-        data = nullptr;
-        DDLogInfo(@"Predictive text engine unmapped ngram table from memory.");
-    }
-    if (fd != -1) {
-        close(fd);
-        fd = -1;
-        fileSize = 0;
+        model.close();
+        cache.clear();
         DDLogInfo(@"Predictive text engine closed ngram.");
     }
 }
 
 - (id)init:(NSString*) ngramFilePath {
+    return [self init:ngramFilePath overlayFilePath:nil];
+}
+
+- (id)init:(NSString*) ngramFilePath overlayFilePath:(NSString*) overlayFilePath {
     self = [super init];
     
-    fd = -1;
-    fileSize = 0;
-    data = nullptr;
-    header = nullptr;
-    weights = nullptr;
-    isWordList = nullptr;
-    
-    fd = open([ngramFilePath UTF8String], O_RDONLY);
-    
-    DDLogInfo(@"Predictive text engine opening ngram...");
-    if (fd == -1) {
-        NSString *s = [NSString stringWithFormat:@"Failed to open %@ ngram file. %s", ngramFilePath, strerror(errno)];
-        DDLogInfo(@"Error: %@", s);
-        return self;
-    }
-    
-    struct stat buf;
-    fstat(fd, &buf);
-    fileSize = buf.st_size;
-    data = (char*)mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
-    
-    DDLogInfo(@"Predictive text engine mapping ngram table into memory...");
-    if (data == MAP_FAILED) {
-        NSString *s = [NSString stringWithFormat:@"Predictive text engine failed to mmap ngram file. %s", strerror(errno)];
-        DDLogInfo(@"Error: %@", s);
-        [self close];
-        return self;
-    } else {
-        header = (NGramHeader*)data;
-        
-        if (header->version != 0) {
-            DDLogInfo(@"Predictive text engine doesn't support ngram file version %d.", header->version);
-            [self close];
-            return self;
+    predictQueue = dispatch_queue_create("org.cantoboard.PredictiveTextEngine", dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_USER_INTERACTIVE, 0));
+    latestRequestId = 0;
+    lastPredictNumOfVisitedKeys = 0;
+    lastPredictNumOfSearches = 0;
+    overlayQueue = dispatch_queue_create("org.cantoboard.PredictiveTextEngine.overlay", dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_UTILITY, 0));
+    residencyQueue = dispatch_queue_create("org.cantoboard.PredictiveTextEngine.residency", dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_UTILITY, 0));
+    isPreTouchCancelled = false;
+    isUnloaded = false;
+    modelMaxN = 0;
+    numOfLoads = 0;
+    numOfUnloads = 0;
+    totalLoadTimeInNs = 0;
+    lastUseTimeInNs = steadyClockNowInNs();
+    desiredResidencyPolicy = NGramResidencyPolicyDemandPaging;
+
+    const char* ngramFilePathCStr = [ngramFilePath UTF8String];
+    modelFilePath = ngramFilePathCStr != nullptr ? ngramFilePathCStr : "";
+    unique_lock<shared_mutex> lock(modelMutex);
+    if (![self loadModel]) return self;
+
+    string error;
+    if (overlayFilePath != nil) {
+        if (overlay.open([overlayFilePath UTF8String], error)) {
+            model.setOverlay(&overlay);
+            DDLogInfo(@"Predictive text engine loaded user overlay with %lu contexts.", (unsigned long)overlay.numOfContexts());
+        } else {
+            DDLogInfo(@"Error: Predictive text engine failed to load user overlay %@. %s", overlayFilePath, error.c_str());
         }
     }
-    
-    const NGramSectionHeader& trieSectionHeader = header->sections[NGramSectionId::trie];
-    trie.map(data + trieSectionHeader.dataOffset, trieSectionHeader.dataSizeInBytes);
-    
-    const NGramSectionHeader& weightSectionHeader = header->sections[weight];
-    weights = (Weight*)(data + weightSectionHeader.dataOffset);
-    
-    const NGramSectionHeader& isWordListSectionHeader = header->sections[isWord];
-    isWordList = (const char*)(data + isWordListSectionHeader.dataOffset);
-    
     DDLogInfo(@"Predictive text engine loaded.");
     return self;
 }
 
-static NSString* offensiveWords[] = {
-    @"屌", @"𨳒", @"鳩", @"𨳊", @"閪", @"撚", @"柒", @"仆街", @"老母", @"老味", // TC
-    @"鸠" // SC
-};
+// Requires modelMutex held exclusively.
+- (bool)loadModel {
+    const auto startTime = chrono::steady_clock::now();
+    DDLogInfo(@"Predictive text engine opening ngram...");
+    string error;
+    // Do not retry on every keystroke if the file is gone.
+    isUnloaded = false;
+    if (!model.open(modelFilePath, error)) {
+        DDLogInfo(@"Error: Predictive text engine failed to load %s. %s", modelFilePath.c_str(), error.c_str());
+        return false;
+    }
+
+    if (model.numOfPrecomputedPrefixes() > 0) {
+        DDLogInfo(@"Predictive text engine loaded precomputed completions of %lu prefixes.", (unsigned long)model.numOfPrecomputedPrefixes());
+    } else {
+        DDLogInfo(@"Predictive text engine ngram file has no precomputed completions. Falling back to live search.");
+    }
+    if (!model.hasOffensiveFlags()) {
+        DDLogInfo(@"Predictive text engine ngram file has no offensive word flags. Falling back to the built-in word list.");
+    }
+    modelMaxN = model.maxN();
+    [self applyResidencyPolicy];
+    const uint64_t loadTimeInNs = nanosecondsSince(startTime);
+    numOfLoads++;
+    totalLoadTimeInNs += loadTimeInNs;
+    DDLogInfo(@"Predictive text engine opened ngram in %.1f ms.", loadTimeInNs / 1e6);
+    return true;
+}
+
+// Returns a shared lock on modelMutex, loading the model first if it was unloaded.
+// The model may still be closed if it failed to load, callers must check model.isOpen().
+- (shared_lock<shared_mutex>)lockLoadedModel {
+    lastUseTimeInNs = steadyClockNowInNs();
+    shared_lock<shared_mutex> lock(modelMutex);
+    if (!isUnloaded) return lock;
+
+    lock.unlock();
+    {
+        unique_lock<shared_mutex> uniqueLock(modelMutex);
+        // Another thread may have loaded it in between.
+        if (isUnloaded) [self loadModel];
+    }
+    lock.lock();
+    return lock;
+}
+
+- (void)unload {
+    isPreTouchCancelled = true;
+    unique_lock<shared_mutex> lock(modelMutex);
+    isPreTouchCancelled = false;
+    if (!model.isOpen()) return;
+
+    model.close();
+    // The cached results would outlive the mapping for nothing, the model is loaded again before they could be used.
+    cache.clear();
+    isUnloaded = true;
+    numOfUnloads++;
+    DDLogInfo(@"Predictive text engine unloaded ngram, idle for %.0f s.", [self idleTime]);
+}
+
+- (bool)isLoaded {
+    shared_lock<shared_mutex> lock(modelMutex);
+    return model.isOpen();
+}
+
+- (NSTimeInterval)idleTime {
+    return (steadyClockNowInNs() - lastUseTimeInNs) / 1e9;
+}
+
+- (NSUInteger)numOfLoads {
+    return numOfLoads;
+}
+
+- (NSUInteger)numOfUnloads {
+    return numOfUnloads;
+}
+
+- (NSTimeInterval)totalLoadTime {
+    return totalLoadTimeInNs / 1e9;
+}
+
+- (void)learn:(NSString*) committedText context:(NSString*) context {
+    lastUseTimeInNs = steadyClockNowInNs();
+    const char* committedTextCStr = [committedText UTF8String];
+    const char* contextCStr = [context UTF8String];
+    // Only maxN is needed, so an unloaded model stays unloaded. The overlay stays open while the model is unloaded.
+    const int maxN = modelMaxN;
+    if (maxN <= 1 || committedTextCStr == nullptr || contextCStr == nullptr) return;
+
+    const string text(committedTextCStr);
+    const string contextText(contextCStr);
+    const size_t maxContextLength = maxN - 1;
+    dispatch_async(overlayQueue, ^{
+        if (!self->overlay.isOpen()) return;
+        // record only keeps the last maxContextLength chars of the context.
+        if (!self->overlay.record(contextText, text, maxContextLength)) return;
+        // Every recorded suffix ends with the last char of the context. Only the cached predictions of contexts ending
+        // with that char looked up any of them.
+        const size_t lastCharIndex = previousCodePointIndex(contextText, contextText.length());
+        self->cache.invalidateContextsEndingWith(string_view(contextText).substr(lastCharIndex));
+
+        if (self->overlay.needsCompaction()) {
+            const size_t fileSizeBefore = self->overlay.fileSizeInBytes();
+            string error;
+            const bool isCompacted = self->overlay.compact(error);
+            // Compaction decays and evicts the counts of any context, even if writing the compacted file then fails.
+            self->cache.clear();
+            if (isCompacted) {
+                DDLogInfo(@"Predictive text engine compacted user overlay from %lu to %lu bytes.",
+                          (unsigned long)fileSizeBefore, (unsigned long)self->overlay.fileSizeInBytes());
+            } else {
+                DDLogInfo(@"Error: Predictive text engine failed to compact user overlay. %s", error.c_str());
+            }
+        }
+    });
+}
 
 - (NSArray*)predict:(NSString*) context filterOffensiveWords:(bool) shouldFilterOffensiveWords {
-    if (header == nullptr) {
+    PredictStats stats;
+    NSArray *results = [self predict:context filterOffensiveWords:shouldFilterOffensiveWords session:nullptr budget:nullptr stats:stats];
+    lastPredictNumOfVisitedKeys = stats.numOfVisitedKeys;
+    lastPredictNumOfSearches = stats.numOfSearches;
+    return results;
+}
+
+// If session is set, it is moved to context and searches only the suffixes that may still have completions.
+- (NSArray*)predict:(NSString*) context filterOffensiveWords:(bool) shouldFilterOffensiveWords session:(NGramSession*) session
+             budget:(const PredictBudget*) budget stats:(PredictStats&) stats {
+    const auto startTime = chrono::steady_clock::now();
+    const char* contextCStr = [context UTF8String];
+    shared_lock<shared_mutex> lock = [self lockLoadedModel];
+    if (!model.isOpen() || contextCStr == nullptr) {
         return [[NSArray alloc] init];
     }
-    // header->maxN indicates the max length of suggested text.
-    // That means we should search for suffix with length up to max length-1 of the context.
-    // To start the search, move the pointer backward from the end of the string by max length-1 times.
-    NSUInteger backward = header->maxN - 1;
-    NSUInteger currentIndex = context.length;
-    while (currentIndex > 0 && backward > 0) {
-        NSRange curCharRange = [context rangeOfComposedCharacterSequenceAtIndex:currentIndex - 1];
-        currentIndex = curCharRange.location;
-        backward--;
-    }
-    
-    // Now we are pointing to the beginning of the longest suffix. Search for the whole suffix.
-    // Then move forward by 1 composed char then search again.
-    // e.g. let context = abcdefg, max length = 6,
-    // The first iteration would search for cdefg, then defg, etc. At the end it would search for g.
-    NSMutableArray *results = [[NSMutableArray alloc] init];
-    NSMutableSet *dedupSet = [[NSMutableSet alloc] init];
-    DDLogInfo(@"PredictiveTextEngine context: %@ currentIndex: %lu", context, (unsigned long)currentIndex);
-    while (currentIndex < context.length) {
-        NSString *prefixToSearch = [context substringWithRange:NSMakeRange(currentIndex, context.length - currentIndex)];
-        NSRange curCharRange = [context rangeOfComposedCharacterSequenceAtIndex:currentIndex];
-        currentIndex += curCharRange.length;
-        // DDLogInfo(@"PredictiveTextEngine searching prefix: %@", prefixToSearch);
-        [self search:prefixToSearch output:results dedupSet:dedupSet shouldFilterOffensiveWords:shouldFilterOffensiveWords];
+
+    const string_view effectiveContext = model.effectiveContext(contextCStr);
+    // The session walks the suffixes of the new context here rather than in predict.
+    const bool shouldTimeSuffixWalk = session != nullptr && model.stageTimingEnabled();
+    const auto suffixWalkStartTime = shouldTimeSuffixWalk ? chrono::steady_clock::now() : startTime;
+    if (session != nullptr) session->update(effectiveContext);
+    const uint64_t suffixWalkDurationInNs = shouldTimeSuffixWalk ? nanosecondsSince(suffixWalkStartTime) : 0;
+    vector<string> results;
+    metrics.increment(PredictCounter::predictions);
+    // learn invalidates cached predictions from another queue. Results computed from the overlay before that must not be cached.
+    const size_t cacheGeneration = cache.generation();
+    if (cache.get(effectiveContext, shouldFilterOffensiveWords, results)) {
+        stats = PredictStats();
+        metrics.increment(PredictCounter::cacheHits);
+#ifdef DEBUG_PREDICTIONS
+        DDLogInfo(@"PredictiveTextEngine context: %@ cache hit.", context);
+#endif
+    } else {
+        if (session != nullptr) {
+            results = session->predict(shouldFilterOffensiveWords, &stats, budget);
+            if (shouldTimeSuffixWalk) stats.addStageDuration(PredictStage::suffixWalk, suffixWalkDurationInNs);
+        } else {
+            results = model.predict(effectiveContext, shouldFilterOffensiveWords, &stats, budget);
+        }
+        // Interrupted searches only have partial results.
+        if (!stats.isTimedOut && !stats.isCancelled) {
+            cache.put(effectiveContext, shouldFilterOffensiveWords, results, cacheGeneration);
+        }
+        [self recordMetrics:stats];
+#ifdef DEBUG_PREDICTIONS
+        DDLogInfo(@"PredictiveTextEngine context: %@ visited %lu keys in %lu searches.%s%s", context,
+                  (unsigned long)stats.numOfVisitedKeys, (unsigned long)stats.numOfSearches,
+                  stats.isTimedOut ? " Timed out." : "", stats.isCancelled ? " Cancelled." : "");
+#endif
     }
-    
-    NSArray *finalResults = [results subarrayWithRange:NSMakeRange(0, min((NSUInteger)kMaxNumberOfTerms, [results count]))];
+
+    const auto stringConversionStartTime = chrono::steady_clock::now();
+    NSArray *finalResults = toNSArray(results);
+    metrics.record(PredictStage::stringConversion, nanosecondsSince(stringConversionStartTime));
+    metrics.record(PredictStage::total, nanosecondsSince(startTime));
     return finalResults;
 }
 
-- (bool)isWord:(size_t) keyId {
-    size_t byteOffset = keyId / 8;
-    short bitOffset = keyId % 8;
-    char encodedByte = isWordList[byteOffset];
-    
-    return 1 == ((encodedByte >> bitOffset) & 1);
+- (void)recordMetrics:(const PredictStats&) stats {
+    for (PredictStage stage : { PredictStage::suffixWalk, PredictStage::trieTraversal, PredictStage::materialization, PredictStage::filtering }) {
+        if (stats.isStageTimed(stage)) metrics.record(stage, stats.stageDurationsInNs[(size_t)stage]);
+    }
+    metrics.increment(PredictCounter::visitedKeys, stats.numOfVisitedKeys);
+    metrics.increment(PredictCounter::droppedResults, stats.numOfDroppedResults);
+    metrics.increment(PredictCounter::offensiveResults, stats.numOfOffensiveResults);
+    if (stats.isTimedOut) metrics.increment(PredictCounter::timedOutPredictions);
+    if (stats.isCancelled) metrics.increment(PredictCounter::cancelledPredictions);
+}
+
+- (NSArray*)predictPhrases:(NSString*) context filterOffensiveWords:(bool) shouldFilterOffensiveWords {
+    return [self predictPhrases:context filterOffensiveWords:shouldFilterOffensiveWords
+                     numOfSteps:NGramModel::kDefaultNumOfPhraseSteps beamWidth:NGramModel::kDefaultPhraseBeamWidth];
+}
+
+- (NSArray*)predictPhrases:(NSString*) context filterOffensiveWords:(bool) shouldFilterOffensiveWords
+                numOfSteps:(NSUInteger) numOfSteps beamWidth:(NSUInteger) beamWidth {
+    const char* contextCStr = [context UTF8String];
+    shared_lock<shared_mutex> lock = [self lockLoadedModel];
+    if (!model.isOpen() || contextCStr == nullptr) {
+        return [[NSArray alloc] init];
+    }
+
+    PredictStats stats;
+    vector<string> phrases = model.predictPhrases(contextCStr, shouldFilterOffensiveWords, numOfSteps, beamWidth, &stats);
+#ifdef DEBUG_PREDICTIONS
+    DDLogInfo(@"PredictiveTextEngine phrases context: %@ visited %lu keys in %lu searches.%s", context,
+              (unsigned long)stats.numOfVisitedKeys, (unsigned long)stats.numOfSearches, stats.isArenaFull ? " Arena full." : "");
+#endif
+    return toNSArray(phrases);
 }
 
-struct PredictiveResult {
-    string text;
-    bool isWord;
-};
+- (NSArray<NSNumber*>*)scoreContinuations:(NSString*) context candidates:(NSArray<NSString*>*) candidates
+                               timeBudget:(NSTimeInterval) timeBudget {
+    const auto startTime = chrono::steady_clock::now();
+    const char* contextCStr = [context UTF8String];
+    if (contextCStr == nullptr) return nil;
 
-- (void)search:(NSString*) prefix output:(NSMutableArray*) output dedupSet:(NSMutableSet*) dedupSet shouldFilterOffensiveWords:(bool) shouldFilterOffensiveWords {
-    if (header == nullptr) {
-        return;
+    vector<string> candidateTexts;
+    candidateTexts.reserve(candidates.count);
+    for (NSString *candidate in candidates) {
+        const char* candidateCStr = [candidate UTF8String];
+        candidateTexts.emplace_back(candidateCStr != nullptr ? candidateCStr : "");
     }
-    auto cmp = [&](const pair<size_t, PredictiveResult>& key1, const pair<size_t, PredictiveResult>& key2) {
-        return weights[key1.first] > weights[key2.first];
-    };
-    set<pair<size_t, PredictiveResult>, decltype(cmp)> orderedResults(cmp);
-
-    Agent trieAgent;
-    const char* prefixCStr = [prefix UTF8String];
-    if (prefixCStr == nullptr) {
-        return;
+    const vector<string_view> candidateViews(candidateTexts.begin(), candidateTexts.end());
+
+    // Unlike lockLoadedModel, do not load an unloaded model here, nor wait for another thread loading or unloading it.
+    // Mapping or unmapping the file could take longer than the budget.
+    shared_lock<shared_mutex> lock(modelMutex, try_to_lock);
+    if (!lock.owns_lock() || !model.isOpen()) return nil;
+    lastUseTimeInNs = steadyClockNowInNs();
+
+    PredictBudget budget;
+    budget.deadline = startTime + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(timeBudget));
+    PredictStats stats;
+    const vector<float> scores = model.scoreContinuations(model.effectiveContext(contextCStr), candidateViews, &stats, &budget);
+    if (stats.isTimedOut) {
+#ifdef DEBUG_PREDICTIONS
+        DDLogInfo(@"PredictiveTextEngine scoring %lu candidates after %@ timed out.", (unsigned long)candidates.count, context);
+#endif
+        return nil;
     }
-    trieAgent.set_query(prefixCStr);
-    while (trie.predictive_search(trieAgent)) {
-        const Key& key = trieAgent.key();
-        string keyText = string(key.ptr(), key.length());
-        bool isWord = [self isWord:key.id()];
-        PredictiveResult predictiveResult({ keyText, isWord });
-        orderedResults.insert({ key.id(), predictiveResult });
+
+    NSMutableArray<NSNumber*> *results = [[NSMutableArray alloc] initWithCapacity:scores.size()];
+    for (const float score : scores) {
+        [results addObject:@(score)];
     }
+    return results;
+}
+
+- (void)predictAsync:(NSString*) context filterOffensiveWords:(bool) shouldFilterOffensiveWords timeBudget:(NSTimeInterval) timeBudget
+          completion:(void (^)(NSArray*)) completion {
+    [self predictAsync:context filterOffensiveWords:shouldFilterOffensiveWords timeBudget:timeBudget session:nil completion:completion];
+}
+
+- (void)predictAsync:(NSString*) context filterOffensiveWords:(bool) shouldFilterOffensiveWords timeBudget:(NSTimeInterval) timeBudget
+             session:(PredictionSession*) session completion:(void (^)(NSArray*)) completion {
+    const uint64_t requestId = ++latestRequestId;
+    const auto deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(timeBudget));
+    NSString *contextCopy = [context copy];
     
-    for (auto it = orderedResults.begin(); it != orderedResults.end(); ++it) {
-        const auto& key = it->second;
-        const auto& text = key.text;
-        const auto isWord = it->second.isWord;
-        NSString *fullText = [[NSString alloc] initWithBytes:text.c_str()
-                                                      length:text.length()
-                                                    encoding:NSUTF8StringEncoding];
-        
-        bool shouldFilter = false;
-        if (shouldFilterOffensiveWords) {
-            for (NSString* offensiveWord : offensiveWords) {
-                if ([fullText containsString: offensiveWord]) {
-                    shouldFilter = true;
-                    break;
-                }
-            }
-            if (shouldFilter) continue;
-        }
-        
-        NSString *toAdd = nullptr;
-        
-        NSRange suffixRange = NSMakeRange([prefix length], [fullText length] - [prefix length]);
-        NSString *suffix = [fullText substringWithRange:suffixRange];
-        
-        if (isWord) {
-            toAdd = suffix;
-        } else {
-            Agent trieAgent;
-            const char* suffixCStr = [suffix UTF8String];
-            if (suffixCStr == nullptr) {
-                continue;
-            }
-            trieAgent.set_query(suffixCStr);
-            
-            if ([suffix lengthOfComposedChars] == 1) {
-                // If the suffix has just a single char, always suggest it.
-                NSRange lastCharRange = [fullText rangeOfComposedCharacterSequenceAtIndex:fullText.length - 1];
-                NSString *lastChar = [fullText substringWithRange:lastCharRange];
-                toAdd = lastChar;
-            } else if (trie.lookup(trieAgent)) {
-                // If suffix is a word, suggest the whole word.
-                size_t suffixKeyId = trieAgent.key().id();
-                bool isSuffixWord = [self isWord:suffixKeyId];
-                if (isSuffixWord) toAdd = suffix;
+    dispatch_async(predictQueue, ^{
+        PredictBudget budget;
+        budget.deadline = deadline;
+        budget.latestRequestId = &self->latestRequestId;
+        budget.requestId = requestId;
+        PredictStats stats;
+        NSArray *results = [self predict:contextCopy filterOffensiveWords:shouldFilterOffensiveWords session:[session ngramSession] budget:&budget stats:stats];
+        if (stats.isCancelled) return;
+
+        dispatch_async(dispatch_get_main_queue(), ^{
+            // A newer request may have been issued while the results were on their way.
+            if (self->latestRequestId != requestId) {
+                self->metrics.increment(PredictCounter::cancelledPredictions);
+                return;
             }
-        }
-        
-        if (toAdd == nullptr || toAdd.length == 0) continue;
+            completion(results);
+        });
+    });
+}
 
-        DDLogInfo(@"PredictiveTextEngine fullText %@ toAdd %@ weight %f isWord %s", fullText, toAdd, weights[it->first], isWord ? "true" : "false");
-        if (![dedupSet containsObject:toAdd]) {
-            [output addObject:toAdd];
-            [dedupSet addObject:toAdd];
-        }
+- (bool)backoffScoringEnabled {
+    return model.scoringMode() == ScoringMode::stupidBackoff;
+}
+
+- (void)setBackoffScoringEnabled:(bool) backoffScoringEnabled {
+    model.setScoringMode(backoffScoringEnabled ? ScoringMode::stupidBackoff : ScoringMode::longestSuffixFirst);
+    // Cached results were ranked by the previous mode.
+    cache.clear();
+}
+
+- (NSUInteger)numOfTimedOutPredictions {
+    return metrics.counter(PredictCounter::timedOutPredictions);
+}
+
+- (NSUInteger)numOfCancelledPredictions {
+    return metrics.counter(PredictCounter::cancelledPredictions);
+}
+
+- (NSString*)metricsJson {
+    return [NSString stringWithUTF8String:metrics.toJson().c_str()];
+}
+
+- (void)resetMetrics {
+    metrics.reset();
+}
+
+- (double)predictLatencyInMicrosecondsAtPercentile:(double) percentile {
+    return metrics.histogram(PredictStage::total).percentile(percentile) / 1000.0;
+}
+
+- (bool)stageTimingEnabled {
+    return model.stageTimingEnabled();
+}
+
+- (void)setStageTimingEnabled:(bool) stageTimingEnabled {
+    model.setStageTimingEnabled(stageTimingEnabled);
+}
+
+- (NGramResidencyPolicy)residencyPolicy {
+    return desiredResidencyPolicy;
+}
+
+- (void)setResidencyPolicy:(NGramResidencyPolicy) residencyPolicy {
+    desiredResidencyPolicy = residencyPolicy;
+    shared_lock<shared_mutex> lock(modelMutex);
+    [self applyResidencyPolicy];
+}
+
+// Requires modelMutex held.
+- (void)applyResidencyPolicy {
+    if (!model.isOpen()) return;
+    ResidencyPolicy policy = ResidencyPolicy::demandPaging;
+    if (desiredResidencyPolicy == NGramResidencyPolicyAdvise) policy = ResidencyPolicy::advise;
+    if (desiredResidencyPolicy == NGramResidencyPolicyPreTouch) policy = ResidencyPolicy::preTouch;
+    if (!model.setResidencyPolicy(policy)) {
+        DDLogInfo(@"Error: Predictive text engine failed to apply residency policy %ld. %s", (long)desiredResidencyPolicy, strerror(errno));
+    }
+    if (policy != ResidencyPolicy::preTouch) return;
+
+    dispatch_async(residencyQueue, ^{
+        shared_lock<shared_mutex> lock(self->modelMutex);
+        // The model may have been unloaded before this ran.
+        if (!self->model.isOpen()) return;
+        const auto startTime = chrono::steady_clock::now();
+        const size_t numOfBytesTouched = self->model.preTouchHotSections(&self->isPreTouchCancelled);
+        DDLogInfo(@"Predictive text engine pre-touched %lu bytes in %.1f ms.", (unsigned long)numOfBytesTouched,
+                  nanosecondsSince(startTime) / 1e6);
+    });
+}
+
+- (NSDictionary<NSString*, NSNumber*>*)residentBytesBySection {
+    shared_lock<shared_mutex> lock(modelMutex);
+    NSMutableDictionary<NSString*, NSNumber*> *residentBytes = [[NSMutableDictionary alloc] init];
+    for (const SectionResidency& residency : model.sectionResidency()) {
+        residentBytes[[NSString stringWithUTF8String:toString(residency.sectionId)]] = @(residency.residentSizeInBytes);
     }
+    return residentBytes;
+}
+
+- (PredictionSession*)createSession {
+    return [[PredictionSession alloc] init:self];
+}
+
+- (const NGramModel&)model {
+    return model;
+}
+
+- (NSUInteger)lastPredictNumOfVisitedKeys {
+    return lastPredictNumOfVisitedKeys;
+}
+
+- (NSUInteger)lastPredictNumOfSearches {
+    return lastPredictNumOfSearches;
+}
+
+- (NSUInteger)predictionCacheCapacityInBytes {
+    return cache.capacityInBytes();
+}
+
+- (void)setPredictionCacheCapacityInBytes:(NSUInteger) capacityInBytes {
+    cache.setCapacityInBytes(capacityInBytes);
+}
+
+- (NSUInteger)predictionCacheHits {
+    return cache.hits();
+}
+
+- (NSUInteger)predictionCacheMisses {
+    return cache.misses();
+}
+
+@end
+
+@implementation PredictionSession {
+    PredictiveTextEngine* engine;
+    unique_ptr<NGramSession> session;
+}
+
+- (id)init:(PredictiveTextEngine*) predictiveTextEngine {
+    self = [super init];
+    engine = predictiveTextEngine;
+    session = make_unique<NGramSession>([engine model]);
+    return self;
+}
+
+- (void)reset:(NSString*) context {
+    const char* contextCStr = [context UTF8String];
+    session->reset(contextCStr != nullptr ? contextCStr : "");
+}
+
+- (void)append:(NSString*) committedText {
+    const char* committedTextCStr = [committedText UTF8String];
+    if (committedTextCStr != nullptr) session->append(committedTextCStr);
+}
+
+- (NSArray*)predict:(bool) shouldFilterOffensiveWords {
+    NSString *context = [NSString stringWithUTF8String:session->context().c_str()];
+    return [self predict:context filterOffensiveWords:shouldFilterOffensiveWords];
+}
+
+- (NSArray*)predict:(NSString*) context filterOffensiveWords:(bool) shouldFilterOffensiveWords {
+    PredictStats stats;
+    return [engine predict:context filterOffensiveWords:shouldFilterOffensiveWords session:session.get() budget:nullptr stats:stats];
+}
+
+- (void)predictAsync:(NSString*) context filterOffensiveWords:(bool) shouldFilterOffensiveWords timeBudget:(NSTimeInterval) timeBudget
+          completion:(void (^)(NSArray*)) completion {
+    [engine predictAsync:context filterOffensiveWords:shouldFilterOffensiveWords timeBudget:timeBudget session:self completion:completion];
+}
+
+- (NGramSession*)ngramSession {
+    return session.get();
 }
 
 @end
@@ -0,0 +1,113 @@
+//
+//  Utf8.h
+//  CantoboardFramework
+//
+//  Code point walking over UTF-8 text. The input is assumed to be valid UTF-8.
+//
+
+#ifndef UTF8_H_
+#define UTF8_H_
+
+#include <cstdint>
+#include <string_view>
+
+inline bool isUtf8ContinuationByte(char c) {
+    return (c & 0xC0) == 0x80;
+}
+
+// Returns the byte index of the code point before index.
+inline size_t previousCodePointIndex(std::string_view text, size_t index) {
+    do {
+        --index;
+    } while (index > 0 && isUtf8ContinuationByte(text[index]));
+    return index;
+}
+
+// Returns the byte index of the code point after index.
+inline size_t nextCodePointIndex(std::string_view text, size_t index) {
+    do {
+        ++index;
+    } while (index < text.length() && isUtf8ContinuationByte(text[index]));
+    return index;
+}
+
+inline size_t countCodePoints(std::string_view text) {
+    size_t count = 0;
+    for (char c : text) {
+        if (!isUtf8ContinuationByte(c)) count++;
+    }
+    return count;
+}
+
+// Decodes the code point starting at index.
+inline uint32_t decodeCodePoint(std::string_view text, size_t index) {
+    const unsigned char leadByte = text[index];
+    size_t numOfContinuationBytes;
+    uint32_t codePoint;
+    if (leadByte < 0x80) return leadByte;
+    else if (leadByte < 0xE0) { numOfContinuationBytes = 1; codePoint = leadByte & 0x1F; }
+    else if (leadByte < 0xF0) { numOfContinuationBytes = 2; codePoint = leadByte & 0x0F; }
+    else { numOfContinuationBytes = 3; codePoint = leadByte & 0x07; }
+    for (size_t i = 1; i <= numOfContinuationBytes && index + i < text.length(); ++i) {
+        codePoint = (codePoint << 6) | (text[index + i] & 0x3F);
+    }
+    return codePoint;
+}
+
+// The ranges NGramBuilder keeps in the ngram file: CJK Unified Ideographs and extensions A and B.
+inline bool isCjkCodePoint(uint32_t codePoint) {
+    return (0x4E00 <= codePoint && codePoint <= 0x9FFF) ||
+           (0x3400 <= codePoint && codePoint <= 0x4DBF) ||
+           (0x20000 <= codePoint && codePoint <= 0x2A6DF);
+}
+
+enum class Utf8TextKind : uint8_t {
+    // Valid UTF-8 made of CJK code points only.
+    cjk,
+    // Valid UTF-8 with some other code point.
+    notCjk,
+    invalid,
+};
+
+// Validates text and checks its code points against isCjkCodePoint in a single pass, without decoding into a buffer.
+// Overlong encodings, surrogates and code points above U+10FFFF are invalid. numOfCodePoints is only set for valid text.
+inline Utf8TextKind classifyUtf8Text(std::string_view text, size_t& numOfCodePoints) {
+    const unsigned char* it = (const unsigned char*)text.data();
+    const unsigned char* const end = it + text.length();
+    size_t count = 0;
+    bool isAllCjk = true;
+    while (it < end) {
+        // Every CJK code point is 3 bytes with lead byte E3 to E9 (U+3400 to U+9FFF),
+        // the common case by far, or 4 bytes with lead byte F0 (extension B).
+        if (end - it >= 3 && it[0] >= 0xE3 && it[0] <= 0xE9 && isUtf8ContinuationByte(it[1]) && isUtf8ContinuationByte(it[2])) {
+            const uint32_t codePoint = ((it[0] & 0x0F) << 12) | ((it[1] & 0x3F) << 6) | (it[2] & 0x3F);
+            isAllCjk &= isCjkCodePoint(codePoint);
+            it += 3;
+            count++;
+            continue;
+        }
+
+        size_t length;
+        uint32_t codePoint, minCodePoint;
+        if (it[0] < 0x80) { length = 1; codePoint = it[0]; minCodePoint = 0; }
+        else if (it[0] >= 0xC2 && it[0] < 0xE0) { length = 2; codePoint = it[0] & 0x1F; minCodePoint = 0x80; }
+        else if (it[0] >= 0xE0 && it[0] < 0xF0) { length = 3; codePoint = it[0] & 0x0F; minCodePoint = 0x800; }
+        else if (it[0] >= 0xF0 && it[0] < 0xF5) { length = 4; codePoint = it[0] & 0x07; minCodePoint = 0x10000; }
+        else return Utf8TextKind::invalid;
+        if ((size_t)(end - it) < length) return Utf8TextKind::invalid;
+        for (size_t i = 1; i < length; ++i) {
+            if (!isUtf8ContinuationByte(it[i])) return Utf8TextKind::invalid;
+            codePoint = (codePoint << 6) | (it[i] & 0x3F);
+        }
+        if (codePoint < minCodePoint || codePoint > 0x10FFFF || (0xD800 <= codePoint && codePoint <= 0xDFFF)) {
+            return Utf8TextKind::invalid;
+        }
+        isAllCjk &= isCjkCodePoint(codePoint);
+        it += length;
+        count++;
+    }
+    numOfCodePoints = count;
+    return isAllCjk ? Utf8TextKind::cjk : Utf8TextKind::notCjk;
+}
+
+#endif  // UTF8_H_
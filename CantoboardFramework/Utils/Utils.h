@@ -33,9 +33,88 @@ typedef struct __attribute__((packed)) {
 + (void)createUnihanDictionary:(NSString*) csvPath quick3OrderCsvPath:(NSString*) quick3OrderCsvPath dictDbPath:(NSString*) dbPath;
 @end
 
+@class PredictionSession;
+
+// See ResidencyPolicy in NGramModel.h.
+typedef NS_ENUM(NSInteger, NGramResidencyPolicy) {
+    NGramResidencyPolicyDemandPaging,
+    NGramResidencyPolicyAdvise,
+    // Also faults in the trie and the precomputed completions on a background queue.
+    NGramResidencyPolicyPreTouch,
+};
+
+// Thread safe. Predictions can run on several threads at once, e.g. to score candidate continuations in parallel.
 @interface PredictiveTextEngine: NSObject
 - (id)init:(NSString*) ngramFilePath;
+// Learns from committed text into the overlay file, creating it if needed, and mixes it into the predictions.
+- (id)init:(NSString*) ngramFilePath overlayFilePath:(NSString*) overlayFilePath;
+// Records that committedText was committed after contextText. Does nothing without an overlay file.
+- (void)learn:(NSString*) committedText context:(NSString*) contextText;
+- (NSArray*)predict:(NSString*) contextText filterOffensiveWords:(bool) shouldFilterOffensiveWords;
+// Returns multi-word continuations of contextText, e.g. 食咗飯未 after 你. See NGramModel::predictPhrases.
+- (NSArray*)predictPhrases:(NSString*) contextText filterOffensiveWords:(bool) shouldFilterOffensiveWords;
+- (NSArray*)predictPhrases:(NSString*) contextText filterOffensiveWords:(bool) shouldFilterOffensiveWords
+                numOfSteps:(NSUInteger) numOfSteps beamWidth:(NSUInteger) beamWidth;
+- (PredictionSession*)createSession;
+// Returns the log probability of each candidate following contextText as NSNumber floats, in the order of candidates,
+// e.g. to re-rank input method candidates by context. Unknown candidates score -infinity. See NGramModel::scoreContinuations.
+// Returns nil if scoring takes longer than timeBudget seconds, the ngram file is unloaded or it is being loaded or
+// unloaded. Never maps the file itself or waits for it, so it is safe to call on the main thread.
+- (NSArray<NSNumber*>*)scoreContinuations:(NSString*) contextText candidates:(NSArray<NSString*>*) candidates
+                               timeBudget:(NSTimeInterval) timeBudget;
+// Predicts on a background queue and calls completion on the main queue. If the search takes longer than timeBudget
+// seconds, completion receives the best results found so far. Issuing a new request cancels the pending one,
+// its completion is never called.
+- (void)predictAsync:(NSString*) contextText filterOffensiveWords:(bool) shouldFilterOffensiveWords timeBudget:(NSTimeInterval) timeBudget
+          completion:(void (^)(NSArray* results)) completion;
+// Number of trie keys enumerated and trie searches performed by the last predict call.
+@property(readonly) NSUInteger lastPredictNumOfVisitedKeys;
+@property(readonly) NSUInteger lastPredictNumOfSearches;
+// Predictions are cached by the last maxN - 1 chars of the context. Setting the capacity to 0 disables the cache.
+@property NSUInteger predictionCacheCapacityInBytes;
+@property(readonly) NSUInteger predictionCacheHits;
+@property(readonly) NSUInteger predictionCacheMisses;
+// Ranks predictions following every suffix of the context together with Stupid Backoff,
+// instead of always listing predictions following longer suffixes first.
+@property bool backoffScoringEnabled;
+@property(readonly) NSUInteger numOfTimedOutPredictions;
+@property(readonly) NSUInteger numOfCancelledPredictions;
+// Latency histograms of each predict stage and counters since the engine was opened or the metrics were reset, as JSON.
+- (NSString*)metricsJson;
+- (void)resetMetrics;
+// e.g. 0.99 for the p99 latency of the whole predict call, including cache hits.
+- (double)predictLatencyInMicrosecondsAtPercentile:(double) percentile;
+// Times the stages of predict into the stage histograms of metricsJson. Off by default, it costs a couple of clock reads
+// per selected key. The total latency is always recorded.
+@property bool stageTimingEnabled;
+// Trades the latency of the first predictions after launch against RSS. Defaults to demand paging.
+@property NGramResidencyPolicy residencyPolicy;
+// Bytes of each ngram file section in memory, keyed by section name.
+- (NSDictionary<NSString*, NSNumber*>*)residentBytesBySection;
+// Unmaps the ngram file and clears the prediction cache. The next prediction maps the file again.
+- (void)unload;
+@property(readonly) bool isLoaded;
+// Seconds since the last prediction or learn call.
+@property(readonly) NSTimeInterval idleTime;
+@property(readonly) NSUInteger numOfLoads;
+@property(readonly) NSUInteger numOfUnloads;
+// Seconds spent mapping the ngram file, over all loads.
+@property(readonly) NSTimeInterval totalLoadTime;
+@end
+
+// Keeps track of which suffixes of the context can still have completions, so that predicting after
+// committing more text does not search from scratch. Unlike the engine, a session must be used by one thread at a time.
+@interface PredictionSession: NSObject
+- (id)init:(PredictiveTextEngine*) predictiveTextEngine;
+// Starts over from context, e.g. after backspace or moving the caret.
+- (void)reset:(NSString*) context;
+- (void)append:(NSString*) committedText;
+- (NSArray*)predict:(bool) shouldFilterOffensiveWords;
+// Appends to the session if context extends the current context, resets the session otherwise.
 - (NSArray*)predict:(NSString*) contextText filterOffensiveWords:(bool) shouldFilterOffensiveWords;
+// Same as PredictiveTextEngine predictAsync. Do not mix with the synchronous calls while a request is pending.
+- (void)predictAsync:(NSString*) contextText filterOffensiveWords:(bool) shouldFilterOffensiveWords timeBudget:(NSTimeInterval) timeBudget
+          completion:(void (^)(NSArray* results)) completion;
 @end
 
 #endif /* Utils_h */
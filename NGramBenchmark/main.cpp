@@ -0,0 +1,240 @@
+//
+//  main.cpp
+//  NGramBenchmark
+//
+//  Measures NGramModel::predict latency on a fixed set of contexts.
+//  Usage: NGramBenchmark [ngram file] [iterations] [ngram file to compare]
+//  The file to compare is typically the same data in another layout, e.g. built with NGramBuilder --lex-ranges.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "NGramModel.h"
+#include "NGramOverlay.h"
+#include "NGramSession.h"
+#include "Utf8.h"
+
+using namespace std;
+
+#ifndef DEFAULT_NGRAM_PATH
+#define DEFAULT_NGRAM_PATH "CantoboardFramework/Data/InstallToCache/NGram/zh_HK.ngram"
+#endif
+
+// Short contexts have the most completions and are the slowest to predict.
+const char* contexts[] = {
+    "一", "我", "你", "好", "食", "今日", "香港", "唔該", "我哋今日去", "食咗飯未",
+};
+
+// Typed one char at a time to compare predicting from scratch against an NGramSession.
+const char* sentence = "我哋今日去咗海洋公園玩，好開心呀";
+
+// Prefixes of 1 or 2 chars mostly read the precomputed completions, longer ones have few completions each.
+// Both depend on how completions of a key are selected.
+const char* shortPrefixContexts[] = { "一", "我", "你", "好", "食", "今日", "香港", "唔該" };
+const char* longPrefixContexts[] = { "我哋今日去", "食咗飯未", "香港人", "唔該晒你", "今日天氣好" };
+
+double percentile(vector<double>& sortedSamples, double p) {
+    size_t index = min(sortedSamples.size() - 1, (size_t)(p * sortedSamples.size()));
+    return sortedSamples[index];
+}
+
+// Returns the sorted latencies of predicting every context iterations times.
+template <size_t numOfContexts>
+vector<double> measurePredict(const NGramModel& model, const char* (&contexts)[numOfContexts], int iterations, size_t& numOfVisitedKeys) {
+    vector<double> samples;
+    samples.reserve(iterations * numOfContexts);
+    numOfVisitedKeys = 0;
+    for (int i = 0; i < iterations; ++i) {
+        for (const char* context : contexts) {
+            PredictStats stats;
+            auto start = chrono::steady_clock::now();
+            model.predict(context, true, &stats);
+            auto end = chrono::steady_clock::now();
+            samples.push_back(chrono::duration<double, micro>(end - start).count());
+            numOfVisitedKeys += stats.numOfVisitedKeys;
+        }
+    }
+    sort(samples.begin(), samples.end());
+    numOfVisitedKeys /= samples.size();
+    return samples;
+}
+
+// Compares the prefix completion latency of two files holding the same data, and checks they predict the same.
+bool compareLayouts(const NGramModel& model, const string& otherNGramFilePath, int iterations) {
+    NGramModel otherModel;
+    string error;
+    if (!otherModel.open(otherNGramFilePath, error)) {
+        cerr << error << endl;
+        return false;
+    }
+
+    size_t numOfMismatches = 0;
+    for (const char* context : contexts) {
+        if (model.predict(context, true) != otherModel.predict(context, true)) numOfMismatches++;
+    }
+    for (const char* context : longPrefixContexts) {
+        if (model.predict(context, true) != otherModel.predict(context, true)) numOfMismatches++;
+    }
+
+    cout << left << setw(12) << "layout" << setw(8) << "prefix" << right << setw(10) << "visited"
+         << setw(12) << "p50 us" << setw(12) << "p95 us" << setw(12) << "max us" << "\n";
+    const NGramModel* layoutModels[] = { &model, &otherModel };
+    for (const NGramModel* layoutModel : layoutModels) {
+        const char* layoutName = layoutModel->hasLexRanges() ? "lex ranges" : "trie walk";
+        size_t numOfVisitedKeys;
+        vector<double> shortSamples = measurePredict(*layoutModel, shortPrefixContexts, iterations, numOfVisitedKeys);
+        cout << left << setw(12) << layoutName << setw(8) << "short" << right << setw(10) << numOfVisitedKeys << fixed << setprecision(1)
+             << setw(12) << percentile(shortSamples, 0.5) << setw(12) << percentile(shortSamples, 0.95) << setw(12) << shortSamples.back() << "\n";
+        vector<double> longSamples = measurePredict(*layoutModel, longPrefixContexts, iterations, numOfVisitedKeys);
+        cout << left << setw(12) << layoutName << setw(8) << "long" << right << setw(10) << numOfVisitedKeys << fixed << setprecision(1)
+             << setw(12) << percentile(longSamples, 0.5) << setw(12) << percentile(longSamples, 0.95) << setw(12) << longSamples.back() << "\n";
+    }
+
+    if (numOfMismatches > 0) {
+        cerr << numOfMismatches << " contexts are predicted differently by " << otherNGramFilePath << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, const char * argv[]) {
+    const string ngramFilePath = argc > 1 ? argv[1] : DEFAULT_NGRAM_PATH;
+    const int iterations = argc > 2 ? atoi(argv[2]) : 200;
+    const string otherNGramFilePath = argc > 3 ? argv[3] : "";
+
+    NGramModel model;
+    string error;
+    if (!model.open(ngramFilePath, error)) {
+        cerr << error << endl;
+        return 1;
+    }
+    cout << "Loaded " << ngramFilePath << " maxN=" << model.maxN()
+         << " precomputed prefixes=" << model.numOfPrecomputedPrefixes() << "\n";
+
+    cout << left << setw(16) << "context" << right << setw(10) << "results" << setw(10) << "visited"
+         << setw(12) << "p50 us" << setw(12) << "p95 us" << setw(12) << "max us" << "\n";
+
+    size_t numOfContextsWithoutResults = 0;
+    for (const char* context : contexts) {
+        PredictStats stats;
+        size_t numOfResults = model.predict(context, true, &stats).size();
+        if (numOfResults == 0) numOfContextsWithoutResults++;
+
+        vector<double> samples;
+        samples.reserve(iterations);
+        for (int i = 0; i < iterations; ++i) {
+            auto start = chrono::steady_clock::now();
+            auto results = model.predict(context, true);
+            auto end = chrono::steady_clock::now();
+            samples.push_back(chrono::duration<double, micro>(end - start).count());
+        }
+        sort(samples.begin(), samples.end());
+
+        cout << left << setw(16) << context << right << setw(10) << numOfResults << setw(10) << stats.numOfVisitedKeys
+             << fixed << setprecision(1)
+             << setw(12) << percentile(samples, 0.5) << setw(12) << percentile(samples, 0.95) << setw(12) << samples.back() << "\n";
+    }
+
+    // Replay the sentence one commit at a time.
+    double predictTotalUs = 0, sessionTotalUs = 0;
+    size_t predictNumOfSearches = 0, sessionNumOfSearches = 0;
+    for (int i = 0; i < iterations; ++i) {
+        NGramSession session(model);
+        const string_view text(sentence);
+        for (size_t endIndex = nextCodePointIndex(text, 0); endIndex <= text.length(); endIndex = nextCodePointIndex(text, endIndex)) {
+            const string_view context = text.substr(0, endIndex);
+            PredictStats stats;
+
+            auto start = chrono::steady_clock::now();
+            model.predict(context, true, &stats);
+            auto end = chrono::steady_clock::now();
+            predictTotalUs += chrono::duration<double, micro>(end - start).count();
+            predictNumOfSearches += stats.numOfSearches;
+
+            start = chrono::steady_clock::now();
+            session.update(context);
+            session.predict(true, &stats);
+            end = chrono::steady_clock::now();
+            sessionTotalUs += chrono::duration<double, micro>(end - start).count();
+            sessionNumOfSearches += stats.numOfSearches;
+
+            if (endIndex == text.length()) break;
+        }
+    }
+    // Phrase prediction runs several searches per call, it must still fit in the keystroke budget.
+    vector<double> phraseSamples;
+    size_t numOfPhrases = 0;
+    for (int i = 0; i < iterations; ++i) {
+        for (const char* context : contexts) {
+            auto start = chrono::steady_clock::now();
+            numOfPhrases += model.predictPhrases(context, true).size();
+            auto end = chrono::steady_clock::now();
+            phraseSamples.push_back(chrono::duration<double, micro>(end - start).count());
+        }
+    }
+    sort(phraseSamples.begin(), phraseSamples.end());
+
+    // Overlay lookups happen on every search, measure what they add with a realistic amount of learned text.
+    const string overlayFilePath = ngramFilePath + ".benchmark-overlay";
+    remove(overlayFilePath.c_str());
+    NGramOverlay overlay;
+    double overlayOverheadPercent = 0;
+    if (overlay.open(overlayFilePath, error)) {
+        const string_view text(sentence);
+        for (int i = 0; i < 100; ++i) {
+            for (size_t index = 0; index < text.length();) {
+                const size_t endIndex = nextCodePointIndex(text, index);
+                overlay.record(text.substr(0, index), text.substr(index, endIndex - index), model.maxN() - 1);
+                index = endIndex;
+            }
+        }
+
+        double withoutOverlayUs = 0, withOverlayUs = 0;
+        for (int i = 0; i < iterations; ++i) {
+            for (const char* context : contexts) {
+                auto start = chrono::steady_clock::now();
+                model.predict(context, true);
+                auto end = chrono::steady_clock::now();
+                withoutOverlayUs += chrono::duration<double, micro>(end - start).count();
+
+                model.setOverlay(&overlay);
+                start = chrono::steady_clock::now();
+                model.predict(context, true);
+                end = chrono::steady_clock::now();
+                withOverlayUs += chrono::duration<double, micro>(end - start).count();
+                model.setOverlay(nullptr);
+            }
+        }
+        overlayOverheadPercent = 100.0 * (withOverlayUs - withoutOverlayUs) / withoutOverlayUs;
+        overlay.close();
+        remove(overlayFilePath.c_str());
+    } else {
+        cerr << error << endl;
+    }
+
+    const size_t numOfCommits = iterations * countCodePoints(sentence);
+    cout << fixed << setprecision(1)
+         << "Per commit, from scratch: " << predictTotalUs / numOfCommits << " us, "
+         << (double)predictNumOfSearches / numOfCommits << " searches\n"
+         << "Per commit, with session: " << sessionTotalUs / numOfCommits << " us, "
+         << (double)sessionNumOfSearches / numOfCommits << " searches\n"
+         << "Phrases: p50 " << percentile(phraseSamples, 0.5) << " us, p95 " << percentile(phraseSamples, 0.95) << " us, "
+         << (double)numOfPhrases / phraseSamples.size() << " phrases per call\n"
+         << "Overlay overhead: " << overlayOverheadPercent << "%\n";
+
+    // Every sample context is common enough to have predictions. If none has any, the model is broken.
+    if (numOfContextsWithoutResults == sizeof(contexts) / sizeof(*contexts)) {
+        cerr << "No predictions for any context." << endl;
+        return 1;
+    }
+
+    if (!otherNGramFilePath.empty() && !compareLayouts(model, otherNGramFilePath, iterations)) return 1;
+    return 0;
+}
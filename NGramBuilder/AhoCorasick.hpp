@@ -0,0 +1,102 @@
+//
+//  AhoCorasick.hpp
+//  NGramBuilder
+//
+//  Multi-pattern substring matcher. Runs over UTF-8 bytes, which is safe because a UTF-8 encoded
+//  pattern can only match at a code point boundary.
+//
+
+#ifndef AhoCorasick_hpp
+#define AhoCorasick_hpp
+
+#include <cstdint>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class AhoCorasick {
+public:
+    AhoCorasick() : nodes(1) {}
+
+    void addPattern(std::string_view pattern) {
+        if (pattern.empty()) return;
+        int state = 0;
+        for (unsigned char c : pattern) {
+            int next = findChild(state, c);
+            if (next == -1) {
+                next = (int)nodes.size();
+                nodes[state].children.push_back({ c, next });
+                nodes.emplace_back();
+            }
+            state = next;
+        }
+        nodes[state].isMatch = true;
+        numOfPatterns++;
+    }
+
+    // Must be called after adding all patterns and before calling containsAny.
+    void build() {
+        std::queue<int> queue;
+        for (const Transition& transition : nodes[0].children) {
+            nodes[transition.target].failure = 0;
+            queue.push(transition.target);
+        }
+        while (!queue.empty()) {
+            const int state = queue.front();
+            queue.pop();
+            for (const Transition& transition : nodes[state].children) {
+                int failure = nodes[state].failure;
+                while (failure != 0 && findChild(failure, transition.c) == -1) {
+                    failure = nodes[failure].failure;
+                }
+                const int failureChild = findChild(failure, transition.c);
+                nodes[transition.target].failure = failureChild != -1 ? failureChild : 0;
+                // A state matches if any pattern ending at it, including the shorter ones reached by failure links, matches.
+                nodes[transition.target].isMatch |= nodes[nodes[transition.target].failure].isMatch;
+                queue.push(transition.target);
+            }
+        }
+    }
+
+    // Returns true if text contains any of the patterns.
+    bool containsAny(std::string_view text) const {
+        int state = 0;
+        for (unsigned char c : text) {
+            int next;
+            while ((next = findChild(state, c)) == -1 && state != 0) {
+                state = nodes[state].failure;
+            }
+            state = next != -1 ? next : 0;
+            if (nodes[state].isMatch) return true;
+        }
+        return false;
+    }
+
+    size_t size() const { return numOfPatterns; }
+
+private:
+    struct Transition {
+        unsigned char c;
+        int target;
+    };
+
+    struct Node {
+        // Blocklists are small and most nodes have one child, a linear scan beats a map here.
+        std::vector<Transition> children;
+        int failure = 0;
+        bool isMatch = false;
+    };
+
+    int findChild(int state, unsigned char c) const {
+        for (const Transition& transition : nodes[state].children) {
+            if (transition.c == c) return transition.target;
+        }
+        return -1;
+    }
+
+    std::vector<Node> nodes;
+    size_t numOfPatterns = 0;
+};
+
+#endif /* AhoCorasick_hpp */
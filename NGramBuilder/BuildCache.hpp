@@ -0,0 +1,115 @@
+//
+//  BuildCache.hpp
+//  NGramBuilder
+//
+//  Content addressed cache of intermediate build results. Each entry is named after the hash of everything it was
+//  computed from, so changing an input misses the cache and stale entries are never read.
+//
+
+#ifndef BuildCache_hpp
+#define BuildCache_hpp
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// 64-bit FNV-1a. Not cryptographic, only meant to tell build inputs apart.
+class ContentHash {
+public:
+    ContentHash& add(const void* data, size_t size) {
+        const unsigned char* bytes = (const unsigned char*)data;
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+        }
+        return *this;
+    }
+
+    ContentHash& add(uint64_t value) {
+        return add(&value, sizeof(value));
+    }
+
+    // Length prefixed, so consecutive strings cannot run into each other.
+    ContentHash& add(const std::string& text) {
+        add((uint64_t)text.length());
+        return add(text.data(), text.length());
+    }
+
+    // Hashes the size and contents of the file at path. A missing file hashes as absent rather than failing, since the
+    // builder skips missing inputs, so creating the file later changes the hash.
+    ContentHash& addFile(const std::string& path) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            if (errno == ENOENT) return add(kAbsentFileSize);
+            throw std::runtime_error("Could not open " + path + " to hash it.");
+        }
+        struct stat fileStat;
+        if (fstat(fd, &fileStat) != 0) {
+            close(fd);
+            throw std::runtime_error("Could not stat " + path + " to hash it.");
+        }
+        const size_t fileSize = fileStat.st_size;
+        add((uint64_t)fileSize);
+        if (fileSize > 0) {
+            void* data = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Could not mmap " + path + " to hash it.");
+            }
+            add(data, fileSize);
+            munmap(data, fileSize);
+        }
+        close(fd);
+        return *this;
+    }
+
+    uint64_t value() const { return hash; }
+
+private:
+    // Hashed in place of the size of a missing file. No file is that large.
+    static const uint64_t kAbsentFileSize = UINT64_MAX;
+
+    uint64_t hash = 0xCBF29CE484222325ull;
+};
+
+class BuildCache {
+public:
+    // An empty directory disables the cache.
+    explicit BuildCache(const std::string& directory) : directory(directory) {
+        if (!directory.empty()) mkdir(directory.c_str(), 0755);
+    }
+
+    bool isEnabled() const { return !directory.empty(); }
+
+    // e.g. build-cache/dict-0123456789abcdef.run
+    std::string entryPath(const char* stage, uint64_t hash, const char* extension) const {
+        char hashInHex[17];
+        snprintf(hashInHex, sizeof(hashInHex), "%016llx", (unsigned long long)hash);
+        return directory + "/" + stage + "-" + hashInHex + extension;
+    }
+
+    bool hasEntry(const std::string& path) const {
+        struct stat fileStat;
+        return isEnabled() && stat(path.c_str(), &fileStat) == 0;
+    }
+
+    // Entries are written to a temp path and moved into place once complete, so an interrupted build never leaves a
+    // truncated entry. writerName tells apart threads writing the same entry.
+    std::string tempPath(const std::string& path, const std::string& writerName) const {
+        return path + "." + writerName + ".tmp";
+    }
+
+    void commit(const std::string& tempPath, const std::string& path) const {
+        if (rename(tempPath.c_str(), path.c_str()) != 0) throw std::runtime_error("Could not move " + tempPath + " into the build cache.");
+    }
+
+private:
+    std::string directory;
+};
+
+#endif /* BuildCache_hpp */
@@ -0,0 +1,183 @@
+//
+//  DictRuns.hpp
+//  NGramBuilder
+//
+//  The entries of a dict as runs sorted by key, each kept in memory, spilled to a temp file or saved in the build cache,
+//  and merged in key order.
+//  Spilling lets the builder bound its memory by the size of a run instead of the size of the corpus.
+//
+
+#ifndef DictRuns_hpp
+#define DictRuns_hpp
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// What the dict keeps of a converted key.
+struct DictValue {
+    // The max prob of the rows converted to the key.
+    float prob;
+    // Counted when the row was validated, so later stages need not count again. Saturates at UINT8_MAX.
+    uint8_t numOfCodePoints;
+};
+
+typedef std::unordered_map<std::string, DictValue> Dict;
+
+class DictRuns {
+public:
+    typedef std::pair<std::string, DictValue> Entry;
+
+    DictRuns() = default;
+    DictRuns(DictRuns&& other) = default;
+    DictRuns(const DictRuns&) = delete;
+    DictRuns& operator=(const DictRuns&) = delete;
+    DictRuns& operator=(DictRuns&&) = delete;
+
+    ~DictRuns() {
+        for (FILE* spilledRun : spilledRuns) fclose(spilledRun);
+    }
+
+    // Sorts entries into a run, in memory or in a temp file, and clears entries.
+    void addRun(Dict& entries, bool shouldSpill) {
+        std::vector<Entry> run(entries.begin(), entries.end());
+        Dict().swap(entries);
+        std::sort(run.begin(), run.end(), [](const Entry& entry1, const Entry& entry2) { return entry1.first < entry2.first; });
+        if (!shouldSpill) {
+            memoryRuns.push_back(std::move(run));
+            return;
+        }
+
+        // Deleted on fclose.
+        FILE* file = tmpfile();
+        if (file == nullptr) throw std::runtime_error("Could not create a temp file to spill the dict into.");
+        spilledRuns.push_back(file);
+        for (const Entry& entry : run) writeEntry(file, entry.first, entry.second);
+        numOfSpilledBytes += ftell(file);
+    }
+
+    // Adds a run written by saveMerged.
+    void addSavedRun(const std::string& path) {
+        FILE* file = fopen(path.c_str(), "rb");
+        if (file == nullptr) throw std::runtime_error("Could not open dict run " + path);
+        spilledRuns.push_back(file);
+    }
+
+    // Merges the runs into a single run at path, which addSavedRun can read back. Consumes the runs.
+    void saveMerged(const std::string& path) {
+        FILE* file = fopen(path.c_str(), "wb");
+        if (file == nullptr) throw std::runtime_error("Could not create dict run " + path);
+        try {
+            merge([&](const std::string& key, const DictValue& value) { writeEntry(file, key, value); });
+        } catch (...) {
+            fclose(file);
+            throw;
+        }
+        if (fclose(file) != 0) throw std::runtime_error("Could not write dict run " + path);
+    }
+
+    // Moves the runs of other into this.
+    void takeRuns(DictRuns& other) {
+        for (auto& run : other.memoryRuns) memoryRuns.push_back(std::move(run));
+        spilledRuns.insert(spilledRuns.end(), other.spilledRuns.begin(), other.spilledRuns.end());
+        numOfSpilledBytes += other.numOfSpilledBytes;
+        other.memoryRuns.clear();
+        other.spilledRuns.clear();
+        other.numOfSpilledBytes = 0;
+    }
+
+    size_t numOfRuns() const { return memoryRuns.size() + spilledRuns.size(); }
+    size_t spilledSizeInBytes() const { return numOfSpilledBytes; }
+
+    // Calls onEntry(key, value) once per distinct key in byte order, with the max prob of the key over all runs.
+    // Consumes the runs.
+    template <typename OnEntry>
+    void merge(OnEntry onEntry) {
+        std::vector<RunCursor> cursors;
+        for (const auto& run : memoryRuns) cursors.push_back(RunCursor(&run, nullptr));
+        for (FILE* spilledRun : spilledRuns) {
+            rewind(spilledRun);
+            cursors.push_back(RunCursor(nullptr, spilledRun));
+        }
+
+        // Min-heap of the current entry of each run, by key.
+        auto isAfter = [&](size_t cursorIndex1, size_t cursorIndex2) {
+            return cursors[cursorIndex1].entry.first > cursors[cursorIndex2].entry.first;
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(isAfter)> heap(isAfter);
+        for (size_t cursorIndex = 0; cursorIndex < cursors.size(); ++cursorIndex) {
+            if (cursors[cursorIndex].next()) heap.push(cursorIndex);
+        }
+
+        Entry merged;
+        bool hasMerged = false;
+        while (!heap.empty()) {
+            const size_t cursorIndex = heap.top();
+            heap.pop();
+            Entry& entry = cursors[cursorIndex].entry;
+            if (hasMerged && merged.first == entry.first) {
+                merged.second.prob = std::max(merged.second.prob, entry.second.prob);
+            } else {
+                if (hasMerged) onEntry(merged.first, merged.second);
+                merged.swap(entry);
+                hasMerged = true;
+            }
+            if (cursors[cursorIndex].next()) heap.push(cursorIndex);
+        }
+        if (hasMerged) onEntry(merged.first, merged.second);
+
+        memoryRuns.clear();
+        for (FILE* spilledRun : spilledRuns) fclose(spilledRun);
+        spilledRuns.clear();
+    }
+
+private:
+    static void writeEntry(FILE* file, const std::string& key, const DictValue& value) {
+        const uint32_t keyLength = (uint32_t)key.length();
+        if (fwrite(&keyLength, sizeof(keyLength), 1, file) != 1 ||
+            fwrite(key.data(), 1, keyLength, file) != keyLength ||
+            fwrite(&value.prob, sizeof(value.prob), 1, file) != 1 ||
+            fwrite(&value.numOfCodePoints, sizeof(value.numOfCodePoints), 1, file) != 1) {
+            throw std::runtime_error("Could not write a dict run.");
+        }
+    }
+
+    // Reads a run in memory or in a file one entry at a time.
+    struct RunCursor {
+        RunCursor(const std::vector<Entry>* memoryRun, FILE* spilledRun) : memoryRun(memoryRun), spilledRun(spilledRun) {}
+
+        bool next() {
+            if (memoryRun != nullptr) {
+                if (index >= memoryRun->size()) return false;
+                entry = (*memoryRun)[index++];
+                return true;
+            }
+            uint32_t keyLength;
+            if (fread(&keyLength, sizeof(keyLength), 1, spilledRun) != 1) return false;
+            entry.first.resize(keyLength);
+            if (fread(&entry.first[0], 1, keyLength, spilledRun) != keyLength ||
+                fread(&entry.second.prob, sizeof(entry.second.prob), 1, spilledRun) != 1 ||
+                fread(&entry.second.numOfCodePoints, sizeof(entry.second.numOfCodePoints), 1, spilledRun) != 1) {
+                throw std::runtime_error("Could not read back a spilled dict run.");
+            }
+            return true;
+        }
+
+        const std::vector<Entry>* memoryRun;
+        FILE* spilledRun;
+        size_t index = 0;
+        Entry entry;
+    };
+
+    std::vector<std::vector<Entry>> memoryRuns;
+    std::vector<FILE*> spilledRuns;
+    size_t numOfSpilledBytes = 0;
+};
+
+#endif /* DictRuns_hpp */
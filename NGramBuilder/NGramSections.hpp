@@ -0,0 +1,239 @@
+//
+//  NGramSections.hpp
+//  NGramBuilder
+//
+//  Builds the sections of the ngram file that are derived from the trie and the weights, and writes the file.
+//  NGramTest builds its files with the same functions, so it checks the sections the builder ships.
+//
+
+#ifndef NGramSections_hpp
+#define NGramSections_hpp
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "marisa/iostream.h"
+#include "marisa/trie.h"
+
+#include "NGram.h"
+#include "Utf8.h"
+#include "WeightCodebook.hpp"
+#include "dynamic_bitset.hpp"
+
+// Completions are precomputed for prefixes with up to this many chars. Set to 0 to omit the top-K sections.
+const size_t topKMaxPrefixLength = 2;
+// Number of best completions stored per prefix.
+const size_t topKSize = 64;
+
+typedef sul::dynamic_bitset<unsigned char> KeyBitset;
+
+struct TopKSections {
+    std::vector<NGramTopKEntry> index;
+    std::vector<uint32_t> keyIds;
+};
+
+// Empty unless the ranges were requested.
+struct LexRangeSections {
+    std::vector<NGramLexRange> ranges;
+    std::vector<uint32_t> keyIds;
+    std::vector<WeightCode> weightCodes;
+};
+
+// If keyRecords is not empty, it replaces the weight, isWord, isOffensive and suffixWordMask sections.
+inline void writeNGram(size_t maxN, const marisa::Trie& trie, const std::vector<WeightCode>& weightCodes, const WeightCodebook& codebook, const KeyBitset& isWordList, const TopKSections& topKSections, const KeyBitset& isOffensiveList, const std::vector<uint8_t>& suffixWordMasks, const std::vector<NGramKeyRecord>& keyRecords, const LexRangeSections& lexRangeSections, const std::string& outputFile, std::ostream& log) {
+    std::ofstream ngramFileStream(outputFile);
+
+    NGramHeader header;
+    header.numOfEntries = trie.size();
+    header.maxN = maxN;
+
+    size_t currentPtr = header.headerSizeInBytes;
+    header.sections[NGramSectionId::trie].dataOffset = currentPtr;
+    header.sections[NGramSectionId::trie].dataSizeInBytes = trie.io_size();
+    currentPtr += header.sections[NGramSectionId::trie].dataSizeInBytes;
+
+    header.sections[weight].dataOffset = currentPtr;
+    header.sections[weight].dataSizeInBytes = keyRecords.empty() ? header.numOfEntries * sizeof(WeightCode) : 0;
+    currentPtr += header.sections[weight].dataSizeInBytes;
+
+    size_t isWordListByteLen = keyRecords.empty() ? (isWordList.size() + 7) / 8 : 0;
+    header.sections[isWord].dataOffset = currentPtr;
+    header.sections[isWord].dataSizeInBytes = isWordListByteLen;
+    currentPtr += header.sections[isWord].dataSizeInBytes;
+
+    header.sections[topKIndex].dataOffset = currentPtr;
+    header.sections[topKIndex].dataSizeInBytes = topKSections.index.size() * sizeof(NGramTopKEntry);
+    currentPtr += header.sections[topKIndex].dataSizeInBytes;
+
+    header.sections[topKKeyIds].dataOffset = currentPtr;
+    header.sections[topKKeyIds].dataSizeInBytes = topKSections.keyIds.size() * sizeof(uint32_t);
+    currentPtr += header.sections[topKKeyIds].dataSizeInBytes;
+
+    size_t isOffensiveListByteLen = keyRecords.empty() ? (isOffensiveList.size() + 7) / 8 : 0;
+    header.sections[isOffensive].dataOffset = currentPtr;
+    header.sections[isOffensive].dataSizeInBytes = isOffensiveListByteLen;
+    currentPtr += header.sections[isOffensive].dataSizeInBytes;
+
+    header.sections[weightCodebook].dataOffset = currentPtr;
+    header.sections[weightCodebook].dataSizeInBytes = kNumOfWeightCodes * sizeof(float);
+    currentPtr += header.sections[weightCodebook].dataSizeInBytes;
+
+    header.sections[keyRecord].dataOffset = currentPtr;
+    header.sections[keyRecord].dataSizeInBytes = keyRecords.size() * sizeof(NGramKeyRecord);
+    currentPtr += header.sections[keyRecord].dataSizeInBytes;
+
+    header.sections[suffixWordMask].dataOffset = currentPtr;
+    header.sections[suffixWordMask].dataSizeInBytes = keyRecords.empty() ? suffixWordMasks.size() : 0;
+    currentPtr += header.sections[suffixWordMask].dataSizeInBytes;
+
+    header.sections[lexRange].dataOffset = currentPtr;
+    header.sections[lexRange].dataSizeInBytes = lexRangeSections.ranges.size() * sizeof(NGramLexRange);
+    currentPtr += header.sections[lexRange].dataSizeInBytes;
+
+    header.sections[lexKeyIds].dataOffset = currentPtr;
+    header.sections[lexKeyIds].dataSizeInBytes = lexRangeSections.keyIds.size() * sizeof(uint32_t);
+    currentPtr += header.sections[lexKeyIds].dataSizeInBytes;
+
+    header.sections[lexWeightCodes].dataOffset = currentPtr;
+    header.sections[lexWeightCodes].dataSizeInBytes = lexRangeSections.weightCodes.size() * sizeof(WeightCode);
+    currentPtr += header.sections[lexWeightCodes].dataSizeInBytes;
+
+    ngramFileStream.write((char*)&header, header.headerSizeInBytes);
+
+    marisa::write(ngramFileStream, trie);
+    ngramFileStream.write((char*)weightCodes.data(), header.sections[weight].dataSizeInBytes);
+    ngramFileStream.write((char*)isWordList.data(), isWordListByteLen);
+    ngramFileStream.write((char*)topKSections.index.data(), header.sections[topKIndex].dataSizeInBytes);
+    ngramFileStream.write((char*)topKSections.keyIds.data(), header.sections[topKKeyIds].dataSizeInBytes);
+    ngramFileStream.write((char*)isOffensiveList.data(), isOffensiveListByteLen);
+    ngramFileStream.write((char*)codebook.logProbs().data(), header.sections[weightCodebook].dataSizeInBytes);
+    ngramFileStream.write((char*)keyRecords.data(), header.sections[keyRecord].dataSizeInBytes);
+    ngramFileStream.write((char*)suffixWordMasks.data(), header.sections[suffixWordMask].dataSizeInBytes);
+    ngramFileStream.write((char*)lexRangeSections.ranges.data(), header.sections[lexRange].dataSizeInBytes);
+    ngramFileStream.write((char*)lexRangeSections.keyIds.data(), header.sections[lexKeyIds].dataSizeInBytes);
+    ngramFileStream.write((char*)lexRangeSections.weightCodes.data(), header.sections[lexWeightCodes].dataSizeInBytes);
+
+    ngramFileStream.close();
+
+    log << "Wrote " << outputFile << ". File size: " << currentPtr << "\n";
+}
+
+// For every key, finds which of its suffixes are words, i.e. what PredictiveTextEngine would find by looking up
+// the rest of the key after each possible search prefix. Code points are counted the same way it does.
+inline std::vector<uint8_t> buildSuffixWordMasks(const marisa::Trie& trie, const KeyBitset& isWordList) {
+    std::vector<uint8_t> suffixWordMasks(trie.size(), 0);
+    marisa::Agent reverseLookupAgent, lookupAgent;
+    for (size_t id = 0; id < trie.size(); ++id) {
+        reverseLookupAgent.set_query(id);
+        trie.reverse_lookup(reverseLookupAgent);
+        const std::string_view key(reverseLookupAgent.key().ptr(), reverseLookupAgent.key().length());
+        size_t index = 0;
+        for (size_t i = 1; i <= kNumOfSuffixWordBits; ++i) {
+            index = nextCodePointIndex(key, index);
+            if (index >= key.length()) break;
+            lookupAgent.set_query(key.data() + index, key.length() - index);
+            if (trie.lookup(lookupAgent) && isWordList[lookupAgent.key().id()]) suffixWordMasks[id] |= 1 << (i - 1);
+        }
+    }
+    return suffixWordMasks;
+}
+
+// Packs the per-key data of every key into an NGramKeyRecord.
+inline std::vector<NGramKeyRecord> buildKeyRecords(const std::vector<WeightCode>& weightCodes, const KeyBitset& isWordList, const KeyBitset& isOffensiveList, const std::vector<uint8_t>& numOfCodePointsList, const std::vector<uint8_t>& suffixWordMasks) {
+    std::vector<NGramKeyRecord> keyRecords(weightCodes.size());
+    for (size_t id = 0; id < keyRecords.size(); ++id) {
+        NGramKeyRecord& record = keyRecords[id];
+        record.weightCode = weightCodes[id];
+        record.flags = (isWordList[id] ? keyIsWord : 0) | (isOffensiveList[id] ? keyIsOffensive : 0);
+        record.numOfCodePoints = numOfCodePointsList[id];
+        record.suffixWordMask = suffixWordMasks[id];
+    }
+    return keyRecords;
+}
+
+// Ranks the keys in byte order. A key sorts right before the keys it is a prefix of, so its completions are
+// the run of ranks from its own up to the first key it is not a prefix of.
+inline LexRangeSections buildLexRangeSections(const marisa::Trie& trie, const std::vector<WeightCode>& weightCodes) {
+    LexRangeSections lexRangeSections;
+    std::vector<std::string> keys(trie.size());
+    marisa::Agent reverseLookupAgent;
+    for (size_t id = 0; id < trie.size(); ++id) {
+        reverseLookupAgent.set_query(id);
+        trie.reverse_lookup(reverseLookupAgent);
+        keys[id].assign(reverseLookupAgent.key().ptr(), reverseLookupAgent.key().length());
+    }
+
+    std::vector<uint32_t>& keyIds = lexRangeSections.keyIds;
+    keyIds.resize(trie.size());
+    for (size_t id = 0; id < keyIds.size(); ++id) keyIds[id] = (uint32_t)id;
+    std::sort(keyIds.begin(), keyIds.end(), [&](uint32_t keyId1, uint32_t keyId2) { return keys[keyId1] < keys[keyId2]; });
+
+    lexRangeSections.ranges.resize(trie.size());
+    lexRangeSections.weightCodes.resize(trie.size());
+    // Ranks of the keys the current key extends, innermost last. Each is closed by the first key it is not a prefix of.
+    std::vector<uint32_t> openRanks;
+    for (uint32_t rank = 0; rank < keyIds.size(); ++rank) {
+        const std::string& key = keys[keyIds[rank]];
+        while (!openRanks.empty() && key.compare(0, keys[keyIds[openRanks.back()]].length(), keys[keyIds[openRanks.back()]]) != 0) {
+            lexRangeSections.ranges[keyIds[openRanks.back()]].endRank = rank;
+            openRanks.pop_back();
+        }
+        lexRangeSections.ranges[keyIds[rank]].firstRank = rank;
+        lexRangeSections.weightCodes[rank] = weightCodes[keyIds[rank]];
+        openRanks.push_back(rank);
+    }
+    for (uint32_t openRank : openRanks) lexRangeSections.ranges[keyIds[openRank]].endRank = (uint32_t)keyIds.size();
+    return lexRangeSections;
+}
+
+// For every key with up to maxPrefixLength chars, find its best k completions.
+// The order must match the order PredictiveTextEngine ranks keys: weight descending, then key id ascending.
+inline TopKSections buildTopKSections(const marisa::Trie& trie, const std::vector<float>& weights, const std::vector<uint8_t>& numOfCodePointsList, size_t maxPrefixLength, size_t k) {
+    TopKSections topKSections;
+    if (maxPrefixLength == 0) return topKSections;
+
+    auto isRankedHigher = [&](uint32_t keyId1, uint32_t keyId2) {
+        if (weights[keyId1] != weights[keyId2]) return weights[keyId1] > weights[keyId2];
+        return keyId1 < keyId2;
+    };
+
+    marisa::Agent allKeysAgent;
+    allKeysAgent.set_query("");
+    std::vector<uint32_t> completions;
+    while (trie.predictive_search(allKeysAgent)) {
+        const marisa::Key& prefixKey = allKeysAgent.key();
+        if (numOfCodePointsList[prefixKey.id()] > maxPrefixLength) continue;
+        const std::string prefix(prefixKey.ptr(), prefixKey.length());
+
+        completions.clear();
+        marisa::Agent agent;
+        agent.set_query(prefix);
+        while (trie.predictive_search(agent)) {
+            completions.push_back((uint32_t)agent.key().id());
+        }
+
+        size_t numOfKeyIds = std::min(k, completions.size());
+        std::partial_sort(completions.begin(), completions.begin() + numOfKeyIds, completions.end(), isRankedHigher);
+
+        NGramTopKEntry entry;
+        entry.prefixKeyId = (uint32_t)prefixKey.id();
+        entry.keyIdsOffset = (uint32_t)topKSections.keyIds.size();
+        entry.numOfKeyIds = (uint16_t)numOfKeyIds;
+        entry.isTruncated = completions.size() > numOfKeyIds;
+        topKSections.index.push_back(entry);
+        topKSections.keyIds.insert(topKSections.keyIds.end(), completions.begin(), completions.begin() + numOfKeyIds);
+    }
+
+    std::sort(topKSections.index.begin(), topKSections.index.end(), [](const NGramTopKEntry& a, const NGramTopKEntry& b) {
+        return a.prefixKeyId < b.prefixKeyId;
+    });
+
+    return topKSections;
+}
+
+#endif /* NGramSections_hpp */
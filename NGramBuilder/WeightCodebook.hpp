@@ -0,0 +1,98 @@
+//
+//  WeightCodebook.hpp
+//  NGramBuilder
+//
+//  Quantizes weights to kNumOfWeightCodes log-probability levels fitted to the data with 1-D k-means.
+//  Levels are ascending, so encoding keeps the order of the weights and codes can be compared directly.
+//
+
+#ifndef WeightCodebook_hpp
+#define WeightCodebook_hpp
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+#include "NGram.h"
+
+class WeightCodebook {
+public:
+    void fit(const std::vector<float>& weights, size_t numOfIterations = 30) {
+        std::vector<float> values;
+        values.reserve(weights.size());
+        for (float weight : weights) values.push_back(toLogProb(weight));
+        std::sort(values.begin(), values.end());
+
+        std::vector<float> distinctValues(values);
+        distinctValues.erase(std::unique(distinctValues.begin(), distinctValues.end()), distinctValues.end());
+        levels.clear();
+        if (distinctValues.size() <= kNumOfWeightCodes) {
+            // Every weight gets a level of its own, no loss.
+            levels = distinctValues;
+        } else {
+            // Start from evenly spaced quantiles, so dense ranges of weights get more levels.
+            for (size_t i = 0; i < kNumOfWeightCodes; ++i) {
+                levels.push_back(values[(2 * i + 1) * values.size() / (2 * kNumOfWeightCodes)]);
+            }
+            levels.erase(std::unique(levels.begin(), levels.end()), levels.end());
+            lloyd(values, numOfIterations);
+        }
+        if (levels.empty()) levels.push_back(0);
+        // Unused codes repeat the last level, so every code decodes to something sensible.
+        while (levels.size() < kNumOfWeightCodes) levels.push_back(levels.back());
+    }
+
+    // Returns the code of the level nearest to weight in log space.
+    WeightCode encode(float weight) const {
+        const float logProb = toLogProb(weight);
+        auto it = std::lower_bound(levels.begin(), levels.end(), logProb);
+        if (it == levels.end()) return (WeightCode)(levels.size() - 1);
+        if (it != levels.begin() && logProb - *(it - 1) <= *it - logProb) --it;
+        return (WeightCode)(it - levels.begin());
+    }
+
+    // Must match how NGramModel decodes weights.
+    float decode(WeightCode code) const {
+        return expf(levels[code]);
+    }
+
+    const std::vector<float>& logProbs() const { return levels; }
+
+private:
+    static float toLogProb(float weight) {
+        return logf(std::max(weight, FLT_MIN));
+    }
+
+    // Moves each level to the mean of the values nearest to it. values must be sorted.
+    void lloyd(const std::vector<float>& values, size_t numOfIterations) {
+        for (size_t iteration = 0; iteration < numOfIterations; ++iteration) {
+            std::vector<double> sums(levels.size(), 0);
+            std::vector<size_t> counts(levels.size(), 0);
+            size_t level = 0;
+            for (float value : values) {
+                // values are sorted, the nearest level only moves forward.
+                while (level + 1 < levels.size() && value - levels[level] > levels[level + 1] - value) level++;
+                sums[level] += value;
+                counts[level]++;
+            }
+
+            bool hasChanged = false;
+            std::vector<float> newLevels;
+            for (size_t i = 0; i < levels.size(); ++i) {
+                // Drop levels nothing maps to.
+                if (counts[i] == 0) continue;
+                const float newLevel = (float)(sums[i] / counts[i]);
+                hasChanged |= newLevel != levels[i];
+                newLevels.push_back(newLevel);
+            }
+            hasChanged |= newLevels.size() != levels.size();
+            levels.swap(newLevels);
+            if (!hasChanged) break;
+        }
+    }
+
+    std::vector<float> levels;
+};
+
+#endif /* WeightCodebook_hpp */
@@ -5,12 +5,23 @@
 //  Created by Alex Man on 12/20/21.
 //
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <exception>
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <thread>
 #include <vector>
 #include <unordered_map>
-#include <unordered_set>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <unicode/ustring.h>
 
 #include "marisa.h"
@@ -19,6 +30,13 @@
 #include "opencc.h"
 
 #include "NGram.h"
+#include "Utf8.h"
+#include "AhoCorasick.hpp"
+#include "BuildCache.hpp"
+#include "DictRuns.hpp"
+#include "NGramSections.hpp"
+#include "OffensiveWords.h"
+#include "WeightCodebook.hpp"
 #include "dynamic_bitset.hpp"
 
 using namespace std;
@@ -33,6 +51,31 @@ const char* rimeDictPaths[] = {
     "../CantoboardFramework/Data/Rime/jyut6ping3.phrase.dict.yaml",
 };
 
+// Keys containing any word listed in this file or in builtInOffensiveWords are flagged as offensive.
+const char* defaultOffensiveWordsPath = "offensive-words.txt";
+
+// Every variant is built from the same parse of ngram.csv, converted with its own opencc config.
+struct NGramVariant {
+    const char* openccConfigPath;
+    const char* outputPath;
+};
+const NGramVariant variants[] = {
+    { "../CantoboardFramework/Data/Rime/opencc/t2hk.json", "../CantoboardFramework/Data/InstallToCache/NGram/zh_HK.ngram" },
+    { "../CantoboardFramework/Data/Rime/opencc/t2s.json", "../CantoboardFramework/Data/InstallToCache/NGram/zh_CN.ngram" },
+};
+
+// ngram.csv is split into chunks of at least this size to be parsed in parallel.
+const size_t csvChunkMinSizeInBytes = 1 << 20;
+
+// Rough size of a Dict entry with a short key, to estimate when to spill the dict.
+const size_t dictEntrySizeInBytes = 80;
+
+// Intermediate results are cached here, relative to the working directory, unless --no-cache is given.
+const char* defaultBuildCacheDirectory = "build-cache";
+// Part of every cache entry hash. Bump it when a change to the builder changes what a cached stage produces,
+// e.g. the row validation in readDict.
+const uint64_t buildCacheVersion = 2;
+
 bool endsWith(std::string const &fullString, std::string const &ending) {
     if (fullString.length() >= ending.length()) {
         return (0 == fullString.compare (fullString.length() - ending.length(), ending.length(), ending));
@@ -41,9 +84,9 @@ bool endsWith(std::string const &fullString, std::string const &ending) {
     }
 }
 
-// Treat entries in rime dict as "words"/詞組.
-unordered_set<string> readWordEntries() {
-    unordered_set<string> words;
+// Treat entries in rime dict as "words"/詞組. Returns them sorted, to be joined with the keys in key order.
+vector<string> readWordEntries() {
+    vector<string> words;
     
     for (auto rimeDictPath : rimeDictPaths) {
         ifstream dictFile(rimeDictPath);
@@ -63,182 +106,489 @@ unordered_set<string> readWordEntries() {
                 if (first_tab_index == string::npos) {
                     first_tab_index = line.length();
                 }
-                const string word(line.data(), first_tab_index);
-                words.insert(word);
+                words.emplace_back(line.data(), first_tab_index);
             }
         }
         dictFile.close();
     }
     
+    sort(words.begin(), words.end());
+    words.erase(unique(words.begin(), words.end()), words.end());
     return words;
 }
 
-unordered_map<string, float> readDict(opencc_t opencc) {
-    unordered_map<string, float> ret;
-    
-    ios::sync_with_stdio(false);
+// Logs whether a build stage was served from the cache and how long it took.
+void logStage(ostream& log, const string& stage, const BuildCache& cache, bool isCacheHit, chrono::steady_clock::time_point startTime) {
+    const double seconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+    log << stage << ": " << (!cache.isEnabled() ? "not cached" : isCacheHit ? "cache hit" : "cache miss") << ", " << seconds << "s\n";
+}
 
-    ifstream dictFile("ngram.csv");
+// Like readWordEntries, cached by the contents of the Rime dicts.
+vector<string> readWordEntries(const BuildCache& cache) {
+    const auto startTime = chrono::steady_clock::now();
+    string entryPath;
+    if (cache.isEnabled()) {
+        ContentHash hash;
+        hash.add(buildCacheVersion);
+        for (auto rimeDictPath : rimeDictPaths) hash.add(string(rimeDictPath)).addFile(rimeDictPath);
+        entryPath = cache.entryPath("words", hash.value(), ".txt");
+        if (cache.hasEntry(entryPath)) {
+            vector<string> words;
+            ifstream entryFile(entryPath);
+            string word;
+            while (getline(entryFile, word)) words.push_back(word);
+            logStage(cout, "Rime words", cache, true, startTime);
+            return words;
+        }
+    }
     
-    if (!dictFile.is_open()) throw std::runtime_error("Could not open file");
+    vector<string> words = readWordEntries();
+    if (cache.isEnabled()) {
+        const string tempPath = cache.tempPath(entryPath, "builder");
+        ofstream entryFile(tempPath);
+        for (const string& word : words) entryFile << word << '\n';
+        entryFile.close();
+        if (!entryFile) throw std::runtime_error("Could not write " + tempPath);
+        cache.commit(tempPath, entryPath);
+    }
+    logStage(cout, "Rime words", cache, false, startTime);
+    return words;
+}
+
+// Hashes an opencc config and the dictionary files it names, which opencc looks up next to the config.
+uint64_t hashOpenccConfig(const string& openccConfigPath) {
+    ContentHash hash;
+    hash.addFile(openccConfigPath);
     
-    bool isFirstLine = true;
-    std::string line;
-    int lineNum = 0;
-    while (getline(dictFile, line)) {
-        lineNum++;
-        if (isFirstLine) {
-            isFirstLine = false;
-            continue;
+    ifstream configFile(openccConfigPath);
+    const string config((istreambuf_iterator<char>(configFile)), istreambuf_iterator<char>());
+    const string configDirectory = openccConfigPath.substr(0, openccConfigPath.rfind('/') + 1);
+    const string fileKey = "\"file\"";
+    for (size_t index = config.find(fileKey); index != string::npos; index = config.find(fileKey, index + 1)) {
+        const size_t nameBegin = config.find('"', config.find(':', index + fileKey.length())) + 1;
+        const size_t nameEnd = config.find('"', nameBegin);
+        if (nameBegin == 0 || nameEnd == string::npos) break;
+        const string fileName = config.substr(nameBegin, nameEnd - nameBegin);
+        hash.add(fileName).addFile(configDirectory + fileName);
+    }
+    return hash.value();
+}
+
+// A line aligned slice of ngram.csv.
+struct CsvChunk {
+    const char* begin;
+    const char* end;
+    // Line number of the first line in the file, counting from 1.
+    size_t firstLineNum;
+};
+
+// Splits data into about numOfChunks chunks, each ending right after a newline or at the end of data.
+vector<CsvChunk> splitIntoLineChunks(const char* data, size_t size, size_t numOfChunks) {
+    vector<CsvChunk> chunks;
+    const char* const dataEnd = data + size;
+    const char* chunkBegin = data;
+    size_t lineNum = 1;
+    for (size_t i = 1; i <= numOfChunks && chunkBegin < dataEnd; ++i) {
+        const char* chunkEnd = dataEnd;
+        if (i < numOfChunks) {
+            chunkEnd = max(chunkBegin, data + size * i / numOfChunks);
+            const char* newline = (const char*)memchr(chunkEnd, '\n', dataEnd - chunkEnd);
+            chunkEnd = newline != nullptr ? newline + 1 : dataEnd;
         }
+        chunks.push_back({ chunkBegin, chunkEnd, lineNum });
+        lineNum += count(chunkBegin, chunkEnd, '\n');
+        chunkBegin = chunkEnd;
+    }
+    return chunks;
+}
+
+// Parses the rows of chunk once and converts each with every opencc handle into the dict of the same index,
+// keeping the max probability of each converted key.
+// Removed rows are logged into log instead of cerr, so the output does not depend on the order chunks are parsed in.
+void readDictChunk(const CsvChunk& chunk, const vector<opencc_t>& openccs, vector<Dict>& dicts, string& log, size_t& numOfRows) {
+    size_t lineNum = chunk.firstLineNum;
+    for (const char* lineBegin = chunk.begin; lineBegin < chunk.end; ++lineNum) {
+        const char* lineEnd = (const char*)memchr(lineBegin, '\n', chunk.end - lineBegin);
+        if (lineEnd == nullptr) lineEnd = chunk.end;
+        const string_view line(lineBegin, lineEnd - lineBegin);
+        lineBegin = lineEnd + 1;
         
-        if (line.empty()) continue;
+        // Skip the header.
+        if (lineNum == 1 || line.empty()) continue;
+        numOfRows++;
         
         try {
-            const char* text = strtok(line.data(), ",");
-            // Skip conditional prob:
-            strtok(NULL, ",");
-            float prob = std::stof(strtok(NULL, ","));
-            size_t textLen = strlen(text);
+            // Columns: text, conditional prob, prob.
+            const size_t textEnd = line.find(',');
+            const size_t conditionalProbEnd = textEnd != string_view::npos ? line.find(',', textEnd + 1) : string_view::npos;
+            if (conditionalProbEnd == string_view::npos) throw std::invalid_argument("missing columns");
+            const size_t probEnd = min(line.length(), line.find(',', conditionalProbEnd + 1));
+            const float prob = std::stof(string(line.substr(conditionalProbEnd + 1, probEnd - conditionalProbEnd - 1)));
+            const size_t textLen = textEnd;
             if (textLen == 0) continue;
             
-            char* converted = opencc_convert_utf8(opencc, text, textLen);
-            
-            UErrorCode errorCode = UErrorCode::U_ZERO_ERROR;
-            
-            UChar ustrBuf[10240];
-            int32_t ustrDestLength = 0;
-            u_strFromUTF8(ustrBuf, sizeof(ustrBuf)/sizeof(*ustrBuf), &ustrDestLength, converted, -1, &errorCode);
-            
-            UChar32 ustr32Buf[10240];
-            int32_t ustr32DestLength = 0;
-            u_strToUTF32(ustr32Buf, sizeof(ustr32Buf)/sizeof(*ustr32Buf), &ustr32DestLength, ustrBuf, ustrDestLength, &errorCode);
+            for (size_t variantIndex = 0; variantIndex < openccs.size(); ++variantIndex) {
+                char* converted = opencc_convert_utf8(openccs[variantIndex], line.data(), textLen);
             
-            if (errorCode != UErrorCode::U_ZERO_ERROR) {
-                cerr << "Error converting line to utf32: " << lineNum << " content: " << line << " exception: " << u_errorName(errorCode) << "\n";
-                exit(-1);
-            }
-            
-            bool isValidString = true;
-            for (size_t i = 0; i < ustr32DestLength; ++i) {
-                UChar32 cUtf32 = ustr32Buf[i];
-                bool isValidChar = (0x4E00 <= cUtf32 && cUtf32 <= 0x9FFF) ||
-                                   (0x3400 <= cUtf32 && cUtf32 <= 0x4DBF) ||
-                                   (0x20000 <= cUtf32 && cUtf32 <= 0x2A6DF);
-                if (!isValidChar) {
-                    isValidString = false;
-                    cerr << "Removing line " << lineNum << " content: '" << converted << "'\n";
-                    break;
-                };
-            }
-            
-            if (isValidString) {
-                if (ret.find(converted) == ret.end()) {
-                    ret[converted] = prob;
+                size_t numOfCodePoints;
+                const Utf8TextKind textKind = classifyUtf8Text(converted, numOfCodePoints);
+                if (textKind == Utf8TextKind::invalid) {
+                    opencc_convert_utf8_free(converted);
+                    throw std::runtime_error("Invalid UTF-8");
+                }
+                
+                if (textKind == Utf8TextKind::cjk) {
+                    const DictValue value = { prob, (uint8_t)min<size_t>(UINT8_MAX, numOfCodePoints) };
+                    auto inserted = dicts[variantIndex].emplace(converted, value);
+                    if (!inserted.second) inserted.first->second.prob = max(inserted.first->second.prob, prob);
                 } else {
-                    ret[converted] = max(ret[converted], prob);
+                    log += "Removing line " + to_string(lineNum) + " content: '" + converted + "'\n";
                 }
-            }
 
-            opencc_convert_utf8_free(converted);
-            converted = nullptr;
-#ifdef DEBUG_BUILD_DICT
-            // cout << text << " " << converted << " " << ret[converted] << "\n";
-#endif
+                opencc_convert_utf8_free(converted);
+                converted = nullptr;
+            }
         } catch (exception& ex) {
-            cerr << "Error parsing line: " << lineNum << " content: " << line << " exception: " << ex.what() << "\n";
-            throw;
+            throw std::runtime_error("Error parsing line: " + to_string(lineNum) + " content: " + string(line) + " exception: " + ex.what());
+        }
+    }
+}
+
+// Maps ngram.csv and parses it once on every core, converting each row with every opencc config.
+// Each thread converts with its own opencc handles into its own maps, the maps are merged at the end.
+// With a memory budget, a thread whose maps outgrow its share of the budget spills them into sorted runs on disk instead.
+// Returns the runs of the dict of each config. The merged runs do not depend on the number of threads or the budget.
+vector<DictRuns> readDict(const vector<const char*>& openccConfigPaths, size_t memoryBudgetInBytes) {
+    ios::sync_with_stdio(false);
+    
+    const auto startTime = chrono::steady_clock::now();
+    const int fd = open("ngram.csv", O_RDONLY);
+    if (fd == -1) throw std::runtime_error("Could not open file");
+    struct stat fileStat;
+    fstat(fd, &fileStat);
+    const size_t fileSize = fileStat.st_size;
+    const char* data = nullptr;
+    if (fileSize > 0) {
+        data = (const char*)mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error(string("Could not mmap file. ") + strerror(errno));
+        }
+        madvise((void*)data, fileSize, MADV_SEQUENTIAL);
+    }
+    
+    const size_t numOfThreads = max(1u, thread::hardware_concurrency());
+    // More chunks than threads, so a thread stuck on slow rows does not hold up the rest.
+    const size_t numOfChunks = max<size_t>(1, min(numOfThreads * 8, fileSize / csvChunkMinSizeInBytes));
+    const vector<CsvChunk> chunks = splitIntoLineChunks(data, fileSize, numOfChunks);
+    
+    vector<vector<Dict>> threadDicts(numOfThreads, vector<Dict>(openccConfigPaths.size()));
+    vector<vector<DictRuns>> threadRuns(numOfThreads);
+    for (auto& runs : threadRuns) runs.resize(openccConfigPaths.size());
+    const size_t threadMemoryBudgetInBytes = memoryBudgetInBytes / numOfThreads;
+    // Spills the maps of a thread into runs, leaving them empty.
+    auto spill = [&](size_t threadIndex) {
+        for (size_t variantIndex = 0; variantIndex < openccConfigPaths.size(); ++variantIndex) {
+            if (threadDicts[threadIndex][variantIndex].empty()) continue;
+            threadRuns[threadIndex][variantIndex].addRun(threadDicts[threadIndex][variantIndex], true);
+        }
+    };
+    vector<size_t> threadNumOfRows(numOfThreads, 0);
+    vector<string> chunkLogs(chunks.size());
+    vector<exception_ptr> chunkErrors(chunks.size());
+    vector<exception_ptr> spillErrors(numOfThreads);
+    atomic<size_t> nextChunkIndex(0);
+    vector<thread> threads;
+    for (size_t threadIndex = 0; threadIndex < numOfThreads; ++threadIndex) {
+        threads.emplace_back([&, threadIndex] {
+            vector<opencc_t> openccs;
+            for (const char* openccConfigPath : openccConfigPaths) openccs.push_back(opencc_open(openccConfigPath));
+            for (size_t chunkIndex = nextChunkIndex++; chunkIndex < chunks.size(); chunkIndex = nextChunkIndex++) {
+                try {
+                    for (size_t variantIndex = 0; variantIndex < openccs.size(); ++variantIndex) {
+                        if (openccs[variantIndex] == (opencc_t)-1) throw std::runtime_error(string("Could not open opencc config ") + openccConfigPaths[variantIndex]);
+                    }
+                    readDictChunk(chunks[chunkIndex], openccs, threadDicts[threadIndex], chunkLogs[chunkIndex], threadNumOfRows[threadIndex]);
+                    if (memoryBudgetInBytes > 0) {
+                        size_t numOfEntries = 0;
+                        for (const auto& dict : threadDicts[threadIndex]) numOfEntries += dict.size();
+                        if (numOfEntries * dictEntrySizeInBytes > threadMemoryBudgetInBytes) spill(threadIndex);
+                    }
+                } catch (...) {
+                    chunkErrors[chunkIndex] = current_exception();
+                }
+            }
+            for (opencc_t opencc : openccs) {
+                if (opencc != (opencc_t)-1) opencc_close(opencc);
+            }
+            // Nothing of the dict stays in memory while the tries are built.
+            if (memoryBudgetInBytes > 0) {
+                try {
+                    spill(threadIndex);
+                } catch (...) {
+                    spillErrors[threadIndex] = current_exception();
+                }
+            }
+        });
+    }
+    for (thread& t : threads) t.join();
+    
+    if (data != nullptr) munmap((void*)data, fileSize);
+    close(fd);
+    
+    for (size_t chunkIndex = 0; chunkIndex < chunks.size(); ++chunkIndex) {
+        cerr << chunkLogs[chunkIndex];
+        if (chunkErrors[chunkIndex] != nullptr) {
+            try {
+                rethrow_exception(chunkErrors[chunkIndex]);
+            } catch (exception& ex) {
+                cerr << ex.what() << "\n";
+                throw;
+            }
+        }
+    }
+    for (const exception_ptr& spillError : spillErrors) {
+        if (spillError != nullptr) rethrow_exception(spillError);
+    }
+    
+    // Max is order independent, so the merged maps do not depend on which thread parsed which chunk.
+    vector<Dict> dicts = move(threadDicts[0]);
+    for (size_t threadIndex = 1; threadIndex < numOfThreads; ++threadIndex) {
+        for (size_t variantIndex = 0; variantIndex < dicts.size(); ++variantIndex) {
+            for (const auto& entry : threadDicts[threadIndex][variantIndex]) {
+                auto inserted = dicts[variantIndex].insert(entry);
+                if (!inserted.second) inserted.first->second.prob = max(inserted.first->second.prob, entry.second.prob);
+            }
         }
+        vector<Dict>().swap(threadDicts[threadIndex]);
     }
     
-    dictFile.close();
+    vector<DictRuns> ret(openccConfigPaths.size());
+    for (size_t variantIndex = 0; variantIndex < ret.size(); ++variantIndex) {
+        // Empty if every thread spilled.
+        if (!dicts[variantIndex].empty()) ret[variantIndex].addRun(dicts[variantIndex], false);
+        for (auto& runs : threadRuns) ret[variantIndex].takeRuns(runs[variantIndex]);
+    }
+    
+    size_t numOfRows = 0;
+    for (size_t threadNumOfRow : threadNumOfRows) numOfRows += threadNumOfRow;
+    const double seconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+    cout << "Read " << numOfRows << " rows for " << ret.size() << " variants in " << seconds << "s with " << numOfThreads
+         << " threads, " << (size_t)(numOfRows / max(seconds, 1e-9)) << " rows/s.\n";
+    if (memoryBudgetInBytes > 0) {
+        for (size_t variantIndex = 0; variantIndex < ret.size(); ++variantIndex) {
+            cout << "Spilled " << ret[variantIndex].numOfRuns() << " runs, " << ret[variantIndex].spilledSizeInBytes()
+                 << " bytes, of " << openccConfigPaths[variantIndex] << ".\n";
+        }
+    }
     
     return ret;
 }
 
-void writeNGram(size_t maxN, const Trie& trie, const Weight* weights, const dynamic_bitset<unsigned char>& isWordList, const string& outputFile) {
-    ofstream ngramFileStream(outputFile);
-        
-    NGramHeader header;
-    header.numOfEntries = trie.size();
-    header.maxN = maxN;
+// Matches builtInOffensiveWords and the words of the file, one per line, skipping blank lines and # comments.
+// Each word is added both as is and converted by opencc.
+AhoCorasick readOffensiveWords(const string& path, opencc_t opencc) {
+    ifstream wordsFile(path);
+    if (!wordsFile.is_open()) throw std::runtime_error("Could not open offensive words file " + path);
     
-    size_t currentPtr = header.headerSizeInBytes;
-    header.sections[NGramSectionId::trie].dataOffset = currentPtr;
-    header.sections[NGramSectionId::trie].dataSizeInBytes = trie.io_size();
-    currentPtr += header.sections[NGramSectionId::trie].dataSizeInBytes;
+    AhoCorasick matcher;
+    auto addWord = [&](const string& word) {
+        matcher.addPattern(word);
+        char* converted = opencc_convert_utf8(opencc, word.c_str(), word.length());
+        if (word != converted) matcher.addPattern(converted);
+        opencc_convert_utf8_free(converted);
+    };
+    for (const char* word : builtInOffensiveWords) addWord(word);
+    std::string line;
+    while (getline(wordsFile, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line.front() == '#') continue;
+        addWord(line);
+    }
+    matcher.build();
+    return matcher;
+}
+
+// The check readDict did before classifyUtf8Text, kept to benchmark against. Fails on text over 10240 UTF-16 units.
+Utf8TextKind classifyUtf8TextWithIcu(const char* text) {
+    UErrorCode errorCode = UErrorCode::U_ZERO_ERROR;
     
-    header.sections[weight].dataOffset = currentPtr;
-    header.sections[weight].dataSizeInBytes = header.numOfEntries * sizeof(Weight);
-    currentPtr += header.sections[weight].dataSizeInBytes;
+    UChar ustrBuf[10240];
+    int32_t ustrDestLength = 0;
+    u_strFromUTF8(ustrBuf, sizeof(ustrBuf)/sizeof(*ustrBuf), &ustrDestLength, text, -1, &errorCode);
     
-    size_t isWordListByteLen = (isWordList.size() + 7) / 8;
-    header.sections[isWord].dataOffset = currentPtr;
-    header.sections[isWord].dataSizeInBytes = isWordListByteLen;
-    currentPtr += header.sections[isWord].dataSizeInBytes;
+    UChar32 ustr32Buf[10240];
+    int32_t ustr32DestLength = 0;
+    u_strToUTF32(ustr32Buf, sizeof(ustr32Buf)/sizeof(*ustr32Buf), &ustr32DestLength, ustrBuf, ustrDestLength, &errorCode);
     
-    ngramFileStream.write((char*)&header, header.headerSizeInBytes);
+    if (errorCode != UErrorCode::U_ZERO_ERROR) return Utf8TextKind::invalid;
+    for (int32_t i = 0; i < ustr32DestLength; ++i) {
+        if (!isCjkCodePoint(ustr32Buf[i])) return Utf8TextKind::notCjk;
+    }
+    return Utf8TextKind::cjk;
+}
+
+// Times classifyUtf8Text against the ICU round trip on the text column of ngram.csv and checks they agree.
+int benchmarkUtf8Classification() {
+    ifstream dictFile("ngram.csv");
+    if (!dictFile.is_open()) throw std::runtime_error("Could not open file");
+    vector<string> texts;
+    string line;
+    getline(dictFile, line);
+    while (getline(dictFile, line)) {
+        if (!line.empty()) texts.push_back(line.substr(0, line.find(',')));
+    }
     
-    write(ngramFileStream, trie);
-    ngramFileStream.write((char*)weights, trie.size() * sizeof(Weight));
-    ngramFileStream.write((char*)isWordList.data(), isWordListByteLen);
+    size_t numOfMismatches = 0;
+    for (const string& text : texts) {
+        size_t numOfCodePoints;
+        if (classifyUtf8Text(text, numOfCodePoints) != classifyUtf8TextWithIcu(text.c_str())) numOfMismatches++;
+    }
     
-    ngramFileStream.close();
+    const int iterations = 5;
+    size_t numOfCjkTexts = 0;
+    auto startTime = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        for (const string& text : texts) numOfCjkTexts += classifyUtf8TextWithIcu(text.c_str()) == Utf8TextKind::cjk;
+    }
+    const double icuNs = chrono::duration<double, nano>(chrono::steady_clock::now() - startTime).count();
+    startTime = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        for (const string& text : texts) {
+            size_t numOfCodePoints;
+            numOfCjkTexts += classifyUtf8Text(text, numOfCodePoints) == Utf8TextKind::cjk;
+        }
+    }
+    const double singlePassNs = chrono::duration<double, nano>(chrono::steady_clock::now() - startTime).count();
+    
+    const size_t numOfSamples = max<size_t>(1, iterations * texts.size());
+    cout << "Classified " << texts.size() << " texts (" << numOfCjkTexts / (2 * iterations) << " CJK). ICU: "
+         << icuNs / numOfSamples << " ns/text, single pass: " << singlePassNs / numOfSamples << " ns/text, "
+         << icuNs / max(singlePassNs, 1.0) << "x. Mismatches: " << numOfMismatches << "\n";
+    return numOfMismatches == 0 ? 0 : 1;
 }
 
-size_t countCodePointsInUtf8String(const string& utf8String) {
-    UChar textInUtf16[1024];
-    UErrorCode pErrorCode = UErrorCode::U_ZERO_ERROR;
-    u_strFromUTF8(textInUtf16, sizeof(textInUtf16) / sizeof(*textInUtf16), nullptr, utf8String.c_str(), -1, &pErrorCode);
-    return u_countChar32(textInUtf16, -1);
+// Copies with the stream buffers, the files are a few MB.
+void copyFile(const string& fromPath, const string& toPath) {
+    ifstream fromFile(fromPath, ios::binary);
+    ofstream toFile(toPath, ios::binary);
+    toFile << fromFile.rdbuf();
+    toFile.close();
+    if (!fromFile || !toFile) throw std::runtime_error("Could not copy " + fromPath + " to " + toPath);
 }
 
-int buildNGram(const char* openccConfigPath, const string& ngramOutputFile) {
+// Builds one variant from its converted dict. Variants are built in parallel, so progress goes to log.
+// words must be sorted. inputsHash covers everything the output depends on, a cached output is copied as is.
+int buildNGram(const char* openccConfigPath, DictRuns& dictRuns, const vector<string>& words, const string& offensiveWordsPath, bool shouldPackKeyRecords, bool shouldBuildLexRanges, const BuildCache& cache, uint64_t inputsHash, const string& ngramOutputFile, ostream& log) {
     Trie trie;
     
-    cout << "Converting using openccConfigPath=" << openccConfigPath << " to " << ngramOutputFile << endl;
+    log << "Converting using openccConfigPath=" << openccConfigPath << " to " << ngramOutputFile << endl;
+    
+    const auto startTime = chrono::steady_clock::now();
+    const string ngramEntryPath = cache.entryPath("ngram", inputsHash, ".ngram");
+    if (cache.hasEntry(ngramEntryPath)) {
+        copyFile(ngramEntryPath, ngramOutputFile);
+        logStage(log, string("NGram of ") + openccConfigPath, cache, true, startTime);
+        return 0;
+    }
     
     opencc_t opencc = opencc_open(openccConfigPath);
-    unordered_map<string, float> dict = readDict(opencc);
+    AhoCorasick offensiveWords = readOffensiveWords(offensiveWordsPath, opencc);
     Keyset keyset;
     
-    unordered_set<string> added;
+    // Building the trie replaces the weights in the keyset with key ids, keep them by key index.
+    vector<float> keyWeights;
+    // Keys come in byte order, so they are joined with the sorted words in a single pass.
+    vector<bool> keyIsWord;
+    auto wordIt = words.begin();
     size_t maxN = 0;
-    for (auto it = dict.begin(); it != dict.end(); ++it) {
-        const string& text = it->first;
-        auto w = it->second;
-        
-        maxN = max(maxN, countCodePointsInUtf8String(text));
+    // The trie only depends on the keys and their weights.
+    ContentHash keysHash;
+    keysHash.add(buildCacheVersion);
+    // Counted by readDict, by key index like keyWeights.
+    vector<uint8_t> keyNumOfCodePoints;
+    dictRuns.merge([&](const string& text, const DictValue& value) {
+        const float w = value.prob;
+        keysHash.add(text).add(&w, sizeof(w));
+        maxN = max<size_t>(maxN, value.numOfCodePoints);
+        keyNumOfCodePoints.push_back(value.numOfCodePoints);
 #ifdef DEBUG_BUILD_DICT
-        // cout << text << "=" << it->second << endl;
+        // cout << text << "=" << w << endl;
 #endif
-        if (added.find(text) != added.end()) {
-            cerr << "Ignoring duplicated key: " << text << endl;
-            continue;
-        }
         keyset.push_back(text, w);
-        added.insert(text);
+        keyWeights.push_back(w);
+        while (wordIt != words.end() && *wordIt < text) ++wordIt;
+        keyIsWord.push_back(wordIt != words.end() && *wordIt == text);
+    });
+    
+    const auto trieStartTime = chrono::steady_clock::now();
+    const string trieEntryPath = cache.entryPath("trie", keysHash.value(), ".marisa");
+    const bool isTrieCached = cache.hasEntry(trieEntryPath);
+    if (isTrieCached) {
+        trie.load(trieEntryPath.c_str());
+    } else {
+        trie.build(keyset, MARISA_TEXT_TAIL | MARISA_WEIGHT_ORDER);
+        if (cache.isEnabled()) {
+            const string tempPath = cache.tempPath(trieEntryPath, ngramOutputFile.substr(ngramOutputFile.rfind('/') + 1));
+            trie.save(tempPath.c_str());
+            cache.commit(tempPath, trieEntryPath);
+        }
     }
-    trie.build(keyset, MARISA_TEXT_TAIL | MARISA_WEIGHT_ORDER);
+    logStage(log, string("Trie of ") + openccConfigPath, cache, isTrieCached, trieStartTime);
     
-    Weight* weights = new Weight[trie.size()];
+    vector<float> weights(trie.size());
+    vector<uint8_t> numOfCodePointsList(trie.size());
     
-    unordered_set<string> words = readWordEntries();
     dynamic_bitset<unsigned char> isWordList(keyset.size());
+    dynamic_bitset<unsigned char> isOffensiveList(keyset.size());
+    size_t numOfOffensiveKeys = 0;
     
+    Agent lookupAgent;
     for (size_t keyIndex = 0; keyIndex < keyset.size(); ++keyIndex) {
         const auto& key = keyset[keyIndex];
-        const auto id = key.id();
         const auto keyStr = string(key.str());
-        const auto w = dict[keyStr];
+        size_t id;
+        if (isTrieCached) {
+            // The keyset was not built, so it does not know the key ids.
+            lookupAgent.set_query(keyStr.c_str(), keyStr.length());
+            trie.lookup(lookupAgent);
+            id = lookupAgent.key().id();
+        } else {
+            id = key.id();
+        }
+        const auto w = keyWeights[keyIndex];
 #ifdef DEBUG_BUILD_DICT
         cout << id << "," << keyStr << "=" << w << "\n";
 #endif
         weights[id] = w;
-        isWordList[id] = words.find(keyStr) != words.end();
+        numOfCodePointsList[id] = keyNumOfCodePoints[keyIndex];
+        isWordList[id] = keyIsWord[keyIndex];
+        isOffensiveList[id] = offensiveWords.containsAny(keyStr);
+        if (isOffensiveList[id]) numOfOffensiveKeys++;
+    }
+    log << "Flagged " << numOfOffensiveKeys << " keys matching " << offensiveWords.size() << " offensive words.\n";
+    
+    // Rank with the decoded weights from here on, the engine only sees those.
+    WeightCodebook codebook;
+    codebook.fit(weights);
+    vector<WeightCode> weightCodes(trie.size());
+    double sumOfRelativeErrors = 0;
+    for (size_t id = 0; id < weights.size(); ++id) {
+        weightCodes[id] = codebook.encode(weights[id]);
+        const float decodedWeight = codebook.decode(weightCodes[id]);
+        if (weights[id] > 0) sumOfRelativeErrors += fabs(decodedWeight - weights[id]) / weights[id];
+        weights[id] = decodedWeight;
     }
+    log << "Quantized weights to " << kNumOfWeightCodes << " codes. Mean relative error: "
+              << 100.0 * sumOfRelativeErrors / max<size_t>(1, weights.size()) << "%\n";
     
-    std::cout << "File size: " << trie.io_size() + trie.size() * sizeof(Weight) << "\n";
+    size_t baseFileSize = trie.io_size() + trie.size() * sizeof(WeightCode) + (isWordList.size() + 7) / 8;
+    log << "File size without top-K sections: " << baseFileSize << "\n";
+    
+    TopKSections topKSections = buildTopKSections(trie, weights, numOfCodePointsList, topKMaxPrefixLength, topKSize);
+    size_t topKSectionsSize = topKSections.index.size() * sizeof(NGramTopKEntry) + topKSections.keyIds.size() * sizeof(uint32_t);
+    log << "Top-K sections: " << topKSections.index.size() << " prefixes, " << topKSectionsSize << " bytes (+"
+              << 100.0 * topKSectionsSize / baseFileSize << "%)\n";
     
 #ifdef DEBUG_BUILD_DICT
     Agent agent;
@@ -248,18 +598,149 @@ int buildNGram(const char* openccConfigPath, const string& ngramOutputFile) {
     }
 #endif
     
-    writeNGram(maxN, trie, weights, isWordList, ngramOutputFile);
+    const vector<uint8_t> suffixWordMasks = buildSuffixWordMasks(trie, isWordList);
+    vector<NGramKeyRecord> keyRecords;
+    if (shouldPackKeyRecords) {
+        keyRecords = buildKeyRecords(weightCodes, isWordList, isOffensiveList, numOfCodePointsList, suffixWordMasks);
+        log << "Packed " << keyRecords.size() << " key records, " << keyRecords.size() * sizeof(NGramKeyRecord) << " bytes.\n";
+    }
     
-    delete[] weights;
+    LexRangeSections lexRangeSections;
+    if (shouldBuildLexRanges) {
+        lexRangeSections = buildLexRangeSections(trie, weightCodes);
+        size_t lexRangeSectionsSize = lexRangeSections.ranges.size() * sizeof(NGramLexRange) +
+            lexRangeSections.keyIds.size() * sizeof(uint32_t) + lexRangeSections.weightCodes.size() * sizeof(WeightCode);
+        log << "Lexicographic range sections: " << lexRangeSectionsSize << " bytes (+"
+                  << 100.0 * lexRangeSectionsSize / baseFileSize << "%)\n";
+    }
+    
+    writeNGram(maxN, trie, weightCodes, codebook, isWordList, topKSections, isOffensiveList, suffixWordMasks, keyRecords, lexRangeSections, ngramOutputFile, log);
+    if (cache.isEnabled()) {
+        const string tempPath = cache.tempPath(ngramEntryPath, ngramOutputFile.substr(ngramOutputFile.rfind('/') + 1));
+        copyFile(ngramOutputFile, tempPath);
+        cache.commit(tempPath, ngramEntryPath);
+    }
+    logStage(log, string("NGram of ") + openccConfigPath, cache, false, startTime);
     
     opencc_close(opencc);
     
     return 0;
 }
 
+// In bytes. ru_maxrss is in kilobytes on Linux.
+size_t peakRssInBytes() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return usage.ru_maxrss * 1024;
+#endif
+}
+
+// Usage: NGramBuilder [--packed-records] [--lex-ranges] [--memory-budget-mb N] [--cache-dir DIR | --no-cache]
+//                     [offensive words file]
+//        NGramBuilder --benchmark-utf8
+// --packed-records stores the per-key data as NGramKeyRecord instead of separate sections.
+// --lex-ranges adds the lexRange sections, so completions of keys are selected by scanning a run of weight codes.
+// --memory-budget-mb spills the parsed dict into sorted runs in temp files once it outgrows N MB, then merges them.
+//   The output is the same as without a budget.
+// --cache-dir keeps the converted dicts, the Rime words, the tries and the ngram files in DIR, build-cache by default,
+//   and reuses them while their inputs are unchanged. --no-cache rebuilds everything.
+// --benchmark-utf8 only compares the UTF-8 checks of readDict on ngram.csv.
 int main(int argc, const char * argv[]) {
-    buildNGram("../CantoboardFramework/Data/Rime/opencc/t2hk.json", "../CantoboardFramework/Data/InstallToCache/NGram/zh_HK.ngram");
-    buildNGram("../CantoboardFramework/Data/Rime/opencc/t2s.json", "../CantoboardFramework/Data/InstallToCache/NGram/zh_CN.ngram");
+    bool shouldPackKeyRecords = false;
+    bool shouldBuildLexRanges = false;
+    size_t memoryBudgetInBytes = 0;
+    string cacheDirectory = defaultBuildCacheDirectory;
+    string offensiveWordsPath = defaultOffensiveWordsPath;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--packed-records") == 0) shouldPackKeyRecords = true;
+        else if (strcmp(argv[i], "--lex-ranges") == 0) shouldBuildLexRanges = true;
+        else if (strcmp(argv[i], "--memory-budget-mb") == 0 && i + 1 < argc) memoryBudgetInBytes = max(1l, atol(argv[++i])) << 20;
+        else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) cacheDirectory = argv[++i];
+        else if (strcmp(argv[i], "--no-cache") == 0) cacheDirectory.clear();
+        else if (strcmp(argv[i], "--benchmark-utf8") == 0) return benchmarkUtf8Classification();
+        else offensiveWordsPath = argv[i];
+    }
+    
+    const BuildCache cache(cacheDirectory);
+    const size_t numOfVariants = sizeof(variants) / sizeof(*variants);
+    const vector<string> words = readWordEntries(cache);
+    
+    // Only parse ngram.csv for the variants whose converted dict is not cached.
+    auto startTime = chrono::steady_clock::now();
+    vector<DictRuns> dicts(numOfVariants);
+    vector<string> dictEntryPaths(numOfVariants);
+    vector<uint64_t> dictHashes(numOfVariants);
+    vector<const char*> missedOpenccConfigPaths;
+    vector<size_t> missedVariantIndices;
+    const uint64_t csvHash = cache.isEnabled() ? ContentHash().addFile("ngram.csv").value() : 0;
+    for (size_t variantIndex = 0; variantIndex < numOfVariants; ++variantIndex) {
+        const char* openccConfigPath = variants[variantIndex].openccConfigPath;
+        if (cache.isEnabled()) {
+            dictHashes[variantIndex] = ContentHash().add(buildCacheVersion).add(csvHash).add(hashOpenccConfig(openccConfigPath)).value();
+            dictEntryPaths[variantIndex] = cache.entryPath("dict", dictHashes[variantIndex], ".run");
+            if (cache.hasEntry(dictEntryPaths[variantIndex])) {
+                dicts[variantIndex].addSavedRun(dictEntryPaths[variantIndex]);
+                logStage(cout, string("Dict of ") + openccConfigPath, cache, true, startTime);
+                startTime = chrono::steady_clock::now();
+                continue;
+            }
+        }
+        missedOpenccConfigPaths.push_back(openccConfigPath);
+        missedVariantIndices.push_back(variantIndex);
+    }
+    if (!missedOpenccConfigPaths.empty()) {
+        vector<DictRuns> missedDicts = readDict(missedOpenccConfigPaths, memoryBudgetInBytes);
+        for (size_t missIndex = 0; missIndex < missedDicts.size(); ++missIndex) {
+            const size_t variantIndex = missedVariantIndices[missIndex];
+            if (cache.isEnabled()) {
+                const string tempPath = cache.tempPath(dictEntryPaths[variantIndex], "builder");
+                missedDicts[missIndex].saveMerged(tempPath);
+                cache.commit(tempPath, dictEntryPaths[variantIndex]);
+                dicts[variantIndex].addSavedRun(dictEntryPaths[variantIndex]);
+            } else {
+                dicts[variantIndex].takeRuns(missedDicts[missIndex]);
+            }
+        }
+        // The variants were parsed together, each is logged with the time of the whole parse.
+        for (const char* openccConfigPath : missedOpenccConfigPaths) {
+            logStage(cout, string("Dict of ") + openccConfigPath, cache, false, startTime);
+        }
+    }
+    
+    // Besides its dict, the ngram file of a variant depends on the words, the offensive words and the layout flags.
+    ContentHash ngramInputsHash;
+    if (cache.isEnabled()) {
+        ngramInputsHash.add(buildCacheVersion).add((uint64_t)shouldPackKeyRecords).add((uint64_t)shouldBuildLexRanges).add(topKMaxPrefixLength).add(topKSize);
+        for (const string& word : words) ngramInputsHash.add(word);
+        for (const char* offensiveWord : builtInOffensiveWords) ngramInputsHash.add(string(offensiveWord));
+        ngramInputsHash.addFile(offensiveWordsPath);
+    }
+    
+    // The variants share nothing but the input, build their tries in parallel.
+    vector<ostringstream> logs(numOfVariants);
+    vector<exception_ptr> errors(numOfVariants);
+    vector<thread> threads;
+    for (size_t variantIndex = 0; variantIndex < numOfVariants; ++variantIndex) {
+        threads.emplace_back([&, variantIndex] {
+            try {
+                const uint64_t inputsHash = ContentHash(ngramInputsHash).add(dictHashes[variantIndex]).value();
+                buildNGram(variants[variantIndex].openccConfigPath, dicts[variantIndex], words, offensiveWordsPath,
+                           shouldPackKeyRecords, shouldBuildLexRanges, cache, inputsHash, variants[variantIndex].outputPath, logs[variantIndex]);
+            } catch (...) {
+                errors[variantIndex] = current_exception();
+            }
+        });
+    }
+    for (thread& t : threads) t.join();
+    
+    for (size_t variantIndex = 0; variantIndex < numOfVariants; ++variantIndex) {
+        cout << logs[variantIndex].str();
+        if (errors[variantIndex] != nullptr) rethrow_exception(errors[variantIndex]);
+    }
+    cout << "Peak RSS: " << peakRssInBytes() / (1 << 20) << " MB\n";
 
     return 0;
 }
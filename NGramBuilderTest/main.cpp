@@ -0,0 +1,258 @@
+//
+//  main.cpp
+//  NGramBuilderTest
+//
+//  Unit tests of the NGramBuilder parts that do not need OpenCC: merging dict runs, the build cache, the offensive
+//  word matcher and the UTF-8 validation of readDict.
+//  Usage: NGramBuilderTest [directory to write temp files to]
+//
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "AhoCorasick.hpp"
+#include "BuildCache.hpp"
+#include "DictRuns.hpp"
+#include "Utf8.h"
+
+using namespace std;
+
+size_t numOfFailures = 0;
+
+void fail(const string& message) {
+    cerr << "FAIL: " << message << endl;
+    numOfFailures++;
+}
+
+string describe(const vector<DictRuns::Entry>& entries) {
+    string description;
+    for (const DictRuns::Entry& entry : entries) {
+        description += (description.empty() ? "" : " ") + entry.first + "=" + to_string(entry.second.prob) + "/" + to_string(entry.second.numOfCodePoints);
+    }
+    return description;
+}
+
+vector<DictRuns::Entry> mergeAll(DictRuns& dictRuns) {
+    vector<DictRuns::Entry> entries;
+    dictRuns.merge([&](const string& key, const DictValue& value) { entries.push_back({ key, value }); });
+    return entries;
+}
+
+void checkSameEntries(const string& name, const vector<DictRuns::Entry>& entries, const vector<DictRuns::Entry>& expectedEntries) {
+    bool isSame = entries.size() == expectedEntries.size();
+    for (size_t i = 0; isSame && i < entries.size(); ++i) {
+        isSame = entries[i].first == expectedEntries[i].first && entries[i].second.prob == expectedEntries[i].second.prob &&
+            entries[i].second.numOfCodePoints == expectedEntries[i].second.numOfCodePoints;
+    }
+    if (!isSame) fail(name + " returned " + describe(entries) + ", expected " + describe(expectedEntries));
+}
+
+// Runs in memory, spilled, taken from another DictRuns and saved to the cache all merge into one entry per key,
+// in byte order, with the max prob.
+void checkDictRunsMerge(const string& outputDirectory) {
+    auto addRuns = [](DictRuns& dictRuns) {
+        Dict dict = { { "b", { 0.5f, 1 } }, { "a", { 0.1f, 1 } }, { "ab", { 0.2f, 2 } } };
+        dictRuns.addRun(dict, false);
+        if (!dict.empty()) fail("addRun did not clear the dict.");
+        dict = { { "a", { 0.3f, 1 } }, { "c", { 0.2f, 1 } } };
+        dictRuns.addRun(dict, true);
+        DictRuns otherDictRuns;
+        dict = { { "b", { 0.4f, 1 } }, { "仆", { 0.6f, 1 } } };
+        otherDictRuns.addRun(dict, true);
+        dictRuns.takeRuns(otherDictRuns);
+        if (otherDictRuns.numOfRuns() != 0) fail("takeRuns left runs behind.");
+    };
+    const vector<DictRuns::Entry> expectedEntries = {
+        { "a", { 0.3f, 1 } }, { "ab", { 0.2f, 2 } }, { "b", { 0.5f, 1 } }, { "c", { 0.2f, 1 } }, { "仆", { 0.6f, 1 } },
+    };
+
+    DictRuns dictRuns;
+    addRuns(dictRuns);
+    if (dictRuns.numOfRuns() != 3) fail("Expected 3 runs, got " + to_string(dictRuns.numOfRuns()));
+    if (dictRuns.spilledSizeInBytes() == 0) fail("Spilled runs were not counted.");
+    checkSameEntries("merge", mergeAll(dictRuns), expectedEntries);
+    if (dictRuns.numOfRuns() != 0) fail("merge did not consume the runs.");
+
+    const string savedRunPath = outputDirectory + "/saved-dict.run";
+    DictRuns savedDictRuns;
+    addRuns(savedDictRuns);
+    savedDictRuns.saveMerged(savedRunPath);
+    DictRuns loadedDictRuns;
+    loadedDictRuns.addSavedRun(savedRunPath);
+    Dict dict = { { "a", { 0.05f, 1 } } };
+    loadedDictRuns.addRun(dict, false);
+    checkSameEntries("merge of a saved run", mergeAll(loadedDictRuns), expectedEntries);
+    remove(savedRunPath.c_str());
+}
+
+bool writeFile(const string& path, const string& contents) {
+    ofstream file(path, ios::binary);
+    file << contents;
+    file.close();
+    if (!file) fail("Could not write " + path);
+    return !!file;
+}
+
+void checkContentHash(const string& outputDirectory) {
+    if (ContentHash().add(string("ab")).add(string("c")).value() == ContentHash().add(string("a")).add(string("bc")).value()) {
+        fail("Consecutive strings hashed the same when split differently.");
+    }
+
+    const string path = outputDirectory + "/hashed-input.txt";
+    remove(path.c_str());
+    const uint64_t absentHash = ContentHash().addFile(path).value();
+    if (!writeFile(path, "")) return;
+    const uint64_t emptyHash = ContentHash().addFile(path).value();
+    if (!writeFile(path, "ngram")) return;
+    const uint64_t contentHash = ContentHash().addFile(path).value();
+    if (absentHash == emptyHash) fail("A missing file hashed like an empty one.");
+    if (emptyHash == contentHash) fail("Changing the contents of a file did not change its hash.");
+    if (contentHash != ContentHash().addFile(path).value()) fail("Hashing the same file twice gave different hashes.");
+    remove(path.c_str());
+}
+
+// An entry is only hit once committed and only for the hash it was written with.
+void checkBuildCache(const string& outputDirectory) {
+    const BuildCache cache(outputDirectory + "/build-cache-test");
+    const string entryPath = cache.entryPath("stage", 0x1234, ".bin");
+    const string otherEntryPath = cache.entryPath("stage", 0x1235, ".bin");
+    remove(entryPath.c_str());
+    if (cache.hasEntry(entryPath)) fail("Hit an entry that was never written.");
+
+    const string tempPath = cache.tempPath(entryPath, "writer");
+    if (!writeFile(tempPath, "cached")) return;
+    if (cache.hasEntry(entryPath)) fail("Hit an entry before it was committed.");
+    cache.commit(tempPath, entryPath);
+    if (!cache.hasEntry(entryPath)) fail("Missed a committed entry.");
+    if (cache.hasEntry(otherEntryPath)) fail("Hit the entry of another hash.");
+
+    const BuildCache disabledCache("");
+    if (disabledCache.isEnabled() || disabledCache.hasEntry(entryPath)) fail("A disabled cache hit an entry.");
+    remove(entryPath.c_str());
+}
+
+void checkMatch(const AhoCorasick& matcher, const string& text, bool shouldMatch) {
+    if (matcher.containsAny(text) != shouldMatch) fail("containsAny(" + text + ") returned " + (shouldMatch ? "false" : "true"));
+}
+
+void checkAhoCorasick() {
+    AhoCorasick emptyMatcher;
+    emptyMatcher.addPattern("");
+    emptyMatcher.build();
+    if (emptyMatcher.size() != 0) fail("An empty pattern was added.");
+    checkMatch(emptyMatcher, "anything", false);
+
+    AhoCorasick matcher;
+    for (const char* pattern : { "he", "she", "his", "hers", "abcd", "bc", "仆街", "𨳒" }) matcher.addPattern(pattern);
+    matcher.build();
+    if (matcher.size() != 8) fail("Expected 8 patterns, got " + to_string(matcher.size()));
+    checkMatch(matcher, "ushers", true);
+    checkMatch(matcher, "xhisx", true);
+    checkMatch(matcher, "hi", false);
+    checkMatch(matcher, "", false);
+    // Only reachable by following the failure link from the abcd branch.
+    checkMatch(matcher, "abce", true);
+    checkMatch(matcher, "abd", false);
+    checkMatch(matcher, "佢係仆街嚟", true);
+    checkMatch(matcher, "仆人街市", false);
+    checkMatch(matcher, "𨳒你", true);
+    // Shares the first 3 bytes with 𨳒.
+    checkMatch(matcher, "𨳊", false);
+}
+
+string encodeCodePoint(uint32_t codePoint) {
+    string text;
+    if (codePoint < 0x80) {
+        text += (char)codePoint;
+    } else if (codePoint < 0x800) {
+        text += (char)(0xC0 | (codePoint >> 6));
+        text += (char)(0x80 | (codePoint & 0x3F));
+    } else if (codePoint < 0x10000) {
+        text += (char)(0xE0 | (codePoint >> 12));
+        text += (char)(0x80 | ((codePoint >> 6) & 0x3F));
+        text += (char)(0x80 | (codePoint & 0x3F));
+    } else {
+        text += (char)(0xF0 | (codePoint >> 18));
+        text += (char)(0x80 | ((codePoint >> 12) & 0x3F));
+        text += (char)(0x80 | ((codePoint >> 6) & 0x3F));
+        text += (char)(0x80 | (codePoint & 0x3F));
+    }
+    return text;
+}
+
+string toHex(const string& text) {
+    string hex;
+    char byteInHex[4];
+    for (unsigned char c : text) {
+        snprintf(byteInHex, sizeof(byteInHex), "%02X ", c);
+        hex += byteInHex;
+    }
+    return hex;
+}
+
+// Valid text classifies like walking it with decodeCodePoint and isCjkCodePoint. Any invalid sequence in it makes it
+// invalid, wherever it is.
+void checkClassifyUtf8Text() {
+    // Around the edges of the CJK ranges, with 1 to 4 bytes per code point. Only 0x3000 and up take the 3-byte fast path.
+    const uint32_t codePoints[] = {
+        0x00, 'a', 0x7F, 0x80, 0x7FF, 0x800, 0x3000, 0x33FF, 0x3400, 0x4DBF, 0x4DC0, 0x4E00, 0x4F60, 0x9FFF, 0xA000,
+        0xD7FF, 0xE000, 0xFFFF, 0x10000, 0x1F600, 0x1FFFF, 0x20000, 0x28CD2, 0x2A6DF, 0x2A6E0, 0x10FFFF,
+    };
+    const char* invalidSequences[] = {
+        "\x80", "\xBF", // Continuation bytes without a lead byte.
+        "\xC0\x80", "\xC1\xBF", "\xE0\x80\x80", "\xE0\x9F\xBF", "\xF0\x80\x80\x80", "\xF0\x8F\xBF\xBF", // Overlong.
+        "\xED\xA0\x80", "\xED\xBF\xBF", // Surrogates.
+        "\xF4\x90\x80\x80", "\xF5\x80\x80\x80", "\xFF", // Above U+10FFFF.
+        "\xE4\xBD", "\xE4\xBD" "a", "\xE4" "a" "\xA0", "\xF0\xA8\xB3", "\xC2", // Truncated.
+    };
+
+    mt19937 random(23);
+    for (size_t i = 0; i < 2000; ++i) {
+        string text;
+        const size_t numOfCodePoints = random() % 6;
+        for (size_t j = 0; j < numOfCodePoints; ++j) {
+            // Mostly CJK, so that some texts are all CJK.
+            const uint32_t codePoint = random() % 3 != 0 ? 0x4E00 + random() % 0x5200 : codePoints[random() % size(codePoints)];
+            text += encodeCodePoint(codePoint);
+        }
+
+        bool isAllCjk = true;
+        for (size_t index = 0; index < text.length(); index = nextCodePointIndex(text, index)) {
+            isAllCjk &= isCjkCodePoint(decodeCodePoint(text, index));
+        }
+        const Utf8TextKind expectedKind = isAllCjk ? Utf8TextKind::cjk : Utf8TextKind::notCjk;
+        size_t count = SIZE_MAX;
+        if (classifyUtf8Text(text, count) != expectedKind || count != countCodePoints(text)) {
+            fail("classifyUtf8Text(" + toHex(text) + ") disagreed with decodeCodePoint and isCjkCodePoint.");
+        }
+
+        // At a code point boundary, so the sequence cannot complete the code point before it.
+        size_t insertIndex = 0;
+        for (size_t j = random() % (numOfCodePoints + 1); j > 0; --j) insertIndex = nextCodePointIndex(text, insertIndex);
+        const string invalidText = text.substr(0, insertIndex) + invalidSequences[random() % size(invalidSequences)] + text.substr(insertIndex);
+        if (classifyUtf8Text(invalidText, count) != Utf8TextKind::invalid) {
+            fail("classifyUtf8Text(" + toHex(invalidText) + ") accepted invalid UTF-8.");
+        }
+    }
+}
+
+int main(int argc, const char * argv[]) {
+    const string outputDirectory = argc > 1 ? argv[1] : ".";
+
+    checkDictRunsMerge(outputDirectory);
+    checkContentHash(outputDirectory);
+    checkBuildCache(outputDirectory);
+    checkAhoCorasick();
+    checkClassifyUtf8Text();
+
+    if (numOfFailures > 0) {
+        cerr << numOfFailures << " checks failed." << endl;
+        return 1;
+    }
+    cout << "All checks passed.\n";
+    return 0;
+}
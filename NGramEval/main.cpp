@@ -0,0 +1,128 @@
+//
+//  main.cpp
+//  NGramEval
+//
+//  Replays held-out text and reports how many keystrokes the predictions would save with each scoring mode.
+//  Usage: NGramEval <held-out text file> [ngram file] [number of candidates shown]
+//
+//  At each position, if a shown candidate matches the upcoming text, the longest matching candidate is selected
+//  with 1 keystroke. Otherwise the next char is typed, which also counts as 1 keystroke. Keystroke savings is
+//  1 - keystrokes / chars. The context is reset at the start of each line.
+//
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "NGramModel.h"
+#include "Utf8.h"
+
+using namespace std;
+
+#ifndef DEFAULT_NGRAM_PATH
+#define DEFAULT_NGRAM_PATH "CantoboardFramework/Data/InstallToCache/NGram/zh_HK.ngram"
+#endif
+
+struct EvalResult {
+    size_t numOfChars = 0;
+    size_t numOfKeystrokes = 0;
+    size_t numOfPredictions = 0;
+    // Number of predictions whose first candidate matches the upcoming text.
+    size_t numOfTop1Hits = 0;
+    // Number of predictions with any shown candidate matching the upcoming text.
+    size_t numOfTopNHits = 0;
+    double totalPredictUs = 0;
+};
+
+static EvalResult evaluate(const NGramModel& model, const vector<string>& lines, size_t numOfCandidatesShown) {
+    EvalResult result;
+    for (const string& line : lines) {
+        const string_view text(line);
+        result.numOfChars += countCodePoints(text);
+
+        size_t index = 0;
+        while (index < text.length()) {
+            result.numOfKeystrokes++;
+            if (index == 0) {
+                // Nothing to predict from.
+                index = nextCodePointIndex(text, index);
+                continue;
+            }
+
+            auto start = chrono::steady_clock::now();
+            const vector<string> candidates = model.predict(text.substr(0, index), true);
+            result.totalPredictUs += chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+            result.numOfPredictions++;
+
+            const string_view upcomingText = text.substr(index);
+            size_t longestMatchLength = 0;
+            for (size_t i = 0; i < candidates.size() && i < numOfCandidatesShown; ++i) {
+                const string& candidate = candidates[i];
+                if (upcomingText.compare(0, candidate.length(), candidate) != 0) continue;
+                if (i == 0) result.numOfTop1Hits++;
+                longestMatchLength = max(longestMatchLength, candidate.length());
+            }
+
+            if (longestMatchLength > 0) {
+                result.numOfTopNHits++;
+                index += longestMatchLength;
+            } else {
+                index = nextCodePointIndex(text, index);
+            }
+        }
+    }
+    return result;
+}
+
+int main(int argc, const char * argv[]) {
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " <held-out text file> [ngram file] [number of candidates shown]" << endl;
+        return 1;
+    }
+    const string heldOutTextPath = argv[1];
+    const string ngramFilePath = argc > 2 ? argv[2] : DEFAULT_NGRAM_PATH;
+    const size_t numOfCandidatesShown = argc > 3 ? atoi(argv[3]) : 5;
+
+    ifstream heldOutTextFile(heldOutTextPath);
+    if (!heldOutTextFile.is_open()) {
+        cerr << "Could not open " << heldOutTextPath << endl;
+        return 1;
+    }
+    vector<string> lines;
+    string line;
+    while (getline(heldOutTextFile, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!line.empty()) lines.push_back(move(line));
+    }
+
+    NGramModel model;
+    string error;
+    if (!model.open(ngramFilePath, error)) {
+        cerr << error << endl;
+        return 1;
+    }
+    cout << "Evaluating " << ngramFilePath << " on " << lines.size() << " lines of " << heldOutTextPath
+         << ", " << numOfCandidatesShown << " candidates shown.\n";
+
+    cout << left << setw(24) << "scoring" << right << setw(12) << "savings %" << setw(12) << "top-1 %"
+         << setw(12) << "top-N %" << setw(12) << "avg us" << "\n";
+    const pair<ScoringMode, const char*> scoringModes[] = {
+        { ScoringMode::longestSuffixFirst, "longest suffix first" },
+        { ScoringMode::stupidBackoff, "stupid backoff" },
+    };
+    for (const auto& [scoringMode, name] : scoringModes) {
+        model.setScoringMode(scoringMode);
+        const EvalResult result = evaluate(model, lines, numOfCandidatesShown);
+        const double numOfPredictions = max<size_t>(1, result.numOfPredictions);
+        cout << left << setw(24) << name << right << fixed << setprecision(2)
+             << setw(12) << 100.0 * (1.0 - (double)result.numOfKeystrokes / max<size_t>(1, result.numOfChars))
+             << setw(12) << 100.0 * result.numOfTop1Hits / numOfPredictions
+             << setw(12) << 100.0 * result.numOfTopNHits / numOfPredictions
+             << setw(12) << result.totalPredictUs / numOfPredictions << "\n";
+    }
+    return 0;
+}
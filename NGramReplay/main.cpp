@@ -0,0 +1,248 @@
+//
+//  main.cpp
+//  NGramReplay
+//
+//  Replays every prefix of a held-out corpus through NGramModel::predict and reports latency percentiles,
+//  heap allocations per query and how often the upcoming text is among the top candidates.
+//  Usage: NGramReplay [--json] [--session] [--backoff] [--every <n>] [--limit <n>] <corpus file> [ngram file]
+//
+//  Each corpus line is a sentence. Anything after a tab is ignored, so Rime essay.txt (text<TAB>weight) can be
+//  replayed as is. --every n keeps every n-th line only, --limit n stops after n lines.
+//  --json prints a single JSON object with stable keys, so two runs (old vs new ngram file or code) can be diffed.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "NGramModel.h"
+#include "NGramSession.h"
+#include "Utf8.h"
+
+using namespace std;
+
+#ifndef DEFAULT_NGRAM_PATH
+#define DEFAULT_NGRAM_PATH "CantoboardFramework/Data/InstallToCache/NGram/zh_HK.ngram"
+#endif
+
+// Counts every heap allocation of the process. Only the ones between two reads around a query are attributed to it.
+static atomic<uint64_t> numOfAllocations(0);
+
+void* operator new(size_t size) {
+    numOfAllocations.fetch_add(1, memory_order_relaxed);
+    if (void* ptr = malloc(size > 0 ? size : 1)) return ptr;
+    throw bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+struct ReplayOptions {
+    string corpusPath;
+    string ngramFilePath = DEFAULT_NGRAM_PATH;
+    bool shouldOutputJson = false;
+    bool shouldUseSession = false;
+    bool shouldUseBackoff = false;
+    size_t every = 1;
+    size_t limit = 0;
+};
+
+struct ReplayResult {
+    vector<double> latenciesUs;
+    uint64_t numOfAllocations = 0;
+    uint64_t numOfVisitedKeys = 0;
+    uint64_t numOfSearches = 0;
+    size_t numOfQueriesWithoutResults = 0;
+    size_t numOfTop1Hits = 0;
+    size_t numOfTop5Hits = 0;
+};
+
+static bool parseOptions(int argc, const char * argv[], ReplayOptions& options) {
+    vector<string> positionalArgs;
+    for (int i = 1; i < argc; ++i) {
+        const string arg = argv[i];
+        if (arg == "--json") {
+            options.shouldOutputJson = true;
+        } else if (arg == "--session") {
+            options.shouldUseSession = true;
+        } else if (arg == "--backoff") {
+            options.shouldUseBackoff = true;
+        } else if ((arg == "--every" || arg == "--limit") && i + 1 < argc) {
+            const size_t value = strtoul(argv[++i], nullptr, 10);
+            if (arg == "--every") options.every = max<size_t>(1, value);
+            else options.limit = value;
+        } else if (arg.rfind("--", 0) == 0) {
+            return false;
+        } else {
+            positionalArgs.push_back(arg);
+        }
+    }
+    if (positionalArgs.empty() || positionalArgs.size() > 2) return false;
+    options.corpusPath = positionalArgs[0];
+    if (positionalArgs.size() > 1) options.ngramFilePath = positionalArgs[1];
+    return true;
+}
+
+static bool readCorpus(const ReplayOptions& options, vector<string>& lines) {
+    ifstream corpusFile(options.corpusPath);
+    if (!corpusFile.is_open()) return false;
+    string line;
+    for (size_t lineIndex = 0; getline(corpusFile, line); ++lineIndex) {
+        if (lineIndex % options.every != 0) continue;
+        const size_t tabIndex = line.find('\t');
+        if (tabIndex != string::npos) line.resize(tabIndex);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        // Nothing to predict in single char lines.
+        if (countCodePoints(line) < 2) continue;
+        lines.push_back(move(line));
+        if (options.limit > 0 && lines.size() >= options.limit) break;
+    }
+    return true;
+}
+
+static void replay(const NGramModel& model, const vector<string>& lines, bool shouldUseSession, ReplayResult& result) {
+    vector<string> candidates;
+    for (const string& line : lines) {
+        const string_view text(line);
+        NGramSession session(model);
+        for (size_t index = nextCodePointIndex(text, 0); index < text.length(); index = nextCodePointIndex(text, index)) {
+            const string_view context = text.substr(0, index);
+            PredictStats stats;
+
+            const uint64_t numOfAllocationsBefore = numOfAllocations.load(memory_order_relaxed);
+            const auto start = chrono::steady_clock::now();
+            if (shouldUseSession) {
+                session.update(context);
+                candidates = session.predict(true, &stats);
+            } else {
+                candidates = model.predict(context, true, &stats);
+            }
+            const auto end = chrono::steady_clock::now();
+            result.numOfAllocations += numOfAllocations.load(memory_order_relaxed) - numOfAllocationsBefore;
+            result.latenciesUs.push_back(chrono::duration<double, micro>(end - start).count());
+            result.numOfVisitedKeys += stats.numOfVisitedKeys;
+            result.numOfSearches += stats.numOfSearches;
+
+            if (candidates.empty()) result.numOfQueriesWithoutResults++;
+            const string_view upcomingText = text.substr(index);
+            for (size_t i = 0; i < candidates.size() && i < 5; ++i) {
+                if (upcomingText.compare(0, candidates[i].length(), candidates[i]) != 0) continue;
+                if (i == 0) result.numOfTop1Hits++;
+                result.numOfTop5Hits++;
+                break;
+            }
+        }
+    }
+}
+
+static double percentile(const vector<double>& sortedSamples, double p) {
+    if (sortedSamples.empty()) return 0;
+    const size_t index = min(sortedSamples.size() - 1, (size_t)(p * sortedSamples.size()));
+    return sortedSamples[index];
+}
+
+static string escapeJson(const string& text) {
+    string escaped;
+    for (const char c : text) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+int main(int argc, const char * argv[]) {
+    ReplayOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        cerr << "Usage: " << argv[0] << " [--json] [--session] [--backoff] [--every <n>] [--limit <n>] <corpus file> [ngram file]" << endl;
+        return 1;
+    }
+
+    vector<string> lines;
+    if (!readCorpus(options, lines)) {
+        cerr << "Could not open " << options.corpusPath << endl;
+        return 1;
+    }
+
+    NGramModel model;
+    string error;
+    if (!model.open(options.ngramFilePath, error)) {
+        cerr << error << endl;
+        return 1;
+    }
+    model.setScoringMode(options.shouldUseBackoff ? ScoringMode::stupidBackoff : ScoringMode::longestSuffixFirst);
+
+    ReplayResult result;
+    const auto start = chrono::steady_clock::now();
+    replay(model, lines, options.shouldUseSession, result);
+    const double elapsedSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    vector<double>& latenciesUs = result.latenciesUs;
+    const size_t numOfQueries = latenciesUs.size();
+    const double queries = max<size_t>(1, numOfQueries);
+    double totalUs = 0;
+    for (const double latencyUs : latenciesUs) totalUs += latencyUs;
+    sort(latenciesUs.begin(), latenciesUs.end());
+
+    if (options.shouldOutputJson) {
+        cout << fixed << setprecision(3)
+             << "{\"ngramFile\":\"" << escapeJson(options.ngramFilePath) << "\""
+             << ",\"corpus\":\"" << escapeJson(options.corpusPath) << "\""
+             << ",\"scoring\":\"" << (options.shouldUseBackoff ? "stupidBackoff" : "longestSuffixFirst") << "\""
+             << ",\"session\":" << (options.shouldUseSession ? "true" : "false")
+             << ",\"lines\":" << lines.size()
+             << ",\"queries\":" << numOfQueries
+             << ",\"queriesPerSecond\":" << numOfQueries / max(elapsedSeconds, 1e-9)
+             << ",\"meanUs\":" << totalUs / queries
+             << ",\"p50Us\":" << percentile(latenciesUs, 0.5)
+             << ",\"p95Us\":" << percentile(latenciesUs, 0.95)
+             << ",\"p99Us\":" << percentile(latenciesUs, 0.99)
+             << ",\"maxUs\":" << (latenciesUs.empty() ? 0 : latenciesUs.back())
+             << ",\"allocationsPerQuery\":" << result.numOfAllocations / queries
+             << ",\"visitedKeysPerQuery\":" << result.numOfVisitedKeys / queries
+             << ",\"searchesPerQuery\":" << result.numOfSearches / queries
+             << ",\"noResultRate\":" << result.numOfQueriesWithoutResults / queries
+             << ",\"top1HitRate\":" << result.numOfTop1Hits / queries
+             << ",\"top5HitRate\":" << result.numOfTop5Hits / queries
+             << "}" << endl;
+    } else {
+        cout << "Replayed " << lines.size() << " lines of " << options.corpusPath << " through " << options.ngramFilePath
+             << (options.shouldUseBackoff ? ", stupid backoff" : "") << (options.shouldUseSession ? ", with session" : "") << ".\n"
+             << fixed << setprecision(1)
+             << "Queries: " << numOfQueries << ", " << numOfQueries / max(elapsedSeconds, 1e-9) << " per second\n"
+             << "Latency: mean " << totalUs / queries << " us, p50 " << percentile(latenciesUs, 0.5)
+             << " us, p95 " << percentile(latenciesUs, 0.95) << " us, p99 " << percentile(latenciesUs, 0.99)
+             << " us, max " << (latenciesUs.empty() ? 0 : latenciesUs.back()) << " us\n"
+             << setprecision(2)
+             << "Per query: " << result.numOfAllocations / queries << " allocations, "
+             << result.numOfVisitedKeys / queries << " visited keys, " << result.numOfSearches / queries << " searches\n"
+             << "Top-1 hit: " << 100.0 * result.numOfTop1Hits / queries << "%, top-5 hit: "
+             << 100.0 * result.numOfTop5Hits / queries << "%, no result: "
+             << 100.0 * result.numOfQueriesWithoutResults / queries << "%\n";
+    }
+    return 0;
+}
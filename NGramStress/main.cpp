@@ -0,0 +1,159 @@
+//
+//  main.cpp
+//  NGramStress
+//
+//  Hammers a shared NGramModel from several threads. Every result is compared with the single threaded result
+//  of the same query, and the throughput of each thread count is compared with a single thread.
+//  Usage: NGramStress [ngram file] [max number of threads] [seconds per run] [corpus file]
+//
+//  Contexts are a built-in list plus, if a corpus is given, every prefix of its first lines. Each thread replays
+//  them with NGramModel::predict, its own NGramSession and, for some contexts, predictPhrases.
+//  Exits with 1 if any result differs.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "NGramModel.h"
+#include "NGramSession.h"
+#include "Utf8.h"
+
+using namespace std;
+
+#ifndef DEFAULT_NGRAM_PATH
+#define DEFAULT_NGRAM_PATH "CantoboardFramework/Data/InstallToCache/NGram/zh_HK.ngram"
+#endif
+
+static const char* builtInContexts[] = {
+    "一", "我", "你", "好", "食", "今日", "香港", "唔該", "我哋今日去", "食咗飯未", "我哋今日去咗海洋公園玩",
+};
+
+static const size_t kMaxNumOfCorpusLines = 200;
+// predictPhrases runs several searches per call, only check it on every few contexts.
+static const size_t kPhraseCheckInterval = 8;
+
+struct Query {
+    string context;
+    vector<string> expectedResults;
+    bool shouldCheckPhrases;
+    vector<string> expectedPhrases;
+};
+
+struct RunResult {
+    size_t numOfQueries = 0;
+    size_t numOfMismatches = 0;
+};
+
+static vector<string> readContexts(const char* corpusPath) {
+    vector<string> contexts(begin(builtInContexts), end(builtInContexts));
+    if (corpusPath == nullptr) return contexts;
+
+    ifstream corpusFile(corpusPath);
+    if (!corpusFile.is_open()) {
+        cerr << "Could not open " << corpusPath << ", using the built-in contexts only." << endl;
+        return contexts;
+    }
+    string line;
+    for (size_t numOfLines = 0; numOfLines < kMaxNumOfCorpusLines && getline(corpusFile, line); ++numOfLines) {
+        const size_t tabIndex = line.find('\t');
+        if (tabIndex != string::npos) line.resize(tabIndex);
+        const string_view text(line);
+        for (size_t index = nextCodePointIndex(text, 0); index <= text.length(); index = nextCodePointIndex(text, index)) {
+            contexts.emplace_back(text.substr(0, index));
+            if (index == text.length()) break;
+        }
+    }
+    return contexts;
+}
+
+// Threads start evenly spread over the queries, so they rarely search the same keys at the same time.
+static void hammer(const NGramModel& model, const vector<Query>& queries, size_t threadIndex, size_t numOfThreads,
+                   chrono::steady_clock::time_point deadline, RunResult& result) {
+    NGramSession session(model);
+    size_t queryIndex = threadIndex * queries.size() / numOfThreads;
+    while (chrono::steady_clock::now() < deadline) {
+        const Query& query = queries[queryIndex % queries.size()];
+        if (model.predict(query.context, true) != query.expectedResults) result.numOfMismatches++;
+
+        session.update(query.context);
+        if (session.predict(true) != query.expectedResults) result.numOfMismatches++;
+
+        if (query.shouldCheckPhrases && model.predictPhrases(query.context, true) != query.expectedPhrases) {
+            result.numOfMismatches++;
+        }
+        result.numOfQueries++;
+        queryIndex++;
+    }
+}
+
+int main(int argc, const char * argv[]) {
+    const string ngramFilePath = argc > 1 ? argv[1] : DEFAULT_NGRAM_PATH;
+    const size_t maxNumOfThreads = argc > 2 ? max(1, atoi(argv[2])) : max(1u, thread::hardware_concurrency());
+    const double secondsPerRun = argc > 3 ? atof(argv[3]) : 2;
+    const char* corpusPath = argc > 4 ? argv[4] : nullptr;
+
+    NGramModel model;
+    string error;
+    if (!model.open(ngramFilePath, error)) {
+        cerr << error << endl;
+        return 1;
+    }
+
+    vector<Query> queries;
+    for (string& context : readContexts(corpusPath)) {
+        Query query;
+        query.expectedResults = model.predict(context, true);
+        query.shouldCheckPhrases = queries.size() % kPhraseCheckInterval == 0;
+        if (query.shouldCheckPhrases) query.expectedPhrases = model.predictPhrases(context, true);
+        query.context = move(context);
+        queries.push_back(move(query));
+    }
+    cout << "Stressing " << ngramFilePath << " with " << queries.size() << " contexts, up to "
+         << maxNumOfThreads << " threads, " << secondsPerRun << " s per run.\n";
+    cout << right << setw(8) << "threads" << setw(14) << "queries/s" << setw(10) << "speedup"
+         << setw(12) << "mismatches" << "\n";
+
+    vector<size_t> threadCounts;
+    for (size_t numOfThreads = 1; numOfThreads < maxNumOfThreads; numOfThreads *= 2) threadCounts.push_back(numOfThreads);
+    threadCounts.push_back(maxNumOfThreads);
+
+    double singleThreadQueriesPerSecond = 0;
+    size_t totalNumOfMismatches = 0;
+    for (const size_t numOfThreads : threadCounts) {
+        vector<RunResult> results(numOfThreads);
+        vector<thread> threads;
+        const auto start = chrono::steady_clock::now();
+        const auto deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(secondsPerRun));
+        for (size_t i = 0; i < numOfThreads; ++i) {
+            threads.emplace_back(hammer, cref(model), cref(queries), i, numOfThreads, deadline, ref(results[i]));
+        }
+        for (thread& t : threads) t.join();
+        const double elapsedSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        RunResult total;
+        for (const RunResult& result : results) {
+            total.numOfQueries += result.numOfQueries;
+            total.numOfMismatches += result.numOfMismatches;
+        }
+        const double queriesPerSecond = total.numOfQueries / elapsedSeconds;
+        if (numOfThreads == 1) singleThreadQueriesPerSecond = queriesPerSecond;
+        totalNumOfMismatches += total.numOfMismatches;
+        cout << setw(8) << numOfThreads << fixed << setprecision(0) << setw(14) << queriesPerSecond
+             << setprecision(2) << setw(10) << queriesPerSecond / max(singleThreadQueriesPerSecond, 1e-9)
+             << setw(12) << total.numOfMismatches << "\n";
+    }
+
+    if (totalNumOfMismatches > 0) {
+        cerr << totalNumOfMismatches << " results differ from the single threaded results." << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,498 @@
+//
+//  main.cpp
+//  NGramTest
+//
+//  Checks NGramModel predictions on the shipped ngram file, that open rejects corrupt files, and that every optional
+//  section of the ngram format, as NGramBuilder builds it, predicts the same as the code path it replaces.
+//  Usage: NGramTest [ngram file] [directory to write the generated ngram files to]
+//  The ngram file must be version 0 with only the required sections, like the shipped zh_HK.ngram.
+//  The expected predictions are those of zh_HK.ngram.
+//
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "AhoCorasick.hpp"
+#include "NGramModel.h"
+#include "NGramOverlay.h"
+#include "NGramSections.hpp"
+#include "NGramSession.h"
+#include "OffensiveWords.h"
+#include "PredictionCache.h"
+#include "Utf8.h"
+
+using namespace std;
+using namespace marisa;
+
+#ifndef DEFAULT_NGRAM_PATH
+#define DEFAULT_NGRAM_PATH "CantoboardFramework/Data/InstallToCache/NGram/zh_HK.ngram"
+#endif
+
+size_t numOfFailures = 0;
+
+void fail(const string& message) {
+    cerr << "FAIL: " << message << endl;
+    numOfFailures++;
+}
+
+string join(const vector<string>& texts) {
+    string joined;
+    for (const string& text : texts) joined += (joined.empty() ? "" : " ") + text;
+    return joined;
+}
+
+template <typename T>
+string bytesOf(const vector<T>& values) {
+    return string((const char*)values.data(), values.size() * sizeof(T));
+}
+
+typedef array<string, NGramSectionId::numOfSections> Sections;
+
+// Lays out the sections in the order of their ids, like writeNGram. Unlike it, can write version 0 files.
+bool writeNGramFile(const string& path, NGramVersion version, char maxN, size_t numOfEntries, const Sections& sections) {
+    NGramHeader header;
+    header.version = version;
+    header.maxN = maxN;
+    header.numOfEntries = numOfEntries;
+    size_t currentPtr = header.headerSizeInBytes;
+    for (size_t i = 0; i < sections.size(); ++i) {
+        header.sections[i].dataOffset = currentPtr;
+        header.sections[i].dataSizeInBytes = sections[i].size();
+        currentPtr += sections[i].size();
+    }
+    ofstream file(path, ios::binary);
+    file.write((const char*)&header, header.headerSizeInBytes);
+    for (const string& section : sections) file.write(section.data(), section.size());
+    file.close();
+    if (!file) {
+        fail("Could not write " + path);
+        return false;
+    }
+    return true;
+}
+
+// The data of the shipped file and everything the optional sections are derived from.
+struct SourceData {
+    string fileData;
+    const NGramHeader* header;
+    Trie trie;
+    vector<string> keys;
+    vector<Fp16Weight> fp16Weights;
+    vector<float> weights;
+    vector<uint8_t> numOfCodePointsList;
+    KeyBitset isWordList;
+    // Flagged like NGramBuilder does with an empty offensive-words.txt.
+    KeyBitset isOffensiveList;
+
+    string section(NGramSectionId sectionId) const {
+        return fileData.substr(header->sections[sectionId].dataOffset, header->sections[sectionId].dataSizeInBytes);
+    }
+};
+
+bool loadSourceData(const string& ngramFilePath, SourceData& source) {
+    ifstream file(ngramFilePath, ios::binary);
+    source.fileData.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    if (source.fileData.size() < sizeof(NGramHeader) - sizeof(NGramHeader::sections)) {
+        fail("Could not read " + ngramFilePath);
+        return false;
+    }
+    source.header = (const NGramHeader*)source.fileData.data();
+    if (source.header->version != NGramVersion::fp16Weights || hasSection(source.header, NGramSectionId::topKIndex)) {
+        fail(ngramFilePath + " must be a version 0 file without optional sections.");
+        return false;
+    }
+
+    const NGramSectionHeader& trieSectionHeader = source.header->sections[NGramSectionId::trie];
+    source.trie.map(source.fileData.data() + trieSectionHeader.dataOffset, trieSectionHeader.dataSizeInBytes);
+    const size_t numOfEntries = source.header->numOfEntries;
+    const char* weightData = source.fileData.data() + source.header->sections[NGramSectionId::weight].dataOffset;
+    const char* isWordData = source.fileData.data() + source.header->sections[NGramSectionId::isWord].dataOffset;
+    AhoCorasick offensiveWords;
+    for (const char* offensiveWord : builtInOffensiveWords) offensiveWords.addPattern(offensiveWord);
+    offensiveWords.build();
+    source.isWordList.resize(numOfEntries);
+    source.isOffensiveList.resize(numOfEntries);
+    Agent reverseLookupAgent;
+    for (size_t id = 0; id < numOfEntries; ++id) {
+        reverseLookupAgent.set_query(id);
+        source.trie.reverse_lookup(reverseLookupAgent);
+        const string key(reverseLookupAgent.key().ptr(), reverseLookupAgent.key().length());
+        Fp16Weight bits;
+        memcpy(&bits, weightData + id * sizeof(Fp16Weight), sizeof(bits));
+        source.fp16Weights.push_back(bits);
+        source.weights.push_back(decodeFp16Weight(bits));
+        source.numOfCodePointsList.push_back((uint8_t)min<size_t>(UINT8_MAX, countCodePoints(key)));
+        source.isWordList[id] = (isWordData[id / 8] >> (id % 8)) & 1;
+        source.isOffensiveList[id] = offensiveWords.containsAny(key);
+        source.keys.push_back(key);
+    }
+    return true;
+}
+
+struct QuantizedWeights {
+    WeightCodebook codebook;
+    vector<WeightCode> codes;
+    // What NGramBuilder ranks with once the weights are quantized.
+    vector<float> decodedWeights;
+    // The largest fp16 weight of each key's code, so a version 0 file with them ranks every key the same as the
+    // quantized file. Encoding keeps the order of the weights, so these are ordered like the codes.
+    vector<Fp16Weight> codeFp16Weights;
+};
+
+// Quantizes the weights like NGramBuilder buildNGram.
+QuantizedWeights quantize(const SourceData& source) {
+    QuantizedWeights quantized;
+    quantized.codebook.fit(source.weights);
+    vector<Fp16Weight> maxFp16WeightOfCodes(kNumOfWeightCodes, 0);
+    for (size_t id = 0; id < source.weights.size(); ++id) {
+        const WeightCode code = quantized.codebook.encode(source.weights[id]);
+        quantized.codes.push_back(code);
+        quantized.decodedWeights.push_back(quantized.codebook.decode(code));
+        // Positive fp16 values compare like their bits.
+        maxFp16WeightOfCodes[code] = max(maxFp16WeightOfCodes[code], source.fp16Weights[id]);
+    }
+    for (WeightCode code : quantized.codes) quantized.codeFp16Weights.push_back(maxFp16WeightOfCodes[code]);
+    return quantized;
+}
+
+void checkPrediction(const NGramModel& model, const char* context, bool shouldFilterOffensiveWords, const vector<string>& expectedFirstResults) {
+    const vector<string> results = model.predict(context, shouldFilterOffensiveWords);
+    const vector<string> firstResults(results.begin(), results.begin() + min(results.size(), expectedFirstResults.size()));
+    if (firstResults != expectedFirstResults || (expectedFirstResults.empty() && !results.empty())) {
+        fail(string("predict(") + context + (shouldFilterOffensiveWords ? ", filtered" : "") + ") returned " + join(results) +
+             ", expected it to start with " + join(expectedFirstResults));
+    }
+}
+
+void checkKnownPredictions(const string& ngramFilePath) {
+    NGramModel model;
+    string error;
+    if (!model.open(ngramFilePath, error)) {
+        fail(error);
+        return;
+    }
+    if (model.maxN() != 6) fail("maxN is " + to_string(model.maxN()) + ", expected 6.");
+
+    checkPrediction(model, "你", true, { "哋", "老", "唔", "係" });
+    checkPrediction(model, "我哋", true, { "嘅", "都", "唔" });
+    checkPrediction(model, "唔該", true, { "你", "哂" });
+    checkPrediction(model, "香港", true, { "人", "的", "嘅" });
+    checkPrediction(model, "多謝", true, { "你", "巴", "巴打" });
+    // Longer than maxN - 1 chars, only the end of the context is searched.
+    checkPrediction(model, "食咗飯未", true, { "有", "來", "必" });
+    // Offensive completions are only suggested without filtering.
+    checkPrediction(model, "老", false, { "母", "豆", "婆" });
+    checkPrediction(model, "老", true, { "豆", "婆", "師" });
+    checkPrediction(model, "仆", false, { "街", "街死", "街仔" });
+    checkPrediction(model, "仆", true, {});
+    checkPrediction(model, "", true, {});
+
+    PredictStats stats;
+    if (model.predictPhrases("你", true, NGramModel::kDefaultNumOfPhraseSteps, NGramModel::kDefaultPhraseBeamWidth, &stats).empty() ||
+        stats.isArenaFull) {
+        fail("predictPhrases(你) returned nothing or ran out of arena.");
+    }
+    // A search too wide for the arena stops early with the phrases found so far.
+    if (model.predictPhrases("你", true, 6, 40, &stats).empty() || !stats.isArenaFull) {
+        fail("predictPhrases(你) with a beam width of 40 did not stop at the arena capacity.");
+    }
+
+    const vector<string_view> candidates = { "哋", "老", "xyz" };
+    const vector<float> scores = model.scoreContinuations("你", candidates);
+    if (!(scores[0] > scores[1] && scores[1] > -INFINITY && scores[2] == -INFINITY)) {
+        fail("scoreContinuations(你) ranks 哋, 老 and an unknown candidate wrongly.");
+    }
+}
+
+void checkOverlay(const string& ngramFilePath, const string& outputDirectory) {
+    NGramModel model;
+    NGramOverlay overlay;
+    string error;
+    const string overlayFilePath = outputDirectory + "/test.overlay";
+    remove(overlayFilePath.c_str());
+    if (!model.open(ngramFilePath, error) || !overlay.open(overlayFilePath, error)) {
+        fail(error);
+        return;
+    }
+    model.setOverlay(&overlay);
+
+    // 龘 has no completion in the ngram file. The session must still search it once the user types something after it.
+    NGramSession session(model);
+    session.reset("龘");
+    if (!session.predict(false).empty()) fail("NGramSession predicted completions of 龘 before learning any.");
+    overlay.record("龘", "你", model.maxN() - 1);
+    if (session.predict(false) != model.predict("龘", false) || model.predict("龘", false).empty()) {
+        fail("NGramSession did not predict what the overlay learned after 龘.");
+    }
+    // 龘你 is not in the ngram file, so it cannot be checked against the blocklist the offensive flags were built from.
+    if (model.predict("龘", true).empty() != model.hasOffensiveFlags()) {
+        fail("predict(龘, filtered) did not filter text learned by the overlay the same way as the ngram file's keys.");
+    }
+
+    model.setOverlay(nullptr);
+    overlay.close();
+    remove(overlayFilePath.c_str());
+}
+
+// Compaction keeps the pairs typed most within maxCompactedSizeInBytes and is not due again until the file doubles.
+void checkOverlayCompaction(const string& outputDirectory) {
+    NGramOverlay overlay;
+    string error;
+    const string overlayFilePath = outputDirectory + "/compaction.overlay";
+    remove(overlayFilePath.c_str());
+    if (!overlay.open(overlayFilePath, error)) {
+        fail(error);
+        return;
+    }
+    overlay.setCompactionThresholdInBytes(1024);
+    overlay.setMaxCompactedSizeInBytes(4096);
+
+    const uint32_t now = 1700000000;
+    for (int i = 0; i < 5; ++i) overlay.record("你", "哋", 1, now);
+    // 1600 pairs typed once, far more than fit in maxCompactedSizeInBytes.
+    const string_view chars = "一丁七万丈三上下不与丐丑专且世丘丙业丛东丝丞丢两严丧个中丰串临丸丹为主丽举乃久么义";
+    for (size_t i = 0; i < chars.length(); i = nextCodePointIndex(chars, i)) {
+        for (size_t j = 0; j < chars.length(); j = nextCodePointIndex(chars, j)) {
+            overlay.record(chars.substr(i, nextCodePointIndex(chars, i) - i), chars.substr(j, nextCodePointIndex(chars, j) - j), 1, now);
+        }
+    }
+    if (!overlay.needsCompaction() || !overlay.compact(error, now)) {
+        fail("Overlay compaction was not due or failed. " + error);
+        return;
+    }
+
+    Arena arena;
+    ArenaVector<NGramOverlayContinuation> continuations{ ArenaAllocator<NGramOverlayContinuation>(arena) };
+    float confidence;
+    if (overlay.fileSizeInBytes() > overlay.maxCompactedSizeInBytes() || overlay.needsCompaction() ||
+        !overlay.findContinuations("你", arena, continuations, confidence, now) || continuations.front().text != "哋") {
+        fail("Overlay compaction did not keep the most typed pairs within the size cap.");
+    }
+    const size_t compactedSize = overlay.fileSizeInBytes();
+    while (overlay.fileSizeInBytes() <= 2 * compactedSize) {
+        if (overlay.needsCompaction()) {
+            fail("Overlay compaction was due again before the file doubled.");
+            break;
+        }
+        overlay.record("龘", "你", 1, now);
+    }
+    if (!overlay.needsCompaction()) fail("Overlay compaction was not due after the file doubled.");
+
+    overlay.close();
+    remove(overlayFilePath.c_str());
+}
+
+// learn invalidates the cached predictions of the contexts ending with the last char it recorded, and only those.
+void checkPredictionCacheInvalidation() {
+    PredictionCache cache;
+    const vector<string> results = { "哋" };
+    for (const char* context : { "你", "我你", "你我", "我" }) {
+        cache.put(context, true, results, cache.generation());
+        cache.put(context, false, results, cache.generation());
+    }
+    const size_t generation = cache.generation();
+    cache.invalidateContextsEndingWith("你");
+    vector<string> cachedResults;
+    for (const char* context : { "你", "我你" }) {
+        if (cache.get(context, true, cachedResults) || cache.get(context, false, cachedResults)) {
+            fail(string("The cached predictions of ") + context + " were not invalidated.");
+        }
+    }
+    for (const char* context : { "你我", "我" }) {
+        if (!cache.get(context, true, cachedResults) || !cache.get(context, false, cachedResults)) {
+            fail(string("The cached predictions of ") + context + " were invalidated.");
+        }
+    }
+    cache.put("你", true, results, generation);
+    if (cache.get("你", true, cachedResults)) fail("Cached predictions computed before the invalidation.");
+}
+
+void checkCorruptFileIsRejected(const string& path, const char* description) {
+    NGramModel model;
+    string error;
+    if (model.open(path, error)) {
+        fail(string("Opened an ngram file with ") + description + ".");
+    } else if (error.empty()) {
+        fail(string("Rejected an ngram file with ") + description + " without an error.");
+    }
+    remove(path.c_str());
+}
+
+void checkCorruptFileIsRejected(const string& path, const string& fileData, const char* description) {
+    ofstream(path, ios::binary).write(fileData.data(), fileData.size());
+    checkCorruptFileIsRejected(path, description);
+}
+
+void checkCorruptFilesAreRejected(const SourceData& source, const string& outputDirectory) {
+    const string path = outputDirectory + "/corrupt.ngram";
+    const string& fileData = source.fileData;
+    auto withModifiedHeader = [&](size_t fileSize, auto modify) {
+        string modifiedFileData(fileData.substr(0, fileSize));
+        modify(*(NGramHeader*)&modifiedFileData[0]);
+        return modifiedFileData;
+    };
+
+    checkCorruptFileIsRejected(path, "", "no data");
+    checkCorruptFileIsRejected(path, fileData.substr(0, 20), "a truncated header");
+    checkCorruptFileIsRejected(path, fileData.substr(0, fileData.size() / 2), "a truncated section");
+    checkCorruptFileIsRejected(path, "NOTNGRAM" + fileData.substr(8), "a wrong magic header");
+    checkCorruptFileIsRejected(path, withModifiedHeader(fileData.size(), [](NGramHeader& header) { header.headerSizeInBytes = 4; }),
+                               "a header too small for its sections");
+    checkCorruptFileIsRejected(path, withModifiedHeader(200, [](NGramHeader& header) { header.headerSizeInBytes = 1000; }),
+                               "a header larger than the file");
+    checkCorruptFileIsRejected(path, withModifiedHeader(fileData.size(), [](NGramHeader& header) { header.maxN = 0; }), "maxN 0");
+    checkCorruptFileIsRejected(path, withModifiedHeader(fileData.size(), [](NGramHeader& header) { header.numOfEntries++; }),
+                               "more entries than keys");
+    checkCorruptFileIsRejected(path, withModifiedHeader(fileData.size(), [](NGramHeader& header) {
+        header.sections[NGramSectionId::weight].dataOffset = SIZE_MAX - 1;
+    }), "a section offset past the end of the file");
+    checkCorruptFileIsRejected(path, withModifiedHeader(fileData.size(), [](NGramHeader& header) {
+        header.sections[NGramSectionId::isWord].dataSizeInBytes = 1;
+    }), "a truncated isWord section");
+
+    Sections sections;
+    for (int i = 0; i <= NGramSectionId::isWord; ++i) sections[i] = source.section((NGramSectionId)i);
+    sections[NGramSectionId::topKIndex] = bytesOf(vector<NGramTopKEntry>({ { 0, 1, 1, 0 } }));
+    sections[NGramSectionId::topKKeyIds] = bytesOf(vector<uint32_t>({ 0 }));
+    if (writeNGramFile(path, NGramVersion::fp16Weights, source.header->maxN, source.header->numOfEntries, sections)) {
+        checkCorruptFileIsRejected(path, "a topK slice past the end of the topKKeyIds section");
+    }
+}
+
+// Contexts each layout pair is compared on: every single char key, which reads the precomputed completions and
+// the largest ranges, and a sample of longer keys.
+vector<string> comparisonContexts(const SourceData& source) {
+    vector<string> contexts;
+    for (size_t id = 0; id < source.keys.size(); ++id) {
+        if (countCodePoints(source.keys[id]) == 1 || id % 53 == 0) contexts.push_back(source.keys[id]);
+    }
+    return contexts;
+}
+
+// Checks that the two files predict the same. Weights decoded differently can differ slightly, so if
+// hasSameWeights is false, only the orders of the weights are compared, i.e. the predictions of longestSuffixFirst.
+void checkSamePredictions(const string& description, const string& ngramFilePath1, const string& ngramFilePath2,
+                          const vector<string>& contexts, bool hasSameWeights) {
+    NGramModel model1, model2;
+    string error;
+    if (!model1.open(ngramFilePath1, error) || !model2.open(ngramFilePath2, error)) {
+        fail(description + ": " + error);
+        return;
+    }
+
+    size_t numOfMismatches = 0;
+    string firstMismatch;
+    auto compare = [&](const string& context, const vector<string>& results1, const vector<string>& results2) {
+        if (results1 == results2) return;
+        if (numOfMismatches++ == 0) firstMismatch = context + ": " + join(results1) + " vs " + join(results2);
+    };
+
+    vector<ScoringMode> scoringModes = { ScoringMode::longestSuffixFirst };
+    if (hasSameWeights) scoringModes.push_back(ScoringMode::stupidBackoff);
+    for (ScoringMode scoringMode : scoringModes) {
+        model1.setScoringMode(scoringMode);
+        model2.setScoringMode(scoringMode);
+        for (const string& context : contexts) {
+            for (bool shouldFilterOffensiveWords : { true, false }) {
+                compare(context, model1.predict(context, shouldFilterOffensiveWords), model2.predict(context, shouldFilterOffensiveWords));
+            }
+        }
+    }
+    if (hasSameWeights) {
+        // Phrases run several searches each, a sample is enough.
+        for (size_t i = 0; i < contexts.size(); i += 16) {
+            compare(contexts[i], model1.predictPhrases(contexts[i], true), model2.predictPhrases(contexts[i], true));
+        }
+    }
+
+    cout << description << ": " << numOfMismatches << " mismatches\n";
+    if (numOfMismatches > 0) fail(description + " predicts differently, e.g. " + firstMismatch);
+}
+
+// Writes the optional sections with the functions NGramBuilder ships them with.
+void checkLayouts(const SourceData& source, const string& outputDirectory) {
+    const NGramHeader& header = *source.header;
+    const QuantizedWeights quantized = quantize(source);
+
+    Sections codeFp16Sections;
+    codeFp16Sections[NGramSectionId::trie] = source.section(NGramSectionId::trie);
+    codeFp16Sections[NGramSectionId::weight] = bytesOf(quantized.codeFp16Weights);
+    codeFp16Sections[NGramSectionId::isWord] = source.section(NGramSectionId::isWord);
+    auto pathOf = [&](const char* layoutName) { return outputDirectory + "/" + layoutName + ".ngram"; };
+    if (!writeNGramFile(pathOf("codeFp16"), NGramVersion::fp16Weights, header.maxN, header.numOfEntries, codeFp16Sections)) return;
+
+    const TopKSections topKSections = buildTopKSections(source.trie, quantized.decodedWeights, source.numOfCodePointsList, topKMaxPrefixLength, topKSize);
+    const vector<uint8_t> suffixWordMasks = buildSuffixWordMasks(source.trie, source.isWordList);
+    const vector<NGramKeyRecord> keyRecords = buildKeyRecords(quantized.codes, source.isWordList, source.isOffensiveList, source.numOfCodePointsList, suffixWordMasks);
+    const LexRangeSections lexRangeSections = buildLexRangeSections(source.trie, quantized.codes);
+    const TopKSections noTopKSections;
+    const KeyBitset noFlags;
+    const vector<uint8_t> noSuffixWordMasks;
+    const vector<NGramKeyRecord> noKeyRecords;
+    const LexRangeSections noLexRangeSections;
+
+    struct Layout {
+        const char* name;
+        const TopKSections& topKSections;
+        const KeyBitset& isOffensiveList;
+        const vector<uint8_t>& suffixWordMasks;
+        const vector<NGramKeyRecord>& keyRecords;
+        const LexRangeSections& lexRangeSections;
+    };
+    const Layout layouts[] = {
+        { "quantized", noTopKSections, noFlags, noSuffixWordMasks, noKeyRecords, noLexRangeSections },
+        { "topK", topKSections, noFlags, noSuffixWordMasks, noKeyRecords, noLexRangeSections },
+        { "suffixWordMask", noTopKSections, noFlags, suffixWordMasks, noKeyRecords, noLexRangeSections },
+        { "isOffensive", noTopKSections, source.isOffensiveList, noSuffixWordMasks, noKeyRecords, noLexRangeSections },
+        { "flaggedQuantized", noTopKSections, source.isOffensiveList, suffixWordMasks, noKeyRecords, noLexRangeSections },
+        { "keyRecord", noTopKSections, noFlags, noSuffixWordMasks, keyRecords, noLexRangeSections },
+        { "lexRange", noTopKSections, noFlags, noSuffixWordMasks, noKeyRecords, lexRangeSections },
+    };
+    ostringstream builderLog;
+    for (const Layout& layout : layouts) {
+        writeNGram(header.maxN, source.trie, quantized.codes, quantized.codebook, source.isWordList, layout.topKSections, layout.isOffensiveList,
+                   layout.suffixWordMasks, layout.keyRecords, layout.lexRangeSections, pathOf(layout.name), builderLog);
+    }
+
+    const vector<string> contexts = comparisonContexts(source);
+    checkSamePredictions("precomputed topK vs live search", pathOf("quantized"), pathOf("topK"), contexts, true);
+    checkSamePredictions("suffixWordMask vs suffix lookup", pathOf("quantized"), pathOf("suffixWordMask"), contexts, true);
+    checkSamePredictions("isOffensive flags vs offensive word list", pathOf("quantized"), pathOf("isOffensive"), contexts, true);
+    checkSamePredictions("fp16 vs quantized decoding", pathOf("codeFp16"), pathOf("quantized"), contexts, false);
+    checkSamePredictions("keyRecord vs separate sections", pathOf("flaggedQuantized"), pathOf("keyRecord"), contexts, true);
+    checkSamePredictions("lexRange vs trie walk", pathOf("quantized"), pathOf("lexRange"), contexts, true);
+    checkOverlay(pathOf("isOffensive"), outputDirectory);
+
+    remove(pathOf("codeFp16").c_str());
+    for (const Layout& layout : layouts) remove(pathOf(layout.name).c_str());
+}
+
+int main(int argc, const char * argv[]) {
+    const string ngramFilePath = argc > 1 ? argv[1] : DEFAULT_NGRAM_PATH;
+    const string outputDirectory = argc > 2 ? argv[2] : ".";
+
+    checkKnownPredictions(ngramFilePath);
+    checkOverlay(ngramFilePath, outputDirectory);
+    checkOverlayCompaction(outputDirectory);
+    checkPredictionCacheInvalidation();
+
+    SourceData source;
+    if (loadSourceData(ngramFilePath, source)) {
+        checkCorruptFilesAreRejected(source, outputDirectory);
+        checkLayouts(source, outputDirectory);
+    }
+
+    if (numOfFailures > 0) {
+        cerr << numOfFailures << " checks failed." << endl;
+        return 1;
+    }
+    cout << "All checks passed.\n";
+    return 0;
+}